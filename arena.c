@@ -0,0 +1,57 @@
+#include "arena.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGN __alignof__ (long double)
+
+typedef struct arena_chunk {
+    struct arena_chunk * next;
+    char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+} arena_chunk_t;
+
+
+void arena_init (arena_t * arena)
+{
+    arena->chunks = NULL;
+    arena->next = NULL;
+    arena->limit = NULL;
+}
+
+
+void arena_destroy (arena_t * arena)
+{
+    for (arena_chunk_t * c = arena->chunks; c;) {
+        arena_chunk_t * next = c->next;
+        free (c);
+        c = next;
+    }
+    arena_init (arena);
+}
+
+
+void * arena_alloc (arena_t * arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & -ARENA_ALIGN;
+
+    if (arena->limit - arena->next < (ptrdiff_t) size) {
+        // Oversize requests get a chunk of their own; put it behind the
+        // current chunk so that the remaining space there is not lost.
+        size_t bytes = size > ARENA_CHUNK_SIZE / 4 ? size : ARENA_CHUNK_SIZE;
+        arena_chunk_t * c = xmalloc (sizeof (arena_chunk_t) + bytes);
+        if (bytes != ARENA_CHUNK_SIZE && arena->chunks) {
+            c->next = arena->chunks->next;
+            arena->chunks->next = c;
+            return c->data;
+        }
+        c->next = arena->chunks;
+        arena->chunks = c;
+        arena->next = c->data;
+        arena->limit = c->data + bytes;
+    }
+
+    void * result = arena->next;
+    arena->next += size;
+    return result;
+}
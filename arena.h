@@ -0,0 +1,24 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/// A simple bump allocator.  Objects allocated from an arena are never freed
+/// individually; all memory is released at once by @ref arena_destroy.
+typedef struct arena {
+    struct arena_chunk * chunks;        ///< Most recent chunk first.
+    char * next;                        ///< Free space in current chunk.
+    char * limit;                       ///< End of current chunk.
+} arena_t;
+
+/// Initialise an empty arena.
+void arena_init (arena_t * arena);
+
+/// Free all memory owned by an arena.
+void arena_destroy (arena_t * arena);
+
+/// Allocate @c size bytes, suitably aligned for any type.
+void * arena_alloc (arena_t * arena, size_t size)
+    __attribute__ ((__malloc__, __warn_unused_result__));
+
+#endif
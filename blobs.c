@@ -0,0 +1,68 @@
+#include "blobs.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void blobs_init (blobs_t * b)
+{
+    b->sha = NULL;
+    b->count = 0;
+    b->max = 0;
+    b->index_size = 1024;
+    b->index = ARRAY_ALLOC (size_t, b->index_size);
+    memset (b->index, -1, b->index_size * sizeof (size_t));
+}
+
+
+void blobs_destroy (blobs_t * b)
+{
+    free (b->sha);
+    free (b->index);
+}
+
+
+static size_t blob_slot (const blobs_t * b, const unsigned char sha[20])
+{
+    // The object ids are uniformly distributed already.
+    uint64_t h;
+    memcpy (&h, sha, sizeof h);
+    return h & (b->index_size - 1);
+}
+
+
+size_t blobs_add (blobs_t * b, const unsigned char sha[20], bool * added)
+{
+    size_t mask = b->index_size - 1;
+    size_t slot = blob_slot (b, sha);
+    for (; b->index[slot] != SIZE_MAX; slot = (slot + 1) & mask)
+        if (memcmp (b->sha[b->index[slot]], sha, 20) == 0) {
+            *added = false;
+            return b->index[slot];
+        }
+
+    *added = true;
+    if (b->count == b->max) {
+        b->max = b->max ? b->max * 2 : 1024;
+        b->sha = xrealloc (b->sha, b->max * sizeof *b->sha);
+    }
+    memcpy (b->sha[b->count], sha, 20);
+    b->index[slot] = b->count;
+
+    if (++b->count * 2 > b->index_size) {
+        // Rehash.
+        b->index_size *= 2;
+        b->index = ARRAY_REALLOC (b->index, b->index_size);
+        memset (b->index, -1, b->index_size * sizeof (size_t));
+        mask = b->index_size - 1;
+        for (size_t i = 0; i != b->count; ++i) {
+            size_t s = blob_slot (b, b->sha[i]);
+            while (b->index[s] != SIZE_MAX)
+                s = (s + 1) & mask;
+            b->index[s] = i;
+        }
+    }
+
+    return b->count - 1;
+}
@@ -0,0 +1,26 @@
+#ifndef BLOBS_H
+#define BLOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// The distinct file contents we know of, by git object id.  Each is given a
+/// small index, which the versions with that content refer to.
+typedef struct blobs {
+    unsigned char (*sha)[20];           ///< The object id of each blob.
+    size_t count;
+    size_t max;
+
+    size_t * index;                     ///< Hash of blob indexes by sha.
+    size_t index_size;
+} blobs_t;
+
+void blobs_init (blobs_t * b);
+
+void blobs_destroy (blobs_t * b);
+
+/// Find the blob with object id @c sha, adding it if it is new; @c added is
+/// set accordingly.  Returns the index of the blob.
+size_t blobs_add (blobs_t * b, const unsigned char sha[20], bool * added);
+
+#endif
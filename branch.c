@@ -12,23 +12,29 @@
 //
 // Later, we want to further reduce the digraph to a tree.
 
-#include "bitset.h"
 #include "branch.h"
 #include "database.h"
 #include "emission.h"
 #include "file.h"
+#include "minhash.h"
+#include "parallel.h"
+#include "scc.h"
 #include "utils.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+fast_tags_t fast_tags;
 
-static int tag_compare (const void * AA, const void * BB)
+
+static void tag_heap_key (const void * context, const void * item,
+                          heap_entry_t * entry)
 {
-    const tag_t * A = AA;
-    const tag_t * B = BB;
-    return A > B;
+    const database_t * db = context;
+    entry->key = (const tag_t *) item - db->tags;
+    entry->tie = 0;
 }
 
 
@@ -54,59 +60,29 @@ static int compare_pb (const void * AA, const void * BB)
 }
 
 
-static parent_branch_t * unemitted_parent (tag_t * t)
+/// Remove the link from tag @c child to its parent branch @c pb.
+static void remove_parent (heap_t * heap, tag_t * child, parent_branch_t * pb)
 {
-    // FIXME - we should be more deterministic - i.e., the choice of parent
-    // should be more obviously related to external observables.
-    parent_branch_t * i = t->parents_end;
-    while (i != t->parents)
-        if (!(--i)->branch->is_released)
-            return i;
-    abort();
-}
-
-
-static void break_cycle (heap_t * heap, tag_t * t)
-{
-    // Find a cycle.
-    tag_t * slow = t;
-    tag_t * fast = t;
-    do {
-        slow = unemitted_parent (slow)->branch;
-        fast = unemitted_parent (unemitted_parent (fast)->branch)->branch;
-    }
-    while (slow != fast);
-
-    // Walk through the cycle again, finding the parent with the lowest weight.
-    tag_t * best = fast;
-    parent_branch_t * best_parent = unemitted_parent (best);
-    tag_t * i = best_parent->branch;
-    while (i != fast) {
-        parent_branch_t * i_parent = unemitted_parent (i);
-        if (compare_pb (i_parent, best_parent) > 0) {
-            best = i;
-            best_parent = i_parent;
-        }
-        i = i_parent->branch;
-    }
-
-    tag_t * parent = best_parent->branch;
+    tag_t * parent = pb->branch;
 
     fprintf (stderr, "Break branch cycle link %s child of %s weight %zu\n",
-             best->tag, parent->tag, best_parent->weight);
+             child->tag, parent->tag, pb->weight);
 
     // Remove the parent from the child.
-    memmove (best_parent, best_parent + 1,
-             sizeof (parent_branch_t) * (best->parents_end - best_parent - 1));
-    --best->parents_end;
-    if (--best->changeset.unready_count == 0)
-        heap_insert (heap, best);
+    memmove (pb, pb + 1,
+             sizeof (parent_branch_t) * (child->parents_end - pb - 1));
+    --child->parents_end;
+    if (--child->changeset.unready_count == 0) {
+        child->is_released = true;
+        heap_insert (heap, child);
+    }
 
     // Remove the child from the parent.
     for (branch_tag_t * i = parent->tags; i != parent->tags_end; ++i)
-        if (i->tag == best) {
+        if (i->tag == child) {
             memmove (i, i + 1,
                      sizeof (branch_tag_t) * (parent->tags_end - i - 1));
+            --parent->tags_end;
             return;
         }
 
@@ -114,6 +90,80 @@ static void break_cycle (heap_t * heap, tag_t * t)
 }
 
 
+/// All the remaining unreleased tags are blocked.  Find the strongly
+/// connected components of the graph of unreleased tags and their unreleased
+/// parents, and in each component containing a cycle, remove the link with the
+/// least weight.
+static void break_cycles (database_t * db, heap_t * heap)
+{
+    // Number the unreleased tags; use the ready_index as they are not on the
+    // heap.
+    tag_t ** nodes = NULL;
+    tag_t ** nodes_end = NULL;
+    for (tag_t * i = db->tags; i != db->tags_end; ++i)
+        if (!i->is_released) {
+            i->changeset.ready_index = nodes_end - nodes;
+            ARRAY_APPEND (nodes, i);
+        }
+
+    size_t num_nodes = nodes_end - nodes;
+    size_t * start = ARRAY_ALLOC (size_t, num_nodes + 1);
+    size_t * edges = NULL;
+    size_t * edges_end = NULL;
+    for (size_t i = 0; i != num_nodes; ++i) {
+        start[i] = edges_end - edges;
+        for (parent_branch_t * j = nodes[i]->parents;
+             j != nodes[i]->parents_end; ++j)
+            if (!j->branch->is_released)
+                ARRAY_APPEND (edges, j->branch->changeset.ready_index);
+    }
+    start[num_nodes] = edges_end - edges;
+
+    size_t * component = ARRAY_ALLOC (size_t, num_nodes);
+    size_t num_components = scc_find (num_nodes, start, edges, component);
+
+    // Find the lightest link within each component.  A link is within a
+    // component if both ends are in it, which also catches self-loops.
+    tag_t ** best = ARRAY_CALLOC (tag_t *, num_components);
+    parent_branch_t ** best_parent
+        = ARRAY_CALLOC (parent_branch_t *, num_components);
+    for (size_t i = 0; i != num_nodes; ++i)
+        for (parent_branch_t * j = nodes[i]->parents;
+             j != nodes[i]->parents_end; ++j) {
+            if (j->branch->is_released)
+                continue;
+            size_t c = component[i];
+            if (component[j->branch->changeset.ready_index] != c)
+                continue;
+            if (best[c] == NULL || compare_pb (j, best_parent[c]) > 0) {
+                best[c] = nodes[i];
+                best_parent[c] = j;
+            }
+        }
+
+    for (tag_t ** i = nodes; i != nodes_end; ++i)
+        (*i)->changeset.ready_index = SIZE_MAX;
+
+    // Each component has a distinct child, so removing one link does not
+    // disturb the others.
+    size_t removed = 0;
+    for (size_t c = 0; c != num_components; ++c)
+        if (best[c] != NULL) {
+            remove_parent (heap, best[c], best_parent[c]);
+            ++removed;
+        }
+
+    assert (removed != 0);
+
+    free (nodes);
+    free (start);
+    free (edges);
+    free (component);
+    free (best);
+    free (best_parent);
+}
+
+
 // Release all the child tags of a branch.
 static void tag_released (heap_t * heap, tag_t * tag,
                           tag_t *** tree_order, tag_t *** tree_order_end)
@@ -181,7 +231,8 @@ static void branch_graph (database_t * db,
     // Do a cycle breaking pass of the branches.
     heap_t heap;
 
-    heap_init (&heap, offsetof (tag_t, changeset.ready_index), tag_compare);
+    heap_init (&heap, offsetof (tag_t, changeset.ready_index),
+               tag_heap_key, db, NULL);
 
     // Release all the tags that are ready right now; also sort the parent
     // lists.
@@ -196,13 +247,12 @@ static void branch_graph (database_t * db,
     while (!heap_empty (&heap))
         tag_released (&heap, heap_pop (&heap), tree_order, tree_order_end);
 
-    for (tag_t * i = db->tags; i != db->tags_end; ++i)
-        while (!i->is_released) {
-            break_cycle (&heap, i);
-            while (!heap_empty (&heap))
-                tag_released (&heap, heap_pop (&heap),
-                              tree_order, tree_order_end);
-        }
+    while (*tree_order_end - *tree_order != db->tags_end - db->tags) {
+        break_cycles (db, &heap);
+        while (!heap_empty (&heap))
+            tag_released (&heap, heap_pop (&heap),
+                          tree_order, tree_order_end);
+    }
 
     heap_destroy (&heap);
 }
@@ -215,96 +265,566 @@ static bool better_than (tag_t * new, tag_t * old)
 }
 
 
-static void branch_tag_point (database_t * db, tag_t * branch, tag_t * tag)
+/// An entry in the inverted index from versions to the tags containing them.
+typedef struct tag_sweep_entry {
+    version_t * version;
+    size_t tag;                         ///< Index into the tags being placed.
+} tag_sweep_entry_t;
+
+
+/// The counters maintained while sweeping a branch to place its tags.
+typedef struct tag_sweep {
+    tag_sweep_entry_t * index;          ///< Sorted by version.
+    tag_sweep_entry_t * index_end;
+    ssize_t * hit;                      ///< Per tag, files matching the tag.
+    ssize_t * present;                  ///< Per tag, live files in the tag.
+    bool * dirty;                       ///< Per tag, counts have changed.
+    size_t * dirty_list;
+    size_t * dirty_list_end;
+} tag_sweep_t;
+
+
+static int compare_tag_sweep_entry (const void * AA, const void * BB)
+{
+    const tag_sweep_entry_t * A = AA;
+    const tag_sweep_entry_t * B = BB;
+    if (A->version != B->version)
+        return A->version > B->version ? 1 : -1;
+    if (A->tag != B->tag)
+        return A->tag > B->tag ? 1 : -1;
+    return 0;
+}
+
+
+/// Adjust @c counter by @c delta for each tag containing a version in the
+/// range [@c begin, @c end), marking those tags dirty.
+static void tag_sweep_adjust (tag_sweep_t * s, ssize_t * counter,
+                              const version_t * begin, const version_t * end,
+                              ssize_t delta)
+{
+    tag_sweep_entry_t * base = s->index;
+    size_t count = s->index_end - s->index;
+    while (count > 0) {
+        size_t mid = count >> 1;
+        if (base[mid].version < begin) {
+            base += mid + 1;
+            count -= mid + 1;
+        }
+        else
+            count = mid;
+    }
+
+    for (; base != s->index_end && base->version < end; ++base) {
+        counter[base->tag] += delta;
+        if (!s->dirty[base->tag]) {
+            s->dirty[base->tag] = true;
+            *s->dirty_list_end++ = base->tag;
+        }
+    }
+}
+
+
+/// The Zobrist key of a version: a pseudo-random value, distinct for each
+/// version.  The hash of a set of versions is the xor of their keys.
+static uint64_t zobrist_key (const database_t * db, const version_t * v)
 {
-    bitset_t hit;
-    bitset_init (&hit, db->files_end - db->files);
-    bitset_t extra;
-    bitset_init (&extra, db->files_end - db->files);
+    uint64_t x = ((uint64_t) (v->file - db->files) << 32)
+        + (v - v->file->versions) + 0x9e3779b97f4a7c15ull;
+    // The splitmix64 finaliser; this is a bijection, so keys are distinct,
+    // and the offset above stops the first version having a zero key.
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+
+/// Find the slot for @c hash in an open addressed table of branch states.
+static size_t state_slot (const uint64_t * slot_hash,
+                          changeset_t * const * slot_cs, size_t num_slots,
+                          uint64_t hash)
+{
+    size_t slot = hash & (num_slots - 1);
+    while (slot_cs[slot] != NULL && slot_hash[slot] != hash)
+        slot = (slot + 1) & (num_slots - 1);
+    return slot;
+}
+
+
+/// Place the tags which exactly match some state of @c branch.  An exact
+/// match is the best possible score, so the first such changeset is where
+/// the scoring sweep would put the tag.  We keep a Zobrist hash of the live
+/// versions as the changesets on the branch are applied, and look each tag up
+/// in a hash table of the states.  The unplaced tags are moved to the front
+/// of @c tags, and their number is returned.
+static size_t branch_exact_tags (database_t * db, tag_t * branch,
+                                 tag_t ** tags, size_t num_tags)
+{
+    size_t num_states = 1;
+    for (changeset_t ** i = branch->changeset.children;
+         i != branch->changeset.children_end; ++i)
+        if ((*i)->type != ct_tag)
+            ++num_states;
+
+    size_t num_slots = 1;
+    while (num_slots < 2 * num_states)
+        num_slots *= 2;
+    uint64_t * slot_hash = ARRAY_ALLOC (uint64_t, num_slots);
+    changeset_t ** slot_cs = ARRAY_CALLOC (changeset_t *, num_slots);
+
+    size_t num_files = db->files_end - db->files;
+    version_t ** current = ARRAY_CALLOC (version_t *, num_files);
+    uint64_t hash = 0;
+    for (version_t ** i = branch->tag_files; i != branch->tag_files_end; ++i)
+        if (current[(*i)->file - db->files] == NULL) {
+            current[(*i)->file - db->files] = *i;
+            hash ^= zobrist_key (db, *i);
+        }
+
+    // Record the first changeset with each state.
+    size_t slot = state_slot (slot_hash, slot_cs, num_slots, hash);
+    slot_hash[slot] = hash;
+    slot_cs[slot] = &branch->changeset;
+
+    for (changeset_t ** i = branch->changeset.children;
+         i != branch->changeset.children_end; ++i) {
+        changeset_t * cs = *i;
+        if (cs->type == ct_tag)
+            continue;
+        for (version_t ** j = cs->versions; j != cs->versions_end; ++j) {
+            if (!(*j)->used)
+                continue;
+            version_t * v = (*j)->dead ? NULL : version_normalise (*j);
+            version_t ** c = &current[(*j)->file - db->files];
+            if (*c != v) {
+                if (*c)
+                    hash ^= zobrist_key (db, *c);
+                if (v)
+                    hash ^= zobrist_key (db, v);
+                *c = v;
+            }
+        }
+
+        slot = state_slot (slot_hash, slot_cs, num_slots, hash);
+        if (slot_cs[slot] == NULL) {
+            slot_hash[slot] = hash;
+            slot_cs[slot] = cs;
+        }
+    }
+
+    size_t remaining = 0;
+    for (size_t t = 0; t != num_tags; ++t) {
+        hash = 0;
+        for (version_t ** j = tags[t]->tag_files;
+             j != tags[t]->tag_files_end; ++j)
+            hash ^= zobrist_key (db, *j);
+
+        slot = state_slot (slot_hash, slot_cs, num_slots, hash);
+        if (slot_cs[slot] != NULL)
+            tags[t]->parent = slot_cs[slot];
+        else
+            tags[remaining++] = tags[t];
+    }
+
+    free (slot_hash);
+    free (slot_cs);
+    free (current);
+    return remaining;
+}
+
+
+/// Score the placement of @c tags on each changeset of @c branch.  Rather
+/// than walking the branch once per tag, we sweep the branch once, keeping the
+/// counts for all the tags up to date via an inverted index from versions to
+/// tags.
+static void branch_sweep_tags (database_t * db, tag_t * branch,
+                               tag_t ** tags, size_t num_tags)
+{
+    tag_sweep_t s;
+    s.index = NULL;
+    s.index_end = NULL;
+    for (size_t t = 0; t != num_tags; ++t)
+        for (version_t ** i = tags[t]->tag_files;
+             i != tags[t]->tag_files_end; ++i) {
+            assert (!(*i)->implicit_merge);
+            ARRAY_EXTEND (s.index);
+            s.index_end[-1].version = *i;
+            s.index_end[-1].tag = t;
+        }
+    ARRAY_SORT (s.index, compare_tag_sweep_entry);
+
+    s.hit = ARRAY_CALLOC (ssize_t, num_tags);
+    s.present = ARRAY_CALLOC (ssize_t, num_tags);
+    s.dirty = ARRAY_CALLOC (bool, num_tags);
+    s.dirty_list = ARRAY_ALLOC (size_t, num_tags);
+    s.dirty_list_end = s.dirty_list;
+
+    // For each file, the version on the branch that the tags are matched
+    // against, and whether the file is live on the branch.
+    size_t num_files = db->files_end - db->files;
+    version_t ** current = ARRAY_CALLOC (version_t *, num_files);
+    bool * live = ARRAY_CALLOC (bool, num_files);
+    ssize_t num_live = 0;
 
-    version_t ** ii = tag->tag_files;
     for (version_t ** i = branch->tag_files; i != branch->tag_files_end; ++i) {
-        for (; ii != tag->tag_files_end && (*ii)->file < (*i)->file; ++ii);
-
-        if (ii == tag->tag_files_end || (*ii)->file > (*i)->file)
-            // Wrong file - counts as extra.
-            bitset_set (&extra, (*i)->file - db->files);
-        else if (*ii == *i)
-            // Hit.
-            bitset_set (&hit, (*i)->file - db->files);
+        file_t * f = (*i)->file;
+        if (live[f - db->files])
+            continue;
+        live[f - db->files] = true;
+        ++num_live;
+        current[f - db->files] = *i;
+        tag_sweep_adjust (&s, s.present, f->versions, f->versions_end, 1);
+        tag_sweep_adjust (&s, s.hit, *i, *i + 1, 1);
     }
 
-    changeset_t * best_cs = &branch->changeset;
-    ssize_t best_hit = hit.count;
-    ssize_t best_extra = extra.count;
+    changeset_t ** best_cs = ARRAY_ALLOC (changeset_t *, num_tags);
+    ssize_t * best_hit = ARRAY_ALLOC (ssize_t, num_tags);
+    ssize_t * best_extra = ARRAY_ALLOC (ssize_t, num_tags);
+    for (size_t t = 0; t != num_tags; ++t) {
+        best_cs[t] = &branch->changeset;
+        best_hit[t] = s.hit[t];
+        best_extra[t] = num_live - s.present[t];
+        s.dirty[t] = false;
+    }
+    s.dirty_list_end = s.dirty_list;
 
     for (changeset_t ** i = branch->changeset.children;
          i != branch->changeset.children_end; ++i) {
         changeset_t * cs = *i;
         if (cs->type == ct_tag)
             continue;                   // Ignore child tags.
+        ssize_t previous_live = num_live;
         for (version_t ** j = cs->versions; j != cs->versions_end; ++j) {
             if (!(*j)->used)
                 continue;
-            if ((*j)->dead) {
-                // Branch deletion.
-                bitset_reset (&hit, (*j)->file - db->files);
-                bitset_reset (&extra, (*j)->file - db->files);
-                continue;
+            file_t * f = (*j)->file;
+            // A dead version is a branch deletion, and matches nothing.
+            version_t * v = (*j)->dead ? NULL : version_normalise (*j);
+            if (live[f - db->files] != (v != NULL)) {
+                live[f - db->files] = v != NULL;
+                num_live += v ? 1 : -1;
+                tag_sweep_adjust (&s, s.present, f->versions, f->versions_end,
+                                  v ? 1 : -1);
+            }
+            version_t * old = current[f - db->files];
+            if (old != v) {
+                if (old)
+                    tag_sweep_adjust (&s, s.hit, old, old + 1, -1);
+                if (v)
+                    tag_sweep_adjust (&s, s.hit, v, v + 1, 1);
+                current[f - db->files] = v;
             }
-            version_t * ft = find_file_tag ((*j)->file, tag);
-            assert (ft == NULL || !ft->implicit_merge);
-            if (ft == NULL)
-                bitset_set (&extra, (*j)->file - db->files);
-            else if (version_normalise (*j) == ft)
-                bitset_set (&hit, (*j)->file - db->files);
-            else
-                bitset_reset (&hit, (*j)->file - db->files);
         }
-        if (hit.count > best_hit
-            || (hit.count == best_hit && extra.count < best_extra)) {
-            best_hit = hit.count;
-            best_extra = extra.count;
-            best_cs = cs;
+
+        // A tag whose counts are unchanged can only have become better if
+        // the number of live files has dropped.  Otherwise, we need only look
+        // at the dirty tags.
+        if (num_live < previous_live)
+            for (size_t t = 0; t != num_tags; ++t)
+                if (!s.dirty[t])
+                    *s.dirty_list_end++ = t;
+
+        for (size_t * t = s.dirty_list; t != s.dirty_list_end; ++t) {
+            ssize_t extra = num_live - s.present[*t];
+            if (s.hit[*t] > best_hit[*t]
+                || (s.hit[*t] == best_hit[*t] && extra < best_extra[*t])) {
+                best_hit[*t] = s.hit[*t];
+                best_extra[*t] = extra;
+                best_cs[*t] = cs;
+            }
+            s.dirty[*t] = false;
         }
+        s.dirty_list_end = s.dirty_list;
     }
 
-    tag->parent = best_cs;
-    ARRAY_APPEND (best_cs->children, &tag->changeset);
+    // The caller adds the tags to the children, so that this can run on
+    // several branches at once.
+    for (size_t t = 0; t != num_tags; ++t)
+        tags[t]->parent = best_cs[t];
 
-    bitset_destroy (&hit);
-    bitset_destroy (&extra);
+    free (s.index);
+    free (s.hit);
+    free (s.present);
+    free (s.dirty);
+    free (s.dirty_list);
+    free (current);
+    free (live);
+    free (best_cs);
+    free (best_hit);
+    free (best_extra);
 }
 
 
-/// Choose which branch to put a tag on.  We choose the branch with the largest
-/// number of tag versions.
-static void branch_choose (tag_t * tag)
+/// Number of sampled states of a branch, with --fast-tags.
+#define FAST_TAG_SAMPLES 64
+
+/// Number of candidate parents or samples scored exactly, with --fast-tags.
+#define FAST_TAG_CANDIDATES 4
+
+
+/// The MinHash signature of the versions of @c tag.
+static void tag_signature (const database_t * db, const tag_t * tag,
+                           minhash_t * sig)
+{
+    minhash_init (sig);
+    for (version_t ** i = tag->tag_files; i != tag->tag_files_end; ++i)
+        minhash_add (sig, zobrist_key (db, *i));
+}
+
+
+/// Approximate placement of @c tags on @c branch, for --fast-tags.  We take
+/// evenly spaced samples of the states of the branch, and use MinHash
+/// signatures to pick, for each tag, the few samples most similar to the tag.
+/// Each tag is then scored exactly, but only on the states from those samples
+/// up to the next ones.
+static void branch_fast_tags (database_t * db, tag_t * branch,
+                              tag_t ** tags, size_t num_tags)
+{
+    // The states: the branch itself, and then each commit on it.
+    changeset_t ** states = NULL;
+    changeset_t ** states_end = NULL;
+    ARRAY_APPEND (states, &branch->changeset);
+    for (changeset_t ** i = branch->changeset.children;
+         i != branch->changeset.children_end; ++i)
+        if ((*i)->type != ct_tag)
+            ARRAY_APPEND (states, *i);
+
+    size_t num_states = states_end - states;
+    size_t stride = (num_states + FAST_TAG_SAMPLES - 1) / FAST_TAG_SAMPLES;
+    size_t num_samples = (num_states + stride - 1) / stride;
+
+    size_t num_files = db->files_end - db->files;
+    version_t ** current = ARRAY_CALLOC (version_t *, num_files);
+    for (version_t ** i = branch->tag_files; i != branch->tag_files_end; ++i)
+        if (current[(*i)->file - db->files] == NULL)
+            current[(*i)->file - db->files] = *i;
+
+    minhash_t * samples = ARRAY_ALLOC (minhash_t, num_samples);
+    for (size_t s = 0; s != num_states; ++s) {
+        if (s != 0)
+            for (version_t ** j = states[s]->versions;
+                 j != states[s]->versions_end; ++j)
+                if ((*j)->used)
+                    current[(*j)->file - db->files]
+                        = (*j)->dead ? NULL : version_normalise (*j);
+
+        if (s % stride == 0) {
+            minhash_init (&samples[s / stride]);
+            for (size_t f = 0; f != num_files; ++f)
+                if (current[f])
+                    minhash_add (&samples[s / stride],
+                                 zobrist_key (db, current[f]));
+        }
+    }
+
+    // Pick the candidate samples for each tag, and list the tags against
+    // each sample.
+    size_t * start = ARRAY_CALLOC (size_t, num_samples + 1);
+    size_t * chosen = ARRAY_ALLOC (size_t, num_tags * FAST_TAG_CANDIDATES);
+    double * similarity = ARRAY_ALLOC (double, num_samples);
+    for (size_t t = 0; t != num_tags; ++t) {
+        minhash_t sig;
+        tag_signature (db, tags[t], &sig);
+        for (size_t w = 0; w != num_samples; ++w)
+            similarity[w] = minhash_jaccard (&sig, &samples[w]);
+
+        for (size_t c = 0; c != FAST_TAG_CANDIDATES; ++c) {
+            size_t best = SIZE_MAX;
+            for (size_t w = 0; w != num_samples; ++w)
+                if (similarity[w] >= 0
+                    && (best == SIZE_MAX || similarity[w] > similarity[best]))
+                    best = w;
+            chosen[t * FAST_TAG_CANDIDATES + c] = best;
+            if (best != SIZE_MAX) {
+                similarity[best] = -1;
+                ++start[best + 1];
+            }
+        }
+    }
+
+    for (size_t w = 0; w != num_samples; ++w)
+        start[w + 1] += start[w];
+    size_t * candidates = ARRAY_ALLOC (size_t, start[num_samples]);
+    size_t * fill = ARRAY_ALLOC (size_t, num_samples);
+    memcpy (fill, start, num_samples * sizeof (size_t));
+    for (size_t t = 0; t != num_tags; ++t)
+        for (size_t c = 0; c != FAST_TAG_CANDIDATES; ++c)
+            if (chosen[t * FAST_TAG_CANDIDATES + c] != SIZE_MAX)
+                candidates[fill[chosen[t * FAST_TAG_CANDIDATES + c]]++] = t;
+
+    // Now sweep the branch again, scoring each tag on its candidate samples.
+    ssize_t * hit = ARRAY_ALLOC (ssize_t, num_tags);
+    ssize_t * present = ARRAY_ALLOC (ssize_t, num_tags);
+    changeset_t ** best_cs = ARRAY_CALLOC (changeset_t *, num_tags);
+    ssize_t * best_hit = ARRAY_ALLOC (ssize_t, num_tags);
+    ssize_t * best_extra = ARRAY_ALLOC (ssize_t, num_tags);
+
+    memset (current, 0, num_files * sizeof (version_t *));
+    ssize_t num_live = 0;
+    for (version_t ** i = branch->tag_files; i != branch->tag_files_end; ++i)
+        if (current[(*i)->file - db->files] == NULL) {
+            current[(*i)->file - db->files] = *i;
+            ++num_live;
+        }
+
+    for (size_t s = 0; s != num_states; ++s) {
+        size_t w = s / stride;
+        size_t * active = candidates + start[w];
+        size_t * active_end = candidates + start[w + 1];
+
+        if (s != 0)
+            for (version_t ** j = states[s]->versions;
+                 j != states[s]->versions_end; ++j) {
+                if (!(*j)->used)
+                    continue;
+                version_t * v = (*j)->dead ? NULL : version_normalise (*j);
+                version_t ** c = &current[(*j)->file - db->files];
+                if (*c == v)
+                    continue;
+                num_live += (v != NULL) - (*c != NULL);
+                if (s % stride != 0)
+                    for (size_t * t = active; t != active_end; ++t) {
+                        version_t * ft = find_file_tag ((*j)->file, tags[*t]);
+                        if (ft == NULL)
+                            continue;
+                        present[*t] += (v != NULL) - (*c != NULL);
+                        hit[*t] += (v == ft) - (*c == ft);
+                    }
+                *c = v;
+            }
+
+        if (s % stride == 0)
+            // Start scoring the candidates of this sample.
+            for (size_t * t = active; t != active_end; ++t) {
+                hit[*t] = 0;
+                present[*t] = 0;
+                for (version_t ** i = tags[*t]->tag_files;
+                     i != tags[*t]->tag_files_end; ++i) {
+                    version_t * c = current[(*i)->file - db->files];
+                    hit[*t] += c == *i;
+                    present[*t] += c != NULL;
+                }
+            }
+
+        for (size_t * t = active; t != active_end; ++t) {
+            ssize_t extra = num_live - present[*t];
+            if (best_cs[*t] == NULL || hit[*t] > best_hit[*t]
+                || (hit[*t] == best_hit[*t] && extra < best_extra[*t])) {
+                best_hit[*t] = hit[*t];
+                best_extra[*t] = extra;
+                best_cs[*t] = states[s];
+            }
+        }
+    }
+
+    for (size_t t = 0; t != num_tags; ++t) {
+        assert (best_cs[t] != NULL);
+        tags[t]->parent = best_cs[t];
+    }
+
+    free (states);
+    free (current);
+    free (samples);
+    free (start);
+    free (chosen);
+    free (similarity);
+    free (candidates);
+    free (fill);
+    free (hit);
+    free (present);
+    free (best_cs);
+    free (best_hit);
+    free (best_extra);
+}
+
+
+/// Choose the changeset on which to place each of the @c tags on @c branch.
+/// For each tag, we take the changeset with the most files matching the tag,
+/// and then the fewest live files not in the tag.  Tags with an exact match
+/// are found by hashing, and the rest are scored by a sweep of the branch, or
+/// approximately with --fast-tags.  With --fast-tags=check, return the number
+/// of tags where the approximate placement differs from the sweep.
+static size_t branch_tag_points (database_t * db, tag_t * branch,
+                                 tag_t ** tags, size_t num_tags)
+{
+    num_tags = branch_exact_tags (db, branch, tags, num_tags);
+    if (num_tags == 0)
+        return 0;
+
+    if (fast_tags == fast_tags_off) {
+        branch_sweep_tags (db, branch, tags, num_tags);
+        return 0;
+    }
+
+    branch_fast_tags (db, branch, tags, num_tags);
+    if (fast_tags != fast_tags_check)
+        return 0;
+
+    changeset_t ** fast = ARRAY_ALLOC (changeset_t *, num_tags);
+    for (size_t t = 0; t != num_tags; ++t)
+        fast[t] = tags[t]->parent;
+
+    branch_sweep_tags (db, branch, tags, num_tags);
+
+    size_t differ = 0;
+    for (size_t t = 0; t != num_tags; ++t) {
+        if (tags[t]->parent != fast[t])
+            ++differ;
+        tags[t]->parent = fast[t];
+    }
+    free (fast);
+    return differ;
+}
+
+
+/// The weight of placing @c tag on @c branch: one more than the number of tag
+/// versions on the branch.
+static size_t parent_weight (const tag_t * tag, const tag_t * branch)
+{
+    size_t weight = 1;
+
+    version_t ** jj = branch->tag_files;
+    for (version_t ** j = tag->tag_files; j != tag->tag_files_end; ++j) {
+        while (jj != branch->tag_files_end && (*jj)->file < (*j)->file)
+            ++jj;
+
+        version_t * tv = version_normalise (*j);
+        version_t * bv = NULL;
+        if (jj != branch->tag_files_end && (*jj)->file == (*j)->file)
+            bv = version_normalise (*jj++);
+
+        // We count the branch if (a) the tag version is on the branch for
+        // this file, (b) the tag version is the branch point, (c) the
+        // tag version is an implicit merge and the branch we are
+        // considering is the trunk.
+        if (tv->branch == branch || tv == bv
+            || (branch->tag[0] == 0 && tv + 1 != tv->file->versions_end
+                && tv[1].implicit_merge && tv[1].used))
+            ++weight;
+    }
+
+    return weight;
+}
+
+
+/// The state shared by the branch choices for all the tags.
+typedef struct tag_choice {
+    database_t * db;
+    minhash_t * signature;              ///< Per branch, with --fast-tags.
+    size_t * size;                      ///< Per branch, with --fast-tags.
+    size_t differ;                      ///< With --fast-tags=check.
+} tag_choice_t;
+
+
+/// Choose the parent branch of @c tag with the largest weight, considering
+/// only the parents flagged in @c candidate, or all parents if it is NULL.
+static tag_t * choose_parent (tag_t * tag, const bool * candidate)
 {
     size_t best_weight = 0;
     tag_t * best_branch = NULL;
     for (parent_branch_t * i = tag->parents; i != tag->parents_end; ++i) {
-        size_t weight = 1;
-
-        version_t ** jj = i->branch->tag_files;
-        for (version_t ** j = tag->tag_files; j != tag->tag_files_end; ++j) {
-            while (jj != i->branch->tag_files_end && (*jj)->file < (*j)->file)
-                ++jj;
-
-            version_t * tv = version_normalise (*j);
-            version_t * bv = NULL;
-            if (jj != i->branch->tag_files_end && (*jj)->file == (*j)->file)
-                bv = version_normalise (*jj++);
-
-            // We count the branch if (a) the tag version is on the branch for
-            // this file, (b) the tag version is the branch point, (c) the
-            // tag version is an implicit merge and the branch we are
-            // considering is the trunk.
-            if (tv->branch == i->branch || tv == bv
-                || (i->branch->tag[0] == 0 && tv + 1 != tv->file->versions_end
-                    && tv[1].implicit_merge && tv[1].used))
-                ++weight;
-        }
+        if (candidate && !candidate[i - tag->parents])
+            continue;
+        size_t weight = parent_weight (tag, i->branch);
         if (weight > best_weight
             || (weight == best_weight
                 && better_than (i->branch, best_branch))) {
@@ -312,32 +832,142 @@ static void branch_choose (tag_t * tag)
             best_branch = i->branch;
         }
     }
-    if (best_branch) {
-        fprintf (stderr, "Tag '%s' placing on branch '%s'\n",
-                 tag->tag, best_branch->tag);
-        tag->parent = &best_branch->changeset;
+    return best_branch;
+}
+
+
+/// With --fast-tags, flag the parents of @c tag with the largest overlap with
+/// the tag, as estimated from MinHash signatures.
+static void fast_parent_candidates (const tag_choice_t * choice,
+                                    const tag_t * tag, bool * candidate)
+{
+    minhash_t sig;
+    tag_signature (choice->db, tag, &sig);
+
+    size_t num_parents = tag->parents_end - tag->parents;
+    double * overlap = ARRAY_ALLOC (double, num_parents);
+    for (size_t i = 0; i != num_parents; ++i) {
+        size_t b = tag->parents[i].branch - choice->db->tags;
+        double j = minhash_jaccard (&sig, &choice->signature[b]);
+        overlap[i] = j * (choice->size[b] + (tag->tag_files_end
+                                             - tag->tag_files)) / (1 + j);
+        candidate[i] = false;
+    }
+
+    for (int c = 0; c != FAST_TAG_CANDIDATES; ++c) {
+        size_t best = SIZE_MAX;
+        for (size_t i = 0; i != num_parents; ++i)
+            if (!candidate[i] && (best == SIZE_MAX || overlap[i] > overlap[best]))
+                best = i;
+        if (best == SIZE_MAX)
+            break;
+        candidate[best] = true;
+    }
+
+    free (overlap);
+}
+
+
+/// Choose which branch to put a tag on.  We choose the branch with the largest
+/// number of tag versions.  With --fast-tags, we only weigh the few parents
+/// that look most similar to the tag.  Return true if this was not the exact
+/// choice, with --fast-tags=check.
+static bool branch_choose (const tag_choice_t * choice, tag_t * tag)
+{
+    size_t num_parents = tag->parents_end - tag->parents;
+    tag_t * best_branch;
+    bool differ = false;
+    if (fast_tags == fast_tags_off || num_parents <= FAST_TAG_CANDIDATES)
+        best_branch = choose_parent (tag, NULL);
+    else {
+        bool * candidate = ARRAY_ALLOC (bool, num_parents);
+        fast_parent_candidates (choice, tag, candidate);
+        best_branch = choose_parent (tag, candidate);
+        if (fast_tags == fast_tags_check)
+            differ = best_branch != choose_parent (tag, NULL);
+        free (candidate);
     }
-    else
-        tag->parent = NULL;
+
+    tag->parent = best_branch ? &best_branch->changeset : NULL;
     xfree (tag->parents);
     tag->parents = NULL;
     tag->parents_end = NULL;
     xfree (tag->tags);
     tag->tags = NULL;
     tag->tags_end = NULL;
+    return differ;
 }
 
 
-static void branch_changesets (database_t * db)
+static void choose_branches (void * p, size_t begin, size_t end)
 {
-    // Do a pass through the changesets, assigning changesets to their branches.
-    // This will place the changesets in emission order.
-    prepare_for_emission (db, NULL);
+    tag_choice_t * choice = p;
+    size_t differ = 0;
+    for (tag_t * i = choice->db->tags + begin;
+         i != choice->db->tags + end; ++i)
+        differ += branch_choose (choice, i);
+
+    __sync_fetch_and_add (&choice->differ, differ);
+}
 
-    changeset_t * cs;
-    while ((cs = next_changeset (db))) {
+
+/// With --fast-tags, compute the MinHash signature of the versions on each
+/// branch, including its branch point.
+static void branch_signatures (tag_choice_t * choice)
+{
+    database_t * db = choice->db;
+    size_t num_tags = db->tags_end - db->tags;
+    choice->signature = ARRAY_ALLOC (minhash_t, num_tags);
+    choice->size = ARRAY_CALLOC (size_t, num_tags);
+    for (tag_t * i = db->tags; i != db->tags_end; ++i) {
+        minhash_init (&choice->signature[i - db->tags]);
+        if (i->branch_versions)
+            for (version_t ** j = i->tag_files; j != i->tag_files_end; ++j) {
+                minhash_add (&choice->signature[i - db->tags],
+                             zobrist_key (db, *j));
+                ++choice->size[i - db->tags];
+            }
+    }
+
+    for (file_t * f = db->files; f != db->files_end; ++f)
+        for (version_t * v = f->versions; v != f->versions_end; ++v)
+            if (v->branch && !v->dead && !v->implicit_merge) {
+                minhash_add (&choice->signature[v->branch - db->tags],
+                             zobrist_key (db, v));
+                ++choice->size[v->branch - db->tags];
+            }
+}
+
+
+/// The tags grouped by the branch they are placed on.
+typedef struct tag_points {
+    database_t * db;
+    size_t * start;                     ///< Per branch, offset into placed.
+    tag_t ** placed;
+    size_t differ;                      ///< With --fast-tags=check.
+} tag_points_t;
+
+
+static void place_tags (void * p, size_t i)
+{
+    tag_points_t * tp = p;
+    if (tp->start[i] != tp->start[i + 1])
+        __sync_fetch_and_add (
+            &tp->differ,
+            branch_tag_points (tp->db, &tp->db->tags[i],
+                               tp->placed + tp->start[i],
+                               tp->start[i + 1] - tp->start[i]));
+}
+
+
+static void branch_changesets (database_t * db)
+{
+    // Go through the changesets in emission order, assigning changesets to
+    // their branches.
+    assert (db->changesets_ordered);
+    for (changeset_t ** i = db->changesets; i != db->changesets_end; ++i) {
+        changeset_t * cs = *i;
         assert (cs->type == ct_commit);
-        changeset_emitted (db, NULL, cs);
         changeset_update_branch_versions (db, cs);
         tag_t * branch = cs->versions[0]->branch;
         ARRAY_APPEND (branch->changeset.children, cs);
@@ -354,14 +984,52 @@ void branch_analyse (database_t * db)
 
     branch_graph (db, &tree_order, &tree_order_end);
 
-    // Choose the branch on which to place each tag.
+    // Choose the branch on which to place each tag.  The choices are
+    // independent, so run them in parallel, and report afterwards.
+    tag_choice_t choice = { db, NULL, NULL, 0 };
+    if (fast_tags != fast_tags_off)
+        branch_signatures (&choice);
+    parallel_for (db->tags_end - db->tags, choose_branches, &choice);
+    for (tag_t * i = db->tags; i != db->tags_end; ++i)
+        if (i->parent)
+            fprintf (stderr, "Tag '%s' placing on branch '%s'\n",
+                     i->tag, as_tag (i->parent)->tag);
+
+    // Choose the changeset on which to place each tag.  Group the tags by
+    // branch, keeping them in order, so that each branch is swept once.
+    size_t num_tags = db->tags_end - db->tags;
+    size_t * start = ARRAY_CALLOC (size_t, num_tags + 1);
     for (tag_t * i = db->tags; i != db->tags_end; ++i)
-        branch_choose (i);
+        if (i->parent)
+            ++start[as_tag (i->parent) - db->tags + 1];
+    for (size_t i = 0; i != num_tags; ++i)
+        start[i + 1] += start[i];
+    tag_t ** placed = ARRAY_ALLOC (tag_t *, start[num_tags]);
+    size_t * fill = ARRAY_ALLOC (size_t, num_tags);
+    memcpy (fill, start, num_tags * sizeof (size_t));
+    for (tag_t * i = db->tags; i != db->tags_end; ++i)
+        if (i->parent)
+            placed[fill[as_tag (i->parent) - db->tags]++] = i;
 
-    // Choose the changeset on which to place each tag.
+    // The branches are independent; sweep them in parallel.  Then add the
+    // tags to the children of the chosen changesets in a fixed order.
+    tag_points_t tp = { db, start, placed, 0 };
+    parallel_each (num_tags, place_tags, &tp);
     for (tag_t * i = db->tags; i != db->tags_end; ++i)
         if (i->parent)
-            branch_tag_point (db, as_tag (i->parent), i);
+            ARRAY_APPEND (i->parent->children, &i->changeset);
+
+    if (fast_tags == fast_tags_check)
+        fprintf (stderr, "Fast tags: %zu branch choices and %zu tag points "
+                 "of %zu tags differ from exact placement.\n",
+                 choice.differ, tp.differ, start[num_tags]);
+
+    free (choice.signature);
+    free (choice.size);
+
+    free (start);
+    free (placed);
+    free (fill);
 
     // Set the timestamps on the tags.
     for (tag_t ** i = tree_order; i != tree_order_end; ++i)
@@ -20,6 +20,16 @@ typedef struct parent_branch {
 } parent_branch_t;
 
 
+/// How to place tags; set by --fast-tags.
+typedef enum fast_tags {
+    fast_tags_off,                      ///< Exact placement.
+    fast_tags_on,                       ///< Approximate placement.
+    fast_tags_check,                    ///< Approximate, and compare to exact.
+} fast_tags_t;
+
+extern fast_tags_t fast_tags;
+
+
 void branch_analyse (struct database * db);
 
 #endif
@@ -2,6 +2,7 @@
 #include "database.h"
 #include "emission.h"
 #include "file.h"
+#include "parallel.h"
 #include "string_cache.h"
 #include "utils.h"
 
@@ -16,6 +17,8 @@ int fuzz_gap = 300;
 void changeset_init (changeset_t * cs)
 {
     cs->ready_index = SIZE_MAX;
+    cs->order = 0;
+    cs->string_rank = 0;
     cs->mark = 0;
     cs->unready_count = 0;
     cs->children = NULL;
@@ -37,7 +40,9 @@ static bool strings_match (const version_t * A, const version_t * B)
 }
 
 
-static int version_compare (const version_t * A, version_t * B)
+/// Order versions by the strings which identify their changeset.  Versions
+/// for which @ref strings_match is true compare equal.
+static int version_compare_strings (const version_t * A, const version_t * B)
 {
     int r = cache_strcmp (A->commitid, B->commitid);
     if (r != 0)
@@ -59,9 +64,15 @@ static int version_compare (const version_t * A, version_t * B)
     if (Alh != Blh)
         return Alh < Blh ? -1 : 1;
 
-    r = cache_strcmp (A->log, B->log);
-    if (r != 0)
-        return r;
+    return cache_strcmp (A->log, B->log);
+}
+
+
+/// Order versions within a group by time.
+static int version_compare_time (const void * AA, const void * BB)
+{
+    const version_t * A = * (version_t * const *) AA;
+    const version_t * B = * (version_t * const *) BB;
 
     if (A->time != B->time)
         return A->time < B->time ? -1 : 1;
@@ -76,10 +87,13 @@ static int version_compare (const version_t * A, version_t * B)
 }
 
 
-static int version_compare_qsort (const void * AA, const void * BB)
+static void version_heap_key (const void * context, const void * item,
+                              heap_entry_t * entry)
 {
-    return version_compare (* (version_t * const *) AA,
-                            * (version_t * const *) BB);
+    const database_t * db = context;
+    const version_t * v = item;
+    entry->key = heap_time_key (v->time);
+    entry->tie = v->file - db->files;
 }
 
 
@@ -87,29 +101,190 @@ static int version_compare_heap (const void * AA, const void * BB)
 {
     const version_t * A = AA;
     const version_t * B = BB;
-    if (A->time != B->time)
-        return A->time > B->time;
+    int r = strcmp (A->version, B->version);
+    if (r != 0)
+        return r;
+
+    return A > B;
+}
+
+
+static void sort_changeset_versions (void * p, size_t begin, size_t end)
+{
+    changeset_t ** changesets = p;
+    for (changeset_t ** i = changesets + begin; i != changesets + end; ++i)
+        ARRAY_RADIX_SORT ((*i)->versions, version_file_key);
+}
+
+
+/// A group of versions with matching strings; see @ref strings_match.
+typedef struct version_group {
+    const version_t * key;              ///< First version seen in the group.
+    size_t count;                       ///< Number of versions in the group.
+    size_t start;                       ///< Start of group in version list.
+} version_group_t;
 
-    if (A->file != B->file)
-        return A->file > B->file;
 
-    return strcmp (A->version, B->version);
+static int compare_version_group (const void * AA, const void * BB)
+{
+    const version_group_t * A = AA;
+    const version_group_t * B = BB;
+    return version_compare_strings (A->key, B->key);
+}
+
+
+/// Hash the strings identifying a version's changeset.  The strings are all
+/// cached, so we can use the pointers and stored hashes.  When the server
+/// gives us a commitid, that identifies the commit on its own.
+static unsigned long version_group_hash (const version_t * v)
+{
+    unsigned long h = string_hash_get (v->commitid);
+    if (*v->commitid == 0) {
+        h = h * 31 + string_hash_get (v->author);
+        h = h * 31 + string_hash_get (v->log);
+        h = h * 31 + (unsigned long) v->branch / sizeof (tag_t);
+    }
+    h = h * 31 + v->implicit_merge;
+    return h ^ h >> 17;
 }
 
 
-static int compare_version_by_file (const void * AA, const void * BB)
+typedef struct sort_groups_context {
+    version_t ** version_list;
+    const version_group_t * groups;
+} sort_groups_context_t;
+
+
+static void sort_groups (void * p, size_t begin, size_t end)
 {
-    const version_t * const * A = AA;
-    const version_t * const * B = BB;
+    sort_groups_context_t * c = p;
+    for (const version_group_t * i = c->groups + begin;
+         i != c->groups + end; ++i)
+        if (i->count > 1)
+            qsort (c->version_list + i->start - i->count, i->count,
+                   sizeof (version_t *), version_compare_time);
+}
+
+
+/// Return all the versions in the database, grouped by changeset strings, and
+/// sorted by time within each group.  The groups are ordered by
+/// @ref version_compare_strings.  Rather than sorting every version with the
+/// full comparator, we bucket the versions with a hash table, order just the
+/// buckets, and then sort each bucket by time.
+static version_t ** cluster_versions (database_t * db, size_t total_versions)
+{
+    size_t num_slots = 16;
+    while (num_slots < total_versions * 2)
+        num_slots *= 2;
+
+    // Open addressing; slots hold group index plus one, zero is empty.
+    size_t * slots = ARRAY_CALLOC (size_t, num_slots);
+    size_t * group_of = ARRAY_ALLOC (size_t, total_versions);
+    version_group_t * groups = NULL;
+    version_group_t * groups_end = NULL;
+
+    size_t n = 0;
+    for (file_t * i = db->files; i != db->files_end; ++i)
+        for (version_t * j = i->versions; j != i->versions_end; ++j, ++n) {
+            size_t slot = version_group_hash (j) & (num_slots - 1);
+            while (slots[slot] != 0
+                   && !strings_match (groups[slots[slot] - 1].key, j))
+                slot = (slot + 1) & (num_slots - 1);
+
+            if (slots[slot] == 0) {
+                ARRAY_EXTEND (groups);
+                groups_end[-1].key = j;
+                groups_end[-1].count = 0;
+                slots[slot] = groups_end - groups;
+            }
+
+            group_of[n] = slots[slot] - 1;
+            ++groups[slots[slot] - 1].count;
+        }
+
+    assert (n == total_versions);
+    free (slots);
+
+    // Order the groups, and then lay them out.  The start field temporarily
+    // holds the original group index, so that we can map old to new.
+    size_t num_groups = groups_end - groups;
+    size_t * position = ARRAY_ALLOC (size_t, num_groups);
+    for (size_t i = 0; i != num_groups; ++i)
+        groups[i].start = i;
+
+    ARRAY_SORT (groups, compare_version_group);
+
+    size_t start = 0;
+    for (size_t i = 0; i != num_groups; ++i) {
+        position[groups[i].start] = i;
+        groups[i].start = start;
+        start += groups[i].count;
+    }
+
+    version_t ** version_list = ARRAY_ALLOC (version_t *, total_versions);
+    n = 0;
+    for (file_t * i = db->files; i != db->files_end; ++i)
+        for (version_t * j = i->versions; j != i->versions_end; ++j, ++n)
+            version_list[groups[position[group_of[n]]].start++] = j;
+
+    // Each start is now the end of its group.
+    sort_groups_context_t c = { version_list, groups };
+    parallel_for (num_groups, sort_groups, &c);
+
+    free (position);
+    free (group_of);
+    free (groups);
+
+    return version_list;
+}
+
+
+static int compare_changeset_strings (const void * AA, const void * BB)
+{
+    const version_t * A = (* (changeset_t * const *) AA)->versions[0];
+    const version_t * B = (* (changeset_t * const *) BB)->versions[0];
+
+    int r = cache_strcmp (A->author, B->author);
+    if (r != 0)
+        return r;
+
+    r = cache_strcmp (A->commitid, B->commitid);
+    if (r != 0)
+        return r;
+
+    r = cache_strcmp (A->log, B->log);
+    if (r != 0)
+        return r;
+
+    if (A->branch->tag != B->branch->tag)
+        return A->branch->tag < B->branch->tag ? -1 : 1;
 
-    if ((*A)->file < (*B)->file)
-        return -1;
-    if ((*A)->file > (*B)->file)
-        return 1;
     return 0;
 }
 
 
+/// Set the string ranks of the changesets, so that the emission order does
+/// not need string compares.
+static void rank_changesets (database_t * db)
+{
+    size_t count = db->changesets_end - db->changesets;
+    changeset_t ** sorted = ARRAY_ALLOC (changeset_t *, count);
+    memcpy (sorted, db->changesets, count * sizeof (changeset_t *));
+    parallel_sort (sorted, count, sizeof (changeset_t *),
+                   compare_changeset_strings);
+
+    unsigned rank = 0;
+    for (size_t i = 0; i != count; ++i) {
+        if (i != 0 && compare_changeset_strings (&sorted[i - 1],
+                                                 &sorted[i]) != 0)
+            ++rank;
+        sorted[i]->string_rank = rank;
+    }
+
+    free (sorted);
+}
+
+
 void create_changesets (database_t * db)
 {
     size_t total_versions = 0;
@@ -120,20 +295,15 @@ void create_changesets (database_t * db)
     if (total_versions == 0)
         return;
 
-    version_t ** version_list = ARRAY_ALLOC (version_t *, total_versions);
-    version_t ** vp = version_list;
-
-    for (file_t * i = db->files; i != db->files_end; ++i)
-        for (version_t * j = i->versions; j != i->versions_end; ++j)
-            *vp++ = j;
-
-    assert (vp == version_list + total_versions);
+    // The version list is kept in the database; each commit changeset's
+    // versions are a span of it.
+    version_t ** version_list = cluster_versions (db, total_versions);
 
-    qsort (version_list, total_versions, sizeof (version_t *),
-           version_compare_qsort);
+    db->version_list = version_list;
+    db->version_list_end = version_list + total_versions;
 
     changeset_t * current = database_new_changeset (db);
-    ARRAY_APPEND (current->versions, version_list[0]);
+    current->versions = version_list;
     version_list[0]->commit = current;
     current->time = version_list[0]->time;
     current->type = ct_commit;
@@ -141,23 +311,24 @@ void create_changesets (database_t * db)
         version_t * next = version_list[i];
         if (!strings_match (*current->versions, next)
             || next->time - current->time > fuzz_span
-            || next->time - current->versions_end[-1]->time > fuzz_gap) {
-            ARRAY_TRIM (current->versions);
+            || next->time - version_list[i - 1]->time > fuzz_gap) {
+            current->versions_end = version_list + i;
             current = database_new_changeset (db);
+            current->versions = version_list + i;
             current->time = next->time;
             current->type = ct_commit;
         }
-        ARRAY_APPEND (current->versions, version_list[i]);
-        version_list[i]->commit = current;
+        next->commit = current;
     }
 
-    ARRAY_TRIM (current->versions);
-    free (version_list);
+    current->versions_end = version_list + total_versions;
+
+    rank_changesets (db);
 
     // Do a pass through the changesets; this breaks any cycles.
     heap_t ready_versions;
-    heap_init (&ready_versions,
-               offsetof (version_t, ready_index), version_compare_heap);
+    heap_init (&ready_versions, offsetof (version_t, ready_index),
+               version_heap_key, db, version_compare_heap);
 
     prepare_for_emission (db, &ready_versions);
     size_t emitted_changesets = 0;
@@ -168,12 +339,31 @@ void create_changesets (database_t * db)
     }
 
     // Sort the changeset version lists by file.
-    for (changeset_t ** i = db->changesets; i != db->changesets_end; ++i)
-        ARRAY_SORT ((*i)->versions, compare_version_by_file);
+    parallel_for (db->changesets_end - db->changesets,
+                  sort_changeset_versions, db->changesets);
 
     assert (heap_empty (&ready_versions));
     assert (heap_empty (&db->ready_changesets));
     assert (emitted_changesets == db->changesets_end - db->changesets);
 
     heap_destroy (&ready_versions);
+
+    // The pass above emits a changeset split from a cycle only once nothing
+    // else can be emitted, which may be long after its time.  So now the
+    // cycles are broken, do another pass to find the emission order.  This is
+    // stored and reused by the later passes, instead of re-running the heap.
+    prepare_for_emission (db, NULL);
+    changeset_t ** order = NULL;
+    changeset_t ** order_end = NULL;
+    while ((changeset = next_changeset (db))) {
+        changeset_emitted (db, NULL, changeset);
+        changeset->order = order_end - order;
+        ARRAY_APPEND (order, changeset);
+    }
+
+    assert (order_end - order == db->changesets_end - db->changesets);
+    free (db->changesets);
+    db->changesets = order;
+    db->changesets_end = order_end;
+    db->changesets_ordered = true;
 }
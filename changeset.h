@@ -26,6 +26,14 @@ struct changeset {
     size_t unready_count;
 
     size_t ready_index;                 ///< Index into emission heap.
+
+    /// Position of a commit in the emission order, once that is fixed.
+    size_t order;
+
+    /// Rank of the author, commitid, log and branch of a commit amongst all
+    /// commits.  This orders the emission heap without string compares.
+    unsigned string_rank;
+
     long mark;                          ///< Mark number for fast-import.
 
     struct version ** versions;         ///< List of versions for a commit.
@@ -1,13 +1,20 @@
 #include "cvs_connection.h"
+#include "blobs.h"
 #include "branch.h"
 #include "changeset.h"
 #include "database.h"
 #include "emission.h"
+#include "entries.h"
 #include "file.h"
 #include "filter.h"
 #include "fixup.h"
+#include "import.h"
 #include "log.h"
 #include "log_parse.h"
+#include "output.h"
+#include "pack.h"
+#include "parallel.h"
+#include "sha1.h"
 #include "string_cache.h"
 #include "utils.h"
 
@@ -17,15 +24,31 @@
 #include <getopt.h>
 #include <limits.h>
 #include <pipeline.h>
+#include <regex.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 
 enum {
     opt_fuzz_span = 256,
     opt_fuzz_gap,
+    opt_threads,
+    opt_fast_tags,
+    opt_pack,
+    opt_prefetch,
+    opt_rlog_connections,
+    opt_rlog_file,
+    opt_save_rlog,
+    opt_include_tags,
+    opt_exclude_tags,
+    opt_include_branches,
+    opt_exclude_branches,
+    opt_path,
+    opt_exclude_path,
+    opt_since,
 };
 
 static const struct option opts[] = {
@@ -42,31 +65,67 @@ static const struct option opts[] = {
     { "version-cache", required_argument, NULL, 'c' },
     { "fuzz-span",     required_argument, NULL, opt_fuzz_span },
     { "fuzz-gap",      required_argument, NULL, opt_fuzz_gap },
+    { "threads",       required_argument, NULL, opt_threads },
+    { "fast-tags",     optional_argument, NULL, opt_fast_tags },
+    { "pack",          no_argument,       NULL, opt_pack },
+    { "prefetch",      no_argument,       NULL, opt_prefetch },
+    { "rlog-connections", required_argument, NULL, opt_rlog_connections },
+    { "rlog-file",     required_argument, NULL, opt_rlog_file },
+    { "save-rlog",     required_argument, NULL, opt_save_rlog },
+    { "include-tags",  required_argument, NULL, opt_include_tags },
+    { "exclude-tags",  required_argument, NULL, opt_exclude_tags },
+    { "include-branches", required_argument, NULL, opt_include_branches },
+    { "exclude-branches", required_argument, NULL, opt_exclude_branches },
+    { "path",          required_argument, NULL, opt_path },
+    { "exclude-path",  required_argument, NULL, opt_exclude_path },
+    { "since",         required_argument, NULL, opt_since },
     { NULL, 0, NULL, 0 }
 };
 
 static unsigned long zlevel;
+static unsigned long rlog_connections = 1;
 static const char * branch_prefix;
+static const char * cvs_module;
+static const char * cvs_root;
 static const char * entries_name;
+static entries_t entries;
 static const char * filter_command;
 static const char * git_dir;
 static const char * master = "master";
 static const char * output_path;
+static const char * rlog_file;
+static const char * save_rlog;
 static const char * remote = "";
 static const char * tag_prefix;
 static const char * version_cache_path;
 
 static bool force;
+static bool pack;
+static bool prefetch;
 
 static long mark_counter;
-static long cached_marks;
+
+/// The file contents; those from the version cache come first.
+static blobs_t blobs;
+static size_t cached_blobs;
+static size_t duplicate_blobs;
+static size_t unchanged_blobs;
+
+/// Number of version requests sent before waiting for the replies, when
+/// prefetching.
+#define PREFETCH_BATCH 64
+
+/// The least number of versions worth fetching as a tag or branch snapshot.
+#define PLAN_MIN_VERSIONS 2
 
 // FIXME - assumes signed time_t!
 #define TIME_MIN (sizeof (time_t) == sizeof (int) ? INT_MIN : LONG_MIN)
 #define TIME_MAX (sizeof (time_t) == sizeof (int) ? INT_MAX : LONG_MAX)
 
-static void print_fixups (FILE * out, const database_t * db,
-                          version_t ** base_versions,
+/// With --since, the history before this time is left out.
+static time_t since = TIME_MIN;
+
+static void print_fixups (FILE * out, const database_t * db, tag_t * base,
                           tag_t * tag, const changeset_t * cs,
                           cvs_connection_t * s);
 
@@ -166,11 +225,23 @@ static void read_version (FILE * out,
         fatal ("cvs checkout %s %s - got unexpected file length '%s'\n",
                version->version, version->file->path, s->line);
 
-    if (version->mark == SIZE_MAX) {
-        version->mark = ++mark_counter;
-        fprintf (out, "blob\nmark :%zu\ndata %lu\n", version->mark, len);
-        cvs_read_block (s, out, len);
-        fprintf (out, "\n");
+    if (version->blob == SIZE_MAX) {
+        // Identical content is only sent once; the commits refer to blobs by
+        // their object id.
+        char * data = xmalloc (len);
+        cvs_read_data (s, data, len);
+        unsigned char sha[20];
+        pack_hash (pack_blob, data, len, sha);
+        bool added;
+        version->blob = blobs_add (&blobs, sha, &added);
+        if (added) {
+            fprintf (out, "blob\ndata %lu\n", len);
+            fwrite (data, 1, len, out);
+            fprintf (out, "\n");
+        }
+        else
+            ++duplicate_blobs;
+        xfree (data);
     }
     else {
         warning ("cvs checkout %s %s - version is duplicate\n", path, vers);
@@ -202,19 +273,60 @@ static void read_versions (FILE * out,
 }
 
 
-static void grab_version (FILE * out, const database_t * db,
-                          cvs_connection_t * s, version_t * version)
+static void open_connection (cvs_connection_t * s,
+                             const char * root, const char * module)
+{
+    connect_to_cvs (s, root);
+
+    if (zlevel != 0)
+        cvs_connection_compress (s, zlevel);
+
+    s->module = xstrdup (module);
+    s->prefix = xasprintf ("%s/%s/", s->remote_root, s->module);
+}
+
+
+/// When the log was read from a file, connect to the server for the first
+/// request.
+static void ensure_connected (cvs_connection_t * s)
+{
+    if (s->socket < 0)
+        open_connection (s, cvs_root, cvs_module);
+}
+
+
+/// Will @c v get the content of its parent, instead of being downloaded?
+static bool version_unchanged (const version_t * v)
 {
-    if (version == NULL || version->mark != SIZE_MAX)
+    return v->unchanged && version_live (v->parent) != NULL;
+}
+
+
+/// If @c v is unchanged from its parent, and we have that, share its content.
+static void version_inherit (version_t * v)
+{
+    if (v->blob != SIZE_MAX || !version_unchanged (v))
         return;
 
+    const version_t * p = version_live (v->parent);
+    if (p->blob != SIZE_MAX) {
+        v->blob = p->blob;
+        v->exec = p->exec;
+        ++unchanged_blobs;
+    }
+}
+
+
+/// Send the request for a single version, without waiting for the reply.
+/// Unless @c directory is false, tell the server about the file's directory.
+static void request_version (cvs_connection_t * s, const version_t * version,
+                             bool directory, bool flush)
+{
+    ensure_connected (s);
+
     const char * path = version->file->path;
     const char * slash = strrchr (path, '/');
-    // Make sure we have the directory.
-    if (slash != NULL
-        && (version->parent == NULL
-            || version->parent->mark == SIZE_MAX
-            || version->parent->mark <= cached_marks))
+    if (directory && slash != NULL)
         cvs_printf (s, "Directory %s/%.*s\n" "%s%.*s\n",
                     s->module, (int) (slash - path), path,
                     s->prefix, (int) (slash - path), path);
@@ -224,21 +336,86 @@ static void grab_version (FILE * out, const database_t * db,
                 "Directory %s\n%.*s\n", s->module,
                 (int) strlen (s->prefix) - 1, s->prefix);
 
-    cvs_printff (s,
-                 "Argument -kk\n"
-                 "Argument -r%s\n"
-                 "Argument --\n"
-                 "Argument %s\nupdate\n",
-                 version->version, version->file->path);
+    (flush ? cvs_printff : cvs_printf) (s,
+                                        "Argument -kk\n"
+                                        "Argument -r%s\n"
+                                        "Argument --\n"
+                                        "Argument %s\nupdate\n",
+                                        version->version, path);
+}
+
+
+static void grab_version (FILE * out, const database_t * db,
+                          cvs_connection_t * s, version_t * version)
+{
+    if (version == NULL || version->blob != SIZE_MAX)
+        return;
+
+    // Make sure we have the directory.
+    request_version (s, version,
+                     version->parent == NULL
+                     || version->parent->blob == SIZE_MAX
+                     || version->parent->blob < cached_blobs, true);
 
     read_versions (out, db, s);
 
-    if (version->mark == SIZE_MAX)
+    if (version->blob == SIZE_MAX)
         fatal ("cvs checkout - failed to get %s %s\n",
                version->file->path, version->version);
 }
 
 
+static void prefetch_batch (FILE * out, const database_t * db,
+                            cvs_connection_t * s,
+                            version_t ** batch, size_t count)
+{
+    for (size_t i = 0; i != count; ++i)
+        request_version (s, batch[i], true, i + 1 == count);
+
+    for (size_t i = 0; i != count; ++i)
+        read_versions (out, db, s);
+
+    for (size_t i = 0; i != count; ++i)
+        if (batch[i]->blob == SIZE_MAX)
+            fatal ("cvs checkout - failed to get %s %s\n",
+                   batch[i]->file->path, batch[i]->version);
+}
+
+
+/// Fetch every version not already cached, before emitting any commits.  We
+/// go file by file, in revision order, so that the server reads each ,v file
+/// in one go, and consecutive blobs are similar.  Requests are sent in batches
+/// without waiting for each reply, to save round trips.
+static void prefetch_versions (FILE * out, const database_t * db,
+                               cvs_connection_t * s)
+{
+    version_t * batch[PREFETCH_BATCH];
+    size_t count = 0;
+    size_t total = 0;
+    for (file_t * f = db->files; f != db->files_end; ++f)
+        for (version_t * v = f->versions; v != f->versions_end; ++v) {
+            // Implicit merges may go unused, and unchanged versions will
+            // share content; leave them to emission.  Versions before the
+            // --since date are mostly not needed.
+            if (v->dead || v->implicit_merge || v->blob != SIZE_MAX
+                || version_unchanged (v) || v->time < since)
+                continue;
+
+            batch[count++] = v;
+            if (count == PREFETCH_BATCH) {
+                prefetch_batch (out, db, s, batch, count);
+                total += count;
+                count = 0;
+            }
+        }
+
+    prefetch_batch (out, db, s, batch, count);
+    total += count;
+
+    fprintf (stderr, "Prefetched %zu versions.\n", total);
+}
+
+
 static void grab_by_option (FILE * out,
                             const database_t * db,
                             cvs_connection_t * s,
@@ -246,6 +423,8 @@ static void grab_by_option (FILE * out,
                             const char * D_arg,
                             version_t ** fetch, version_t ** fetch_end)
 {
+    ensure_connected (s);
+
     // Build an array of the paths that we're getting.  FIXME - if changeset
     // versions were sorted we wouldn't need this.
     const char ** paths = NULL;
@@ -253,7 +432,7 @@ static void grab_by_option (FILE * out,
 
     for (version_t ** i = fetch; i != fetch_end; ++i) {
         version_t * v = version_live (*i);
-        assert (v && v->used && v->mark == SIZE_MAX);
+        assert (v && v->used && v->blob == SIZE_MAX);
         ARRAY_APPEND (paths, v->file->path);
     }
 
@@ -352,89 +531,107 @@ static void grab_versions (FILE * out, const database_t * db,
                         fetch, fetch_end);
 
         for (version_t ** i = fetch; i != fetch_end; ++i)
-            if ((*i)->mark == SIZE_MAX)
+            if ((*i)->blob == SIZE_MAX)
                 fprintf (stderr, "Missed first time round: %s %s\n",
                          (*i)->file->path, (*i)->version);
     }
 
     for (version_t ** i = fetch; i != fetch_end; ++i)
-        if ((*i)->mark == SIZE_MAX)
+        if ((*i)->blob == SIZE_MAX)
             grab_version (out, db, s, *i);
 }
 
 
-static bool same_directory (const char * A, const char * B)
-{
-    const char * sA = strrchr (A, '/');
-    const char * sB = strrchr (B, '/');
-    if (sA == NULL)
-        return sB == NULL;
-    return sB != NULL  &&  sA - A == sB - B  &&  memcmp (A, B, sA - A) == 0;
-}
+/// A tag or branch that could fetch many versions in one transaction.
+typedef struct snapshot {
+    tag_t * tag;
+    version_t ** versions;              ///< The versions a fetch would get.
+    version_t ** versions_end;
+    size_t wanted;                      ///< At least the number not fetched.
+} snapshot_t;
 
 
-static int path_dirlen (const char * p)
+/// Find the head of @c branch for a file, given its branch point @c v.
+static version_t * branch_head (version_t * v, const tag_t * branch)
 {
-    const char * s = strrchr (p, '/');
-    if (s == NULL)
-        return 0;
-    else
-        return s - p + 1;
-}
-
+    for (version_t * c = v->children; c != NULL; )
+        if (c->branch == branch) {
+            v = c;
+            c = v->children;
+        }
+        else
+            c = c->sibling;
 
-static const char * path_filename (const char * p)
-{
-    const char * s = strrchr (p, '/');
-    if (s == NULL)
-        return p;
-    else
-        return s + 1;
+    return v;
 }
 
 
-static const char * output_entries_list (FILE * out,
-                                         const database_t * db,
-                                         version_t * const * vv,
-                                         const file_t * f,
-                                         const char * last_path)
+/// Before emitting, get as many versions as we can by updating to whole tags
+/// and branch heads.  We pick greedily, each time the snapshot that gets the
+/// most versions not yet fetched.  The counts only go down, so a stale count
+/// is an upper bound, and we only need to re-count the best.
+static void plan_fetches (FILE * out, const database_t * db,
+                          cvs_connection_t * s)
 {
-    if (entries_name == NULL || *entries_name == 0)
-        return last_path;
-
-    if (last_path != NULL && same_directory (last_path, f->path))
-        return last_path;
-
-    // Find the range of files in the same directory.
-    bool directory_is_live = false;
-    const file_t * start = f;
-    while (start != db->files && same_directory (start[-1].path, f->path)) {
-        --start;
-        directory_is_live = directory_is_live
-            || version_live (vv[start - db->files]);
-    }
-    const file_t * end = f;
-    do {
-        directory_is_live = directory_is_live
-            || version_live (vv[end - db->files]);
-        ++end;
+    snapshot_t * snapshots = NULL;
+    snapshot_t * snapshots_end = NULL;
+    for (tag_t * t = db->tags; t != db->tags_end; ++t) {
+        // Tags released already are before the --since date, and left out.
+        if (t->dummy || t->tag[0] == 0
+            || (t->is_released && t->branch_versions == NULL))
+            continue;
+
+        ARRAY_EXTEND (snapshots);
+        snapshot_t * sn = &snapshots_end[-1];
+        sn->tag = t;
+        sn->versions = NULL;
+        sn->versions_end = NULL;
+        for (version_t ** i = t->tag_files; i != t->tag_files_end; ++i) {
+            version_t * v = version_live (t->branch_versions
+                                          ? branch_head (*i, t) : *i);
+            if (v != NULL && v->used && v->blob == SIZE_MAX
+                && !version_unchanged (v))
+                ARRAY_APPEND (sn->versions, v);
+        }
+        sn->wanted = sn->versions_end - sn->versions;
     }
-    while (end != db->files_end && same_directory (end->path, f->path));
 
-    if (!directory_is_live) {
-        fprintf (out, "D %.*s%s\n",
-                 path_dirlen (f->path), f->path, entries_name);
-        return f->path;
+    size_t transactions = 0;
+    size_t fetched = 0;
+    while (true) {
+        snapshot_t * best = NULL;
+        for (snapshot_t * i = snapshots; i != snapshots_end; ++i)
+            if (best == NULL || i->wanted > best->wanted)
+                best = i;
+
+        if (best == NULL || best->wanted < PLAN_MIN_VERSIONS)
+            break;
+
+        version_t ** fetch = NULL;
+        version_t ** fetch_end = NULL;
+        for (version_t ** i = best->versions; i != best->versions_end; ++i)
+            if ((*i)->blob == SIZE_MAX)
+                ARRAY_APPEND (fetch, *i);
+
+        size_t wanted = fetch_end - fetch;
+        if (wanted < best->wanted)
+            // Stale; look again.
+            best->wanted = wanted;
+        else {
+            grab_by_option (out, db, s, best->tag->tag, NULL, fetch, fetch_end);
+            best->wanted = 0;
+            ++transactions;
+            fetched += wanted;
+        }
+        xfree (fetch);
     }
-    fprintf (out, "M 644 inline %.*s%s\n",
-             path_dirlen (f->path), f->path, entries_name);
-    fprintf (out, "data <<EOF\n");
-    for (const file_t * f = start; f != end; ++f)
-        if (version_live (vv[f - db->files]))
-            fprintf (out, "%s %s\n",
-                     vv[f - db->files]->version, path_filename (f->path));
-    fprintf (out, "EOF\n");
-    return f->path;
+
+    for (snapshot_t * i = snapshots; i != snapshots_end; ++i)
+        xfree (i->versions);
+    xfree (snapshots);
+
+    fprintf (stderr, "Fetched %zu versions in %zu tag and branch snapshots.\n",
+             fetched, transactions);
 }
 
 
@@ -452,7 +649,11 @@ static void print_commit (FILE * out, const database_t * db, changeset_t * cs,
             continue;
 
         version_t * cv = version_live (*i);
-        if (cv != NULL && cv->mark == SIZE_MAX)
+        if (cv == NULL)
+            continue;
+
+        version_inherit (cv);
+        if (cv->blob == SIZE_MAX)
             ARRAY_APPEND (fetch, cv);
     }
 
@@ -473,8 +674,12 @@ static void print_commit (FILE * out, const database_t * db, changeset_t * cs,
              v->author, v->author, cs->time);
     fprintf (out, "data %zu\n%s\n", strlen (v->log), v->log);
     for (changeset_t ** i = cs->merge; i != cs->merge_end; ++i)
-        if ((*i)->mark == 0)
-            fprintf (stderr, "Whoops, out of order!\n");
+        if ((*i)->mark == 0) {
+            // Changesets before --since are not emitted, so nor are merges
+            // from them.
+            if ((*i)->time >= since)
+                fprintf (stderr, "Whoops, out of order!\n");
+        }
         else if ((*i)->mark == mark_counter)
             fprintf (stderr, "Whoops, self-ref\n");
         else
@@ -486,25 +691,25 @@ static void print_commit (FILE * out, const database_t * db, changeset_t * cs,
             version_t * vv = version_normalise (*i);
             if (vv->dead)
                 fprintf (out, "D %s\n", vv->file->path);
-            else
-                fprintf (out, "M %s :%zu %s\n",
-                         vv->exec ? "755" : "644", vv->mark, vv->file->path);
-            last_path = output_entries_list (
-                out, db, v->branch->branch_versions, vv->file, last_path);
+            else {
+                char hex[41];
+                sha1_hex (blobs.sha[vv->blob], hex);
+                fprintf (out, "M %s %s %s\n",
+                         vv->exec ? "755" : "644", hex, vv->file->path);
+            }
+            last_path = entries_output (
+                &entries, out, v->branch, v->branch->branch_versions,
+                vv->file, last_path);
         }
 
     fprintf (stderr, "\n");
 }
 
 
-static void print_tag (FILE * out, const database_t * db, tag_t * tag,
-                       cvs_connection_t * s)
+/// Note the fix-ups for @c tag, and start a branch off at the versions of its
+/// parent.  Returns the parent branch, if any.
+static tag_t * release_tag (const database_t * db, tag_t * tag)
 {
-    fprintf (stderr, "%s %s %s\n",
-             format_date (&tag->changeset.time, false),
-             tag->branch_versions ? "BRANCH" : "TAG",
-             tag->tag);
-
     tag_t * branch;
     if (tag->parent == NULL)
         branch = NULL;
@@ -517,7 +722,7 @@ static void print_tag (FILE * out, const database_t * db, tag_t * tag,
 
     tag->last = &tag->changeset;
 
-    create_fixups (db, branch ? branch->branch_versions : NULL, tag);
+    create_fixups (db, branch, tag);
 
     // If the tag is a branch, then rewind the current versions to the parent
     // versions.  The fix-up commits will restore things.  FIXME - we should
@@ -529,6 +734,7 @@ static void print_tag (FILE * out, const database_t * db, tag_t * tag,
             memcpy (tag->branch_versions, branch->branch_versions, bytes);
         else
             memset (tag->branch_versions, 0, bytes);
+        tag->branch_live = branch ? branch->branch_live : 0;
     }
 
     if (tag->parent)
@@ -536,6 +742,20 @@ static void print_tag (FILE * out, const database_t * db, tag_t * tag,
     else
         tag->changeset.mark = 0;
 
+    return branch;
+}
+
+
+static void print_tag (FILE * out, const database_t * db, tag_t * tag,
+                       cvs_connection_t * s)
+{
+    fprintf (stderr, "%s %s %s\n",
+             format_date (&tag->changeset.time, false),
+             tag->branch_versions ? "BRANCH" : "TAG",
+             tag->tag);
+
+    tag_t * branch = release_tag (db, tag);
+
     if (tag->deleted
         && (!tag->merge_source || tag->fixups == tag->fixups_end)) {
         assert (tag->branch_versions == NULL);
@@ -552,15 +772,144 @@ static void print_tag (FILE * out, const database_t * db, tag_t * tag,
 
     if (tag->branch_versions == NULL)
         // For a tag, just force out all the fixups immediately.
-        print_fixups (out, db, branch ? branch->branch_versions : NULL,
-                      tag, NULL, s);
+        print_fixups (out, db, branch, tag, NULL, s);
+}
+
+
+/// Bring the branch state up to date with @c cs, as when emitting it, but with
+/// no output.  This is for the history before the --since date.
+static void skip_changeset (const database_t * db, changeset_t * cs)
+{
+    if (cs->type == ct_tag) {
+        tag_t * tag = as_tag (cs);
+        tag->is_released = true;
+        release_tag (db, tag);
+        if (tag->branch_versions == NULL) {
+            // The tag is left out; we don't need its fix-ups.
+            xfree (tag->fixups);
+            tag->fixups = NULL;
+            tag->fixups_end = NULL;
+            tag->fixups_curr = NULL;
+        }
+        return;
+    }
+
+    tag_t * branch = cs->versions[0]->branch;
+
+    fixup_ver_t * fixups;
+    fixup_ver_t * fixups_end;
+    fixup_list (&fixups, &fixups_end, branch, cs);
+    for (fixup_ver_t * ffv = fixups; ffv != fixups_end; ++ffv)
+        branch_set_version (branch, ffv->file - db->files, ffv->version);
+    xfree (fixups);
+
+    for (version_t ** i = cs->versions; i != cs->versions_end; ++i)
+        if ((*i)->used)
+            branch_set_version (branch, (*i)->file - db->files, *i);
+
+    branch->last = cs;
+}
+
+
+/// Start @c branch with a commit of its current versions, for --since.  The
+/// branch is emptied and the versions set up as fix-ups, so that the commit
+/// is written by @ref print_fixups.
+static void print_snapshot (FILE * out, const database_t * db, tag_t * branch,
+                            cvs_connection_t * s)
+{
+    size_t num_files = db->files_end - db->files;
+    version_t ** versions = ARRAY_ALLOC (version_t *, num_files);
+    memcpy (versions, branch->branch_versions, num_files * sizeof *versions);
+    size_t live = branch->branch_live;
+
+    // Set aside the fix-ups still to do after the date.
+    fixup_ver_t * pending = branch->fixups;
+    fixup_ver_t * pending_end = branch->fixups_end;
+    fixup_ver_t * pending_curr = branch->fixups_curr;
+    branch->fixups = NULL;
+    branch->fixups_end = NULL;
+
+    version_t ** fetch = NULL;
+    version_t ** fetch_end = NULL;
+    for (size_t i = 0; i != num_files; ++i) {
+        version_t * v = version_live (versions[i]);
+        branch->branch_versions[i] = NULL;
+        if (v == NULL)
+            continue;
+
+        ARRAY_APPEND (branch->fixups, ((fixup_ver_t) {
+                    .file = &db->files[i], .version = v, .time = TIME_MIN }));
+
+        version_inherit (v);
+        if (v->used && v->blob == SIZE_MAX)
+            ARRAY_APPEND (fetch, v);
+    }
+    branch->fixups_curr = branch->fixups;
+    branch->branch_live = 0;
+
+    // Get what we can as the branch was at the date.  print_fixups gets the
+    // rest one by one.
+    if (fetch != fetch_end && !branch->dummy)
+        grab_by_option (out, db, s, *branch->tag ? branch->tag : NULL,
+                        format_date (&since, true), fetch, fetch_end);
+    xfree (fetch);
+
+    print_fixups (out, db, branch, branch, NULL, s);
+
+    // Put back the dead versions too, and the later fix-ups.
+    memcpy (branch->branch_versions, versions, num_files * sizeof *versions);
+    branch->branch_live = live;
+    xfree (versions);
+
+    assert (branch->fixups == NULL);
+    branch->fixups = pending;
+    branch->fixups_end = pending_end;
+    branch->fixups_curr = pending_curr;
+
+    branch->last->mark = branch->changeset.mark;
+}
+
+
+/// For --since, go through the changesets before the date without output, and
+/// then start each branch with a commit of its state.  Tags before the date
+/// are left out.  Returns the first changeset to emit, and sets @c
+/// skipped_commits to the number of commits before it.
+static changeset_t ** start_shallow (FILE * out, const database_t * db,
+                                     changeset_t ** serial,
+                                     changeset_t ** serial_end,
+                                     cvs_connection_t * s,
+                                     size_t * skipped_commits)
+{
+    changeset_t ** cut = serial;
+    size_t skipped_tags = 0;
+    *skipped_commits = 0;
+    for (; cut != serial_end && (*cut)->time < since; ++cut) {
+        skip_changeset (db, *cut);
+        if ((*cut)->type == ct_commit)
+            ++*skipped_commits;
+        else if (as_tag (*cut)->branch_versions == NULL)
+            ++skipped_tags;
+    }
+
+    size_t branches = 0;
+    for (tag_t * i = db->tags; i != db->tags_end; ++i)
+        if (i->is_released && i->branch_versions) {
+            print_snapshot (out, db, i, s);
+            ++branches;
+        }
+
+    fprintf (stderr, "Skipped %zu commits and %zu tags before %s; "
+             "started %zu branches from their state then.\n",
+             *skipped_commits, skipped_tags,
+             format_date (&since, true), branches);
+
+    return cut;
 }
 
 
 /// Output the fixups that must be done before the given time.  If none, then no
 /// commit is created.
-void print_fixups (FILE * out, const database_t * db,
-                   version_t ** base_versions,
+void print_fixups (FILE * out, const database_t * db, tag_t * base,
                    tag_t * tag, const changeset_t * cs,
                    cvs_connection_t * s)
 {
@@ -572,21 +921,23 @@ void print_fixups (FILE * out, const database_t * db,
     if (fixups == fixups_end)
         return;
 
-    // base_versions should only be NULL for starting the trunk.  But that
-    // should never need fixups.
-    assert (base_versions != NULL);
+    // base should only be NULL for starting the trunk.  But that should never
+    // need fixups.
+    assert (base != NULL && base->branch_versions != NULL);
 
-    // If we're doing fixups for a branch, then the base_versions should be the
-    // branch version.
-    assert (tag->branch_versions == NULL
-            || base_versions == tag->branch_versions);
+    // If we're doing fixups for a branch, then the base should be the branch.
+    assert (tag->branch_versions == NULL || base == tag);
 
     version_t ** fetch = NULL;
     version_t ** fetch_end = NULL;
-    for (fixup_ver_t * ffv = fixups; ffv != fixups_end; ++ffv)
-        if (ffv->version != NULL && !ffv->version->dead
-            && ffv->version->mark == SIZE_MAX)
+    for (fixup_ver_t * ffv = fixups; ffv != fixups_end; ++ffv) {
+        if (ffv->version == NULL || ffv->version->dead)
+            continue;
+
+        version_inherit (ffv->version);
+        if (ffv->version->blob == SIZE_MAX)
             ARRAY_APPEND (fetch, ffv->version);
+    }
 
     // FIXME - grab_versions assumes that all versions are on the same branch!
     // We should pass in the tag rather than guessing it!
@@ -610,7 +961,7 @@ void print_fixups (FILE * out, const database_t * db,
              tag->branch_versions && tag->last
              ? tag->last->time : tag->changeset.time);
     const char * comment = fixup_commit_comment (
-        db, base_versions, tag, fixups, fixups_end);
+        db, base, tag, fixups, fixups_end);
     fprintf (out, "data %zu\n%s", strlen (comment), comment);
     xfree (comment);
     if (tag->deleted)
@@ -618,19 +969,22 @@ void print_fixups (FILE * out, const database_t * db,
 
     // We need a list of versions for updating the entries files.  If we are
     // working on a branch, then we need to update that anyway.  Else take a
-    // temporary list.
+    // temporary list, but only if we are writing entries files.
     version_t ** updated_versions = tag->branch_versions;
-    if (updated_versions == NULL) {
+    if (updated_versions == NULL && entries.name != NULL) {
         size_t bytes = (db->files_end - db->files) * sizeof (version_t *);
         updated_versions = xmalloc (bytes);
-        memcpy (updated_versions, base_versions, bytes);
+        memcpy (updated_versions, base->branch_versions, bytes);
     }
 
     for (fixup_ver_t * ffv = fixups; ffv != fixups_end; ++ffv) {
         int i = ffv->file - db->files;
         version_t * tv = ffv->version;
-        assert (tv != version_live (updated_versions[i]));
-        updated_versions[i] = tv;
+        assert (tv != version_live (base->branch_versions[i]));
+        if (tag->branch_versions)
+            branch_set_version (tag, i, tv);
+        else if (updated_versions)
+            updated_versions[i] = tv;
     }
 
     const char * last_path = NULL;
@@ -639,12 +993,16 @@ void print_fixups (FILE * out, const database_t * db,
 
         if (tv == NULL)
             fprintf (out, "D %s\n", ffv->file->path);
-        else
-            fprintf (out, "M %s :%zu %s\n",
-                     tv->exec ? "755" : "644", tv->mark, tv->file->path);
+        else {
+            char hex[41];
+            sha1_hex (blobs.sha[tv->blob], hex);
+            fprintf (out, "M %s %s %s\n",
+                     tv->exec ? "755" : "644", hex, tv->file->path);
+        }
 
-        last_path = output_entries_list (
-            out, db, updated_versions, ffv->file, last_path);
+        last_path = entries_output (
+            &entries, out, tag->branch_versions ? tag : NULL,
+            updated_versions, ffv->file, last_path);
     }
 
     if (tag->branch_versions == NULL)
@@ -654,26 +1012,18 @@ void print_fixups (FILE * out, const database_t * db,
 }
 
 
-/// Read in our version-sha file and generate marks.
-static void initial_process_marks (const database_t * db)
+/// Read in our version-sha file, giving the versions found their blobs.
+static void read_version_cache (const database_t * db)
 {
     const char * crap_dir = xasprintf ("%s/crap", git_dir);
     // Ignore errors; we only care if we can end up using the directory.
     mkdir (crap_dir, 0777);
     xfree (crap_dir);
 
-    const char * marks_path = xasprintf (
-        "%s/crap/marks%s%s.txt", git_dir, *remote ? "." : "", remote);
-    FILE * output_marks = fopen (marks_path, "w");
-    xfree (marks_path);
-    if (output_marks == NULL)
-        fatal ("opening marks file failed: %s\n", strerror (errno));
-
     FILE * cache = fopen (version_cache_path, "r");
     if (cache == NULL) {
         warning ("opening %s failed: %s\n", version_cache_path,
                  strerror (errno));
-        fclose (output_marks);
         return;
     }
 
@@ -682,15 +1032,6 @@ static void initial_process_marks (const database_t * db)
     size_t line_max = 0;
 
     while (true) {
-        uint32_t sha[5];
-        char mode;
-        if (fscanf (cache, "%8x%8x%8x%8x%8x %c",
-                    &sha[0], &sha[1], &sha[2], &sha[3], &sha[4], &mode) < 6)
-            break;
-
-        if (mode != '-' && mode != 'x')
-            break;
-
         ssize_t ll = getline (&line, &line_max, cache);
         if (ll <= 0)
             break;
@@ -698,7 +1039,15 @@ static void initial_process_marks (const database_t * db)
         if (line[ll - 1] == '\n')
             line[ll - 1] = 0;
 
-        char * ver = line;
+        unsigned char sha[20];
+        if (ll < 43 || !sha1_parse (line, sha) || line[40] != ' ')
+            break;
+
+        char mode = line[41];
+        if (mode != '-' && mode != 'x')
+            break;
+
+        char * ver = line + 42;
         if (*ver == ' ')
             ++ver;
 
@@ -715,74 +1064,193 @@ static void initial_process_marks (const database_t * db)
 
         version_t * v = file_find_version (f, ver);
         if (v) {
-            v->mark = ++mark_counter;
+            bool added;
+            v->blob = blobs_add (&blobs, sha, &added);
             v->exec = mode == 'x';
-            fprintf (output_marks, ":%lu %08x%08x%08x%08x%08x\n",
-                     mark_counter, sha[0], sha[1], sha[2], sha[3], sha[4]);
         }
     }
 
-    cached_marks = mark_counter;
+    cached_blobs = blobs.count;
 
     xfree (line);
 
     fclose (cache);
-    fclose (output_marks);
 }
 
 
-/// Read in the marks file written by git-fast-import, and write out a file
-/// containing the id's in a form that is useful for us to re-read.
-static void final_process_marks (const database_t * db)
+/// Write out the blob ids of all the versions we have, in a form that is
+/// useful for us to re-read.
+static void write_version_cache (const database_t * db)
 {
-    const char * marks_path = xasprintf ("%s/crap/marks%s%s.txt", git_dir,
-                                         *remote ? "." : "", remote);
-    FILE * marks = fopen (marks_path, "r");
-    xfree (marks_path);
-    if (marks == NULL) {
-        warning ("open crap/marks.txt failed: %s\n", strerror (errno));
+    // FIXME - bounce via temporary.
+    FILE * cache = fopen (version_cache_path, "w");
+    if (cache == NULL) {
+        warning ("opening %s failed: %s\n",
+                 version_cache_path, strerror (errno));
         return;
     }
-    assert (sizeof (uint32_t) == 4);
-    assert (mark_counter < LONG_MAX / 20);
-    uint32_t * shas = xcalloc (mark_counter * 20 + 20);
 
-    while (true) {
-        long mark;
-        uint32_t sha[5];
-        if (fscanf (marks, ":%lu %8x%8x%8x%8x%8x\n",
-                    &mark, &sha[0], &sha[1], &sha[2], &sha[3], &sha[4]) < 6)
-            break;
+    for (const file_t * f = db->files; f != db->files_end; ++f)
+        for (const version_t * v = f->versions; v != f->versions_end; ++v)
+            if (v->blob != SIZE_MAX) {
+                char hex[41];
+                sha1_hex (blobs.sha[v->blob], hex);
+                fprintf (cache, "%s %c %s %s\n",
+                         hex, v->exec ? 'x' : '-', v->version, f->path);
+            }
 
-        if (mark >=0 && mark <= mark_counter)
-            memcpy (shas + mark * 5, sha, 20);
+    // FIXME - check errors on write...
+    fclose (cache);
+}
+
+
+/// Read the version information from a file saved with --save-rlog.
+static void read_rlog_file (database_t * db)
+{
+    int fd = open (rlog_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        fatal ("open %s failed: %s\n", rlog_file, strerror (errno));
+
+    struct stat st;
+    if (fstat (fd, &st) != 0)
+        fatal ("stat %s failed: %s\n", rlog_file, strerror (errno));
+
+    // A private writable mapping, as the lines are split in place.
+    char * data = NULL;
+    if (st.st_size != 0) {
+        data = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+        if (data == MAP_FAILED)
+            fatal ("mmap %s failed: %s\n", rlog_file, strerror (errno));
     }
+    close (fd);
 
-    fclose (marks);
+    char * prefix = xasprintf ("%s/%s/", cvs_remote_root (cvs_root),
+                               cvs_module);
+    read_files_versions_memory (db, data, st.st_size, prefix);
+    xfree (prefix);
 
-    // FIXME - bounce via temporary.
-    marks = fopen (version_cache_path, "w");
-    if (marks == NULL) {
-        warning ("opening %s failed: %s\n",
-                 version_cache_path, strerror (errno));
-        return;
+    if (data != NULL)
+        munmap (data, st.st_size);
+}
+
+
+/// If the --path patterns are all plain paths, return the paths to run rlog
+/// on, within the module.  Paths inside another are left out, so that no file
+/// is logged twice.  Otherwise, return NULL; the whole module is logged and
+/// the parser drops the unwanted files.
+static const char ** rlog_paths (const char *** end)
+{
+    if (include_paths == include_paths_end)
+        return NULL;
+
+    for (const char ** i = include_paths; i != include_paths_end; ++i)
+        if (strpbrk (*i, "*?[\\") != NULL)
+            return NULL;
+
+    const char ** paths = NULL;
+    const char ** paths_end = NULL;
+    for (const char ** i = include_paths; i != include_paths_end; ++i) {
+        bool nested = false;
+        for (const char ** j = include_paths; j != include_paths_end; ++j) {
+            size_t len = strlen (*j);
+            if (strcmp (*i, *j) == 0)
+                nested |= j < i;
+            else
+                nested |= strncmp (*i, *j, len) == 0 && (*i)[len] == '/';
+        }
+        if (!nested)
+            ARRAY_APPEND (paths, cache_stringf ("%s/%s", cvs_module, *i));
     }
 
-    for (const file_t * f = db->files; f != db->files_end; ++f)
-        for (const version_t * v = f->versions; v != f->versions_end; ++v) {
-            if (v->mark < 0 || v->mark > mark_counter)
+    *end = paths_end;
+    return paths;
+}
+
+
+/// Read the version information with one rlog for the top directory, and one
+/// for each subdirectory, spread over several connections.  With plain --path
+/// arguments, there is one rlog for each of those instead.
+static void read_sharded (database_t * db, cvs_connection_t * s,
+                          const char * root)
+{
+    rlog_shard_t * shards = NULL;
+    rlog_shard_t * shards_end = NULL;
+
+    const char ** paths_end;
+    const char ** paths = rlog_paths (&paths_end);
+    if (paths != NULL) {
+        for (const char ** i = paths; i != paths_end; ++i) {
+            ARRAY_EXTEND (shards);
+            shards_end[-1].path = *i;
+            shards_end[-1].local = false;
+        }
+        xfree (paths);
+    }
+    else {
+        ARRAY_EXTEND (shards);
+        shards_end[-1].path = s->module;
+        shards_end[-1].local = true;
+
+        // List the subdirectories.
+        cvs_printff (s,
+                     "Global_option -q\n"
+                     "Argument -e\n"
+                     "Argument --\n"
+                     "Argument %s\n"
+                     "rlist\n", s->module);
+
+        for (next_line (s); strcmp (s->line, "ok") != 0; next_line (s)) {
+            if (starts_with (s->line, "error")) {
+                warning ("Listing %s failed; reading the log in one go.\n",
+                         s->module);
+                shards_end = shards;
+                break;
+            }
+
+            if (!starts_with (s->line, "M D/"))
                 continue;
-            const uint32_t * p = shas + 5 * v->mark;
-            if (p[0] | p[1] | p[2] | p[3] | p[4])
-                fprintf (marks, "%08x%08x%08x%08x%08x %c %s %s\n",
-                         p[0], p[1], p[2], p[3], p[4],
-                         v->exec ? 'x' : '-', v->version, f->path);
+
+            const char * name = s->line + 4;
+            const char * slash = strchr (name, '/');
+            if (slash == NULL || slash == name)
+                fatal ("Bad directory listing: %s\n", s->line);
+
+            ARRAY_EXTEND (shards);
+            shards_end[-1].path = cache_stringf ("%s/%.*s", s->module,
+                                                 (int) (slash - name), name);
+            shards_end[-1].local = false;
         }
+    }
 
-    // FIXME - check errors on write...
-    fclose (marks);
+    if (shards == shards_end) {
+        ARRAY_EXTEND (shards);
+        shards_end[-1].path = s->module;
+        shards_end[-1].local = false;
+    }
 
-    free (shas);
+    size_t num_shards = shards_end - shards;
+    size_t num_conns = rlog_connections;
+    if (num_conns > num_shards)
+        num_conns = num_shards;
+
+    cvs_connection_t * extra = ARRAY_ALLOC (cvs_connection_t, num_conns - 1);
+    cvs_connection_t * conns[num_conns];
+    conns[0] = s;
+    for (size_t i = 1; i != num_conns; ++i) {
+        open_connection (&extra[i - 1], root, s->module);
+        conns[i] = &extra[i - 1];
+    }
+
+    read_files_versions_sharded (db, conns, num_conns, shards, num_shards);
+
+    fprintf (stderr, "Read the log of %zu directories over %zu connections.\n",
+             num_shards, num_conns);
+
+    for (size_t i = 1; i != num_conns; ++i)
+        cvs_connection_destroy (&extra[i - 1]);
+    xfree (extra);
+    xfree (shards);
 }
 
 
@@ -810,6 +1278,32 @@ static void usage (const char * prog, FILE * stream, int code)
                          a changeset (default 300 seconds).\n\
       --fuzz-gap=SECONDS The maximum time between two consecutive commits of a\n\
                          changeset (default 300 seconds).\n\
+      --threads=N        Use N threads for log parsing, sorting and analysis\n\
+                         (default: the number of CPUs).\n\
+      --fast-tags[=check] Place tags approximately, scoring only the most\n\
+                         similar candidates.  With 'check', also report how\n\
+                         often this differs from exact placement.\n\
+      --pack             Write the objects straight into a new pack and\n\
+                         update the refs, instead of using git-fast-import.\n\
+      --prefetch         Download all the file versions, file by file, before\n\
+                         emitting any commits.\n\
+      --rlog-connections=N  Read the log of each top-level directory\n\
+                         separately, over N connections (default 1).\n\
+      --save-rlog=FILE   Save the log from the server in FILE.\n\
+      --rlog-file=FILE   Read the log from FILE, saved by --save-rlog, instead\n\
+                         of from the server.\n\
+      --include-tags=REGEX  Only import the tags matching REGEX.\n\
+      --exclude-tags=REGEX  Do not import the tags matching REGEX.\n\
+      --include-branches=REGEX  Only import the branches matching REGEX.\n\
+      --exclude-branches=REGEX  Do not import the branches matching REGEX,\n\
+                         nor the commits on them.\n\
+      --path=PATTERN     Only import the files and directories matching\n\
+                         PATTERN, relative to the module.  May be repeated.\n\
+      --exclude-path=PATTERN  Do not import the files and directories\n\
+                         matching PATTERN.  May be repeated.\n\
+      --since=DATE       Leave out the history before DATE (YYYY-MM-DD\n\
+                         [HH:MM[:SS]], UTC); each branch starts with its\n\
+                         state at DATE.\n\
   <ROOT>                 The CVS repository to access.\n\
   <MODULE>               The relative path within the CVS repository.\n",
              prog);
@@ -818,6 +1312,52 @@ static void usage (const char * prog, FILE * stream, int code)
 }
 
 
+/// Compile the extended regular expression given to a tag or branch filter.
+static const regex_t * compile_filter (const char * option,
+                                       const char * pattern)
+{
+    regex_t * re = xmalloc (sizeof (regex_t));
+    int err = regcomp (re, pattern, REG_EXTENDED | REG_NOSUB);
+    if (err != 0) {
+        char message[256];
+        regerror (err, re, message, sizeof message);
+        fatal ("--%s: bad regular expression '%s': %s\n",
+               option, pattern, message);
+    }
+    return re;
+}
+
+
+/// A --path pattern, without trailing slashes, which would stop it matching
+/// the files in the directory.
+static const char * path_pattern (const char * pattern)
+{
+    size_t len = strlen (pattern);
+    while (len > 1 && pattern[len - 1] == '/')
+        --len;
+
+    return cache_string_n (pattern, len);
+}
+
+
+/// Parse the --since date, as UTC.
+static time_t parse_since (const char * date)
+{
+    static const char * const formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+
+    for (size_t i = 0; i != sizeof formats / sizeof formats[0]; ++i) {
+        struct tm tm;
+        memset (&tm, 0, sizeof tm);
+        const char * end = strptime (date, formats[i], &tm);
+        if (end != NULL && *end == 0)
+            return timegm (&tm);
+    }
+
+    fatal ("--since: bad date '%s'; use YYYY-MM-DD [HH:MM[:SS]]\n", date);
+}
+
+
 static void process_opts (int argc, char * const argv[])
 {
     while (1)
@@ -864,6 +1404,55 @@ static void process_opts (int argc, char * const argv[])
         case opt_fuzz_gap:
             fuzz_gap = strtoul (optarg, NULL, 10);
             break;
+        case opt_threads:
+            parallel_threads = strtoul (optarg, NULL, 10);
+            break;
+        case opt_fast_tags:
+            if (optarg == NULL)
+                fast_tags = fast_tags_on;
+            else if (strcmp (optarg, "check") == 0)
+                fast_tags = fast_tags_check;
+            else
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
+        case opt_pack:
+            pack = true;
+            break;
+        case opt_prefetch:
+            prefetch = true;
+            break;
+        case opt_rlog_connections:
+            rlog_connections = strtoul (optarg, NULL, 10);
+            if (rlog_connections == 0)
+                usage (argv[0], stderr, EXIT_FAILURE);
+            break;
+        case opt_rlog_file:
+            rlog_file = optarg;
+            break;
+        case opt_save_rlog:
+            save_rlog = optarg;
+            break;
+        case opt_include_tags:
+            include_tags = compile_filter ("include-tags", optarg);
+            break;
+        case opt_exclude_tags:
+            exclude_tags = compile_filter ("exclude-tags", optarg);
+            break;
+        case opt_include_branches:
+            include_branches = compile_filter ("include-branches", optarg);
+            break;
+        case opt_exclude_branches:
+            exclude_branches = compile_filter ("exclude-branches", optarg);
+            break;
+        case opt_path:
+            ARRAY_APPEND (include_paths, path_pattern (optarg));
+            break;
+        case opt_exclude_path:
+            ARRAY_APPEND (exclude_paths, path_pattern (optarg));
+            break;
+        case opt_since:
+            since = parse_since (optarg);
+            break;
         case -1:
             return;
         default:
@@ -890,6 +1479,13 @@ int main (int argc, char * const argv[])
     if (argc != optind + 2)
         usage (argv[0], stderr, EXIT_FAILURE);
 
+    if (pack && output_path != NULL)
+        fatal ("--pack and --output cannot be used together.\n");
+
+    if (save_rlog != NULL && (rlog_file != NULL || rlog_connections > 1))
+        fatal ("--save-rlog cannot be used with --rlog-file or "
+               "--rlog-connections.\n");
+
     if (branch_prefix == NULL) {
         if (*remote)
             branch_prefix = cache_stringf ("refs/remotes/%s", remote);
@@ -926,24 +1522,51 @@ int main (int argc, char * const argv[])
             "%s/crap/version-cache%s%s.txt",
             git_dir, *remote ? "." : "", remote);
 
+    cvs_root = argv[optind];
+    cvs_module = argv[optind + 1];
+
+    // With the log from a file, we only connect when something is fetched.
     cvs_connection_t stream;
-    connect_to_cvs (&stream, argv[optind]);
+    stream.socket = -1;
+    stream.count_versions = 0;
+    stream.count_transactions = 0;
 
-    if (zlevel != 0)
-        cvs_connection_compress (&stream, zlevel);
+    database_t db;
 
-    stream.module = xstrdup (argv[optind + 1]);
-    stream.prefix = xasprintf ("%s/%s/", stream.remote_root, stream.module);
+    if (rlog_file != NULL)
+        read_rlog_file (&db);
+    else if (rlog_connections > 1) {
+        open_connection (&stream, cvs_root, cvs_module);
+        read_sharded (&db, &stream, cvs_root);
+    }
+    else {
+        open_connection (&stream, cvs_root, cvs_module);
+        if (save_rlog != NULL) {
+            stream.save = fopen (save_rlog, "we");
+            if (stream.save == NULL)
+                fatal ("open %s failed: %s\n", save_rlog, strerror (errno));
+        }
 
-    cvs_printff (&stream,
-                 "Global_option -q\n"
-                 "Argument --\n"
-                 "Argument %s\n"
-                 "rlog\n", stream.module);
+        cvs_printf (&stream, "Global_option -q\n" "Argument --\n");
 
-    database_t db;
+        const char ** paths_end;
+        const char ** paths = rlog_paths (&paths_end);
+        if (paths == NULL)
+            cvs_printf (&stream, "Argument %s\n", stream.module);
+
+        for (const char ** i = paths; i != paths_end; ++i)
+            cvs_printf (&stream, "Argument %s\n", *i);
+
+        xfree (paths);
+
+        cvs_printff (&stream, "rlog\n");
 
-    read_files_versions (&db, &stream);
+        read_files_versions (&db, &stream);
+
+        if (stream.save != NULL && fclose (stream.save) != 0)
+            fatal ("writing %s failed: %s\n", save_rlog, strerror (errno));
+        stream.save = NULL;
+    }
 
     create_changesets (&db);
 
@@ -969,8 +1592,9 @@ int main (int argc, char * const argv[])
         if (i->branch_versions) {
             memset (i->branch_versions, 0,
                     sizeof (version_t *) * (db.files_end - db.files));
+            i->branch_live = 0;
             for (version_t ** j = i->tag_files; j != i->tag_files_end; ++j)
-                i->branch_versions[(*j)->file - db.files] = *j;
+                branch_set_version (i, (*j)->file - db.files, *j);
         }
     }
 
@@ -996,48 +1620,73 @@ int main (int argc, char * const argv[])
         if (i->branch_versions) {
             memset (i->branch_versions, 0,
                     sizeof (version_t *) * (db.files_end - db.files));
+            i->branch_live = 0;
             for (version_t ** j = i->tag_files; j != i->tag_files_end; ++j)
-                i->branch_versions[(*j)->file - db.files] = *j;
+                branch_set_version (i, (*j)->file - db.files, *j);
         }
     }
 
     // Read in any cached version sha's.
-    initial_process_marks (&db);
+    blobs_init (&blobs);
+    read_version_cache (&db);
 
-    // Start the output to git-fast-import.
+    // Start the output to git-fast-import.  The output goes via a buffer
+    // drained by its own thread, so that we can carry on reading from the
+    // CVS server while the importer is busy.
     pipeline * pipeline = NULL;
-    FILE * out;
-    if (output_path == NULL) {
+    struct import * importer = NULL;
+    int out_fd;
+    if (pack) {
+        // Our own importer reads the stream from a pipe on its own thread.
+        int fds[2];
+        check (pipe2 (fds, O_CLOEXEC), "pipe");
+        importer = import_start (fds[0], git_dir, force);
+        out_fd = fds[1];
+    }
+    else if (output_path == NULL) {
         pipecmd * cmd = pipecmd_new_args ("git", "fast-import", NULL);
-        pipecmd_argf (cmd, "--import-marks=%s/crap/marks%s%s.txt",
-                      git_dir, *remote ? "." : "", remote);
-        pipecmd_argf (cmd, "--export-marks=%s/crap/marks%s%s.txt",
-                      git_dir, *remote ? "." : "", remote);
         if (force)
             pipecmd_arg (cmd, "--force");
         pipeline = pipeline_new_commands (cmd, NULL);
         pipeline_want_in (pipeline, -1);
         pipeline_start (pipeline);
-        out = pipeline_get_infile (pipeline);
+        out_fd = fileno (pipeline_get_infile (pipeline));
     }
     else if (output_path[0] == '|') {
         pipeline = pipeline_new();
         pipeline_command_argstr (pipeline, output_path + 1);
         pipeline_want_in (pipeline, -1);
         pipeline_start (pipeline);
-        out = pipeline_get_infile (pipeline);
+        out_fd = fileno (pipeline_get_infile (pipeline));
     }
     else {
-        out = fopen (output_path, "we");
-        if (out == NULL)
+        out_fd = open (output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       0666);
+        if (out_fd < 0)
             fatal ("open %s failed: %s\n", output_path, strerror (errno));
     }
 
+    output_stats_t output_stats;
+    FILE * out = output_open (out_fd, &output_stats);
+
+    entries_init (&entries, &db, entries_name);
+
     fprintf (out, "feature done\n");
 
+    changeset_t ** first = serial;
+    size_t skipped_commits = 0;
+    if (since != TIME_MIN)
+        first = start_shallow (out, &db, serial, serial_end, &stream,
+                               &skipped_commits);
+
+    plan_fetches (out, &db, &stream);
+
+    if (prefetch)
+        prefetch_versions (out, &db, &stream);
+
     // Output the changesets to git-filter-branch.
     size_t emitted_commits = 0;
-    for (changeset_t ** p = serial; p != serial_end; ++p) {
+    for (changeset_t ** p = first; p != serial_end; ++p) {
         changeset_t * changeset = *p;
         if (changeset->type == ct_tag) {
             tag_t * tag = as_tag (changeset);
@@ -1051,19 +1700,19 @@ int main (int argc, char * const argv[])
         // Before doing the commit proper, output any branch-fixups that need
         // doing.
         tag_t * branch = changeset->versions[0]->branch;
-        print_fixups (out, &db, branch->branch_versions, branch,
+        print_fixups (out, &db, branch, branch,
                       changeset, &stream);
 
         bool live = false;
         for (version_t ** i = changeset->versions;
              i != changeset->versions_end; ++i)
             if ((*i)->used) {
-                version_t ** bv
-                    = &branch->branch_versions[(*i)->file - db.files];
-                if (version_live (*bv) != version_live (*i))
+                size_t index = (*i)->file - db.files;
+                if (version_live (branch->branch_versions[index])
+                    != version_live (*i))
                     live = true;
                 // Keep dead versions, like we do elsewhere...
-                *bv = *i;
+                branch_set_version (branch, index, *i);
             }
 
         if (live) {
@@ -1079,13 +1728,14 @@ int main (int argc, char * const argv[])
     // Final fixups.
     for (tag_t * i = db.tags; i != db.tags_end; ++i)
         if (i->branch_versions)
-            print_fixups (out, &db, i->branch_versions, i, NULL, &stream);
+            print_fixups (out, &db, i, i, NULL, &stream);
 
+    // With --since, the total is of the commits after the date.
+    size_t total_commits = db.changesets_end - db.changesets - skipped_commits;
     fprintf (stderr,
              "Emitted %zu commits (%s total %zu).\n",
-             emitted_commits,
-             emitted_commits == db.changesets_end - db.changesets ? "=" : "!=",
-             db.changesets_end - db.changesets);
+             emitted_commits, emitted_commits == total_commits ? "=" : "!=",
+             total_commits);
 
     size_t exact_branches = 0;
     size_t fixup_branches = 0;
@@ -1116,24 +1766,48 @@ int main (int argc, char * const argv[])
              fixup_branches, fixup_tags, fixup_branches + fixup_tags);
 
     fprintf (stderr,
-             "Download %lu cvs versions in %lu transactions.\n",
-             stream.count_versions, stream.count_transactions);
+             "Download %lu cvs versions in %lu transactions; "
+             "%zu duplicated earlier content, %zu unchanged from the "
+             "parent.\n",
+             stream.count_versions, stream.count_transactions,
+             duplicate_blobs, unchanged_blobs);
 
     string_cache_stats (stderr);
 
     fprintf (out, "done\n");
-    fflush (out);
-    if (ferror (out))
-        fatal ("Writing output failed.\n");
+    if (fclose (out) != 0)
+        fatal ("Writing output failed: %s\n", strerror (errno));
+
+    fprintf (stderr,
+             "Output %lu bytes, stalled %lu times (%.1f seconds) waiting for "
+             "the importer, writer idle %lu times.\n",
+             output_stats.bytes, output_stats.stalls,
+             output_stats.stall_seconds, output_stats.idle);
+
     if (pipeline != NULL) {
         int status = pipeline_wait (pipeline);
         if (status != 0)
             fatal ("Import command exited with %i.\n", status);
         pipeline_free (pipeline);
-        final_process_marks (&db);
+        // Only git-fast-import puts the blobs into this repository.
+        if (output_path == NULL)
+            write_version_cache (&db);
     }
-    else {
-        fclose (out);
+    else if (close (out_fd) != 0)
+        fatal ("Writing output failed: %s\n", strerror (errno));
+
+    if (importer != NULL) {
+        import_stats_t stats;
+        size_t failures = import_finish (importer, &stats);
+        fprintf (stderr, "Pack %s: %zu blobs, %zu trees, %zu commits, "
+                 "%zu stored as deltas; %llu bytes packed from %llu.\n",
+                 *stats.pack ? stats.pack : "not needed",
+                 stats.blobs, stats.trees, stats.commits, stats.deltas,
+                 (unsigned long long) stats.pack_bytes,
+                 (unsigned long long) stats.raw_bytes);
+        if (failures != 0)
+            fatal ("%zu refs were not updated.\n", failures);
+        write_version_cache (&db);
     }
 
     if (deleted_fixup) {
@@ -1144,8 +1818,11 @@ int main (int argc, char * const argv[])
             fatal ("Deleting dummy ref failed: %i\n", ret);
     }
 
-    cvs_connection_destroy (&stream);
+    if (stream.socket >= 0)
+        cvs_connection_destroy (&stream);
 
+    entries_destroy (&entries);
+    blobs_destroy (&blobs);
     database_destroy (&db);
     string_cache_destroy();
 
@@ -71,11 +71,7 @@ static const char * pserver_password (const char * root)
 static void connect_to_pserver (cvs_connection_t * conn, const char * root)
 {
     const char * host = root + strlen (":pserver:");
-
-    const char * path = strchr (host, '/');
-    if (path == NULL)
-        fatal ("No path in CVS root '%s'\n", root);
-    conn->remote_root = path;
+    const char * path = conn->remote_root;
 
     size_t host_len = path - host;
 
@@ -173,31 +169,19 @@ static void connect_to_program (cvs_connection_t * restrict conn,
 }
 
 
-static void connect_to_fork (cvs_connection_t * conn, const char * path)
+static void connect_to_fork (cvs_connection_t * conn)
 {
-    conn->remote_root = path;
     connect_to_program (conn, "cvs", "server", NULL);
 }
 
 
-void connect_to_ext (cvs_connection_t * conn,
-                     const char * root, const char * path)
+void connect_to_ext (cvs_connection_t * conn, const char * path)
 {
     const char * program = getenv ("CVS_RSH");
     if (program == NULL)
         program = "ssh";
 
-    // Split into host and directory as follows:  Find the first ':' or '/'.  A
-    // ':' separates the host and directory, a '/' starts the directory.
     const char * sep = path + strcspn (path, ":/");
-    if (*sep == '\0')
-        fatal ("Root '%s' has no remote root.\n", root);
-
-    if (*sep == ':')
-        conn->remote_root = sep + 1;
-    else
-        conn->remote_root = sep;
-
     const char * host = strndup (path, sep - path);
     connect_to_program (conn, program, host, "cvs", "server", NULL);
     xfree (host);
@@ -208,13 +192,7 @@ static void connect_to_fake (cvs_connection_t * conn, const char * root)
 {
     const char * program = root + strlen (":fake:");
     const char * colon1 = strchr (program, ':');
-    if (colon1 == NULL)
-        fatal ("Root '%s' has no remote root\n", root);
-    const char * colon2 = strchr (colon1 + 1, ':');
-    if (colon2 == NULL)
-        fatal ("Root '%s' has no remote root\n", root);
-
-    conn->remote_root = colon2 + 1;
+    const char * colon2 = conn->remote_root - 1;
     program = strndup (program, colon1 - program);
     const char * argument = strndup (colon1 + 1, colon2 - colon1 - 1);
     connect_to_program (conn, program, argument, NULL);
@@ -223,11 +201,45 @@ static void connect_to_fake (cvs_connection_t * conn, const char * root)
 }
 
 
+const char * cvs_remote_root (const char * root)
+{
+    if (starts_with (root, ":pserver:")) {
+        const char * path = strchr (root + strlen (":pserver:"), '/');
+        if (path == NULL)
+            fatal ("No path in CVS root '%s'\n", root);
+        return path;
+    }
+
+    if (starts_with (root, ":fake:")) {
+        const char * colon1 = strchr (root + strlen (":fake:"), ':');
+        const char * colon2 = colon1 ? strchr (colon1 + 1, ':') : NULL;
+        if (colon2 == NULL)
+            fatal ("Root '%s' has no remote root\n", root);
+        return colon2 + 1;
+    }
+
+    const char * path = root;
+    if (starts_with (root, ":ext:"))
+        path = root + 5;
+    else if (root[0] == '/' || strchr (root, ':') == NULL)
+        return root;
+
+    // Split into host and directory as follows:  Find the first ':' or '/'.  A
+    // ':' separates the host and directory, a '/' starts the directory.
+    const char * sep = path + strcspn (path, ":/");
+    if (*sep == '\0')
+        fatal ("Root '%s' has no remote root.\n", root);
+
+    return *sep == ':' ? sep + 1 : sep;
+}
+
+
 void connect_to_cvs (cvs_connection_t * conn, const char * root)
 {
     conn->count_versions = 0;
     conn->count_transactions = 0;
     conn->log = NULL;
+    conn->save = NULL;
     conn->pipeline = NULL;
     conn->compress = false;
 
@@ -241,17 +253,18 @@ void connect_to_cvs (cvs_connection_t * conn, const char * root)
 
     conn->module = NULL;
     conn->prefix = NULL;
+    conn->remote_root = cvs_remote_root (root);
 
     if (starts_with (root, ":pserver:"))
         connect_to_pserver (conn, root);
     else if (starts_with (root, ":fake:"))
         connect_to_fake (conn, root);
     else if (starts_with (root, ":ext:"))
-        connect_to_ext (conn, root, root + 5);
+        connect_to_ext (conn, root + 5);
     else if (root[0] != '/' && strchr (root, ':') != NULL)
-        connect_to_ext (conn, root, root);
+        connect_to_ext (conn, root);
     else
-        connect_to_fork (conn, root);
+        connect_to_fork (conn);
 
     cvs_printff (conn,
                  "Root %s\n"
@@ -281,6 +294,25 @@ void connect_to_cvs (cvs_connection_t * conn, const char * root)
 }
 
 
+void cvs_connection_memory (cvs_connection_t * conn, char * data, size_t len)
+{
+    conn->socket = -1;
+    conn->remote_root = NULL;
+    conn->module = NULL;
+    conn->prefix = NULL;
+    conn->count_versions = 0;
+    conn->count_transactions = 0;
+    conn->log = NULL;
+    conn->save = NULL;
+    conn->pipeline = NULL;
+    conn->compress = false;
+
+    conn->in_next = (unsigned char *) data;
+    conn->in_end = (unsigned char *) data + len;
+    conn->out_next = conn->out;
+}
+
+
 static const char * file_error (FILE * f)
 {
     return ferror (f) ? strerror (errno) : (feof (f) ? "EOF" : "unknown");
@@ -341,6 +373,13 @@ static size_t next_line_raw (cvs_connection_t * s)
     while (s->in_end == s->in_next
            || (nl = memchr (s->in_next, '\n',
                             s->in_end - s->in_next)) == NULL) {
+        if (s->socket < 0) {
+            // The end of in-memory data reads as the end of the response.
+            static char ok[] = "ok";
+            s->line = ok;
+            s->in_next = s->in_end;
+            return 2;
+        }
         if (s->in_end == in_max (s) && s->in_next == s->in)
             fatal ("Line from CVS server is too long.\n");
         do_read (s);
@@ -355,6 +394,9 @@ static size_t next_line_raw (cvs_connection_t * s)
 
 size_t next_line (cvs_connection_t * s)
 {
+    if (s->socket < 0)
+        return next_line_raw (s);
+
     while (1) {
         ssize_t len = next_line_raw (s);
         if (s->log)
@@ -363,8 +405,11 @@ size_t next_line (cvs_connection_t * s)
             fprintf (stderr, "cvs: %s\n", s->line + 2);
         else if (s->line[0] == 'F' && s->line[1] == 0)
             fflush (stderr);
-        else
+        else {
+            if (s->save)
+                fprintf (s->save, "%s\n", s->line);
             return len;
+        }
     }
 }
 
@@ -528,6 +573,35 @@ void cvs_read_block (cvs_connection_t * s, FILE * f, size_t bytes)
 }
 
 
+void cvs_read_data (cvs_connection_t * s, void * data, size_t bytes)
+{
+    char * p = data;
+    size_t done = 0;
+    while (1) {
+        size_t avail = s->in_end - s->in_next;
+        if (avail > bytes - done)
+            avail = bytes - done;
+
+        memcpy (p + done, s->in_next, avail);
+
+        done += avail;
+        s->in_next += avail;
+        if (s->in_next == s->in_end) {
+            s->in_next = s->in;
+            s->in_end = s->in;
+        }
+
+        if (done == bytes)
+            break;
+
+        do_read (s);
+    }
+
+    if (s->log)
+        fprintf (s->log, "[%zu bytes of data]\n", bytes);
+}
+
+
 void cvs_connection_compress (cvs_connection_t * s, int level)
 {
     if (s->compress || level == 0)
@@ -27,6 +27,7 @@ typedef struct cvs_connection {
     unsigned long count_transactions;
 
     FILE * log;                         ///< Log of comms with cvs server.
+    FILE * save;                        ///< Copy of the lines read, or NULL.
 
     struct pipeline * pipeline;
 
@@ -45,9 +46,17 @@ typedef struct cvs_connection {
 } cvs_connection_t;
 
 
+/// The directory part of the CVS @c root, pointing into it.
+const char * cvs_remote_root (const char * root);
+
 /// Create a connection to the CVS server for @c root.
 void connect_to_cvs (cvs_connection_t * conn, const char * root);
 
+/// Set up @c conn to read lines from the @c len bytes at @c data, instead of
+/// from a server.  The data is modified in place, and its end reads as an "ok"
+/// line.  Nothing can be sent.
+void cvs_connection_memory (cvs_connection_t * conn, char * data, size_t len);
+
 /// Negotiate compression at the given level.
 void cvs_connection_compress (cvs_connection_t * conn, int level);
 
@@ -61,6 +70,9 @@ size_t next_line (cvs_connection_t * s);
 /// data is read and discarded.
 void cvs_read_block (cvs_connection_t * s, FILE * f, size_t n);
 
+/// Receive @c n bytes of data into the buffer @c data.
+void cvs_read_data (cvs_connection_t * s, void * data, size_t n);
+
 /// Send some data to the cvs connection.
 void cvs_printf (cvs_connection_t * s, const char * format, ...)
     __attribute__ ((format (printf, 2, 3)));
@@ -9,46 +9,46 @@
 #include <string.h>
 
 
-static int compare_changeset (const void * AA, const void * BB)
+static void changeset_heap_key (const void * context, const void * item,
+                                heap_entry_t * entry)
 {
-    const changeset_t * A = AA;
-    const changeset_t * B = BB;
+    const database_t * db = context;
+    const changeset_t * cs = item;
+
+    // Once the order is fixed, commits on the heap are those deferred by
+    // tags; keep them in order.
+    if (cs->type == ct_commit && db->changesets_ordered) {
+        entry->key = (uint64_t) 1 << 63 | cs->order;
+        entry->tie = 0;
+        return;
+    }
 
     // We emit implicit merges and branches as soon as they become ready.
-    if (A->type != B->type)
-        return A->type < B->type ? -1 : 1;
-
-    if (A->time != B->time)
-        return A->time > B->time;
+    // After that, order by time.
+    entry->key = (uint64_t) cs->type << 63 | heap_time_key (cs->time);
 
     // That's all the ordering we really *need* to do, but we try and make
-    // things as deterministic as possible.
+    // things as deterministic as possible.  The tags are sorted by name, and
+    // the string rank orders commits by author, commitid, log and branch.
+    if (cs->type == ct_tag)
+        entry->tie = as_tag (cs) - db->tags;
+    else
+        entry->tie = (uint64_t) cs->string_rank << 32
+            | (cs->versions[0]->file - db->files);
+}
 
-    if (A->type != B->type)
-        return A->type > B->type ? 1 : -1;
 
-    if (A->type == ct_tag)
-        return strcmp (as_tag (A)->tag, as_tag (B)->tag);
+static int compare_changeset (const void * AA, const void * BB)
+{
+    const changeset_t * A = AA;
+    const changeset_t * B = BB;
 
+    // Only called when the keys are identical; i.e., commits with the same
+    // strings and first file.
     const version_t * vA = A->versions[0];
     const version_t * vB = B->versions[0];
-    if (vA->author != vB->author)
-        return strcmp (vA->author, vB->author);
-
-    if (vA->commitid != vB->commitid)
-        return strcmp (vA->commitid, vB->commitid);
-
-    if (vA->log != vB->log)
-        return strcmp (vA->log, vB->log);
-
-    if (vA->branch->tag != vB->branch->tag)
-        return vA->branch->tag < vB->branch->tag ? -1 : 1;
-
     assert (vA->implicit_merge == vB->implicit_merge);
 
-    if (vA->file != vB->file)
-        return vA->file > vB->file;
-
     return vA > vB;
 }
 
@@ -61,9 +61,14 @@ void database_init (database_t * db)
     db->tags_end = NULL;
     db->changesets = NULL;
     db->changesets_end = NULL;
-
-    heap_init (&db->ready_changesets,
-               offsetof (changeset_t, ready_index), compare_changeset);
+    db->version_list = NULL;
+    db->version_list_end = NULL;
+    arena_init (&db->changeset_arena);
+    db->changesets_ordered = false;
+    db->emission_cursor = 0;
+
+    heap_init (&db->ready_changesets, offsetof (changeset_t, ready_index),
+               changeset_heap_key, db, compare_changeset);
 }
 
 
@@ -82,16 +87,18 @@ void database_destroy (database_t * db)
         free (i->fixups);
     }
 
+    // The changesets themselves live in the arena, and their version lists
+    // are spans of the version list.
     for (changeset_t ** i = db->changesets; i != db->changesets_end; ++i) {
         free ((*i)->children);
-        free ((*i)->versions);
         free ((*i)->merge);
-        free (*i);
     }
 
     free (db->files);
     free (db->tags);
     free (db->changesets);
+    free (db->version_list);
+    arena_destroy (&db->changeset_arena);
     heap_destroy (&db->ready_changesets);
 }
 
@@ -108,7 +115,8 @@ file_t * database_new_file (database_t * db)
 
 changeset_t * database_new_changeset (database_t * db)
 {
-    changeset_t * result = xmalloc (sizeof (changeset_t));
+    changeset_t * result = arena_alloc (&db->changeset_arena,
+                                        sizeof (changeset_t));
     changeset_init (result);
 
     ARRAY_APPEND (db->changesets, result);
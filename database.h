@@ -1,8 +1,10 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include "arena.h"
 #include "heap.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct database {
@@ -15,7 +17,20 @@ typedef struct database {
     struct changeset ** changesets;
     struct changeset ** changesets_end;
 
+    /// All commit versions, grouped by changeset.  The version list of each
+    /// commit changeset is a span of this array.
+    struct version ** version_list;
+    struct version ** version_list_end;
+
+    arena_t changeset_arena;            ///< Storage for changeset objects.
+
     heap_t ready_changesets;
+
+    /// Set once the commit changesets are in emission order.  After that,
+    /// @ref next_changeset walks that order, and only tags and deferred
+    /// commits go through the ready heap.
+    bool changesets_ordered;
+    size_t emission_cursor;             ///< Next commit in the order.
 } database_t;
 
 /// Initialise a database_t object.
@@ -2,6 +2,8 @@
 #include "database.h"
 #include "emission.h"
 #include "file.h"
+#include "log.h"
+#include "scc.h"
 #include "utils.h"
 
 #include <assert.h>
@@ -14,7 +16,12 @@ static void changeset_release (database_t * db, changeset_t * cs)
 {
     assert (cs->unready_count != 0);
 
-    if (--cs->unready_count == 0)
+    if (--cs->unready_count != 0)
+        return;
+
+    // Commits ahead of the cursor will be picked up in order.
+    if (cs->type == ct_tag || !db->changesets_ordered
+        || cs->order < db->emission_cursor)
         heap_insert (&db->ready_changesets, cs);
 }
 
@@ -59,83 +66,171 @@ static bool can_replace_with_implicit_merge (const version_t * v)
 size_t changeset_update_branch_versions (struct database * db,
                                          struct changeset * cs)
 {
-    version_t ** branch = cs->versions[0]->branch->branch_versions;
-    assert (branch);
+    tag_t * branch = cs->versions[0]->branch;
+    assert (branch->branch_versions);
     size_t changes = 0;
 
     for (version_t ** i = cs->versions; i != cs->versions_end; ++i) {
-        version_t ** bv = &branch[(*i)->file - db->files];
+        size_t index = (*i)->file - db->files;
+        version_t * bv = branch->branch_versions[index];
         (*i)->used = !(*i)->implicit_merge
-            || can_replace_with_implicit_merge (*bv);
+            || can_replace_with_implicit_merge (bv);
         if (!(*i)->used)
             continue;
 
-        if (version_live (*bv) != version_live (*i))
+        if (version_live (bv) != version_live (*i))
             ++changes;
 
         // We need to keep dead versions here, because dead versions block
         // implicit merges of vendor imports.
-        *bv = *i;
+        branch_set_version (branch, index, *i);
     }
 
     return changes;
 }
 
 
-static const version_t * preceed (const changeset_t * cs)
+/// Find the earliest un-emitted ancestor of the blocked version @c v.  This
+/// will be ready to emit.
+static const version_t * blocking_version (const version_t * v)
 {
-    // If cs is not ready to emit, then some version in cs is blocked.  The
-    // earliest un-emitted ancestor of that version will be ready to emit.
-    // Search for it.  FIXME We should be a bit smarter by searching harder for
-    // the oldest possible version.
-    for (version_t ** csv = cs->versions; csv != cs->versions_end; ++csv)
-        if ((*csv)->ready_index == SIZE_MAX)
-            for (version_t * i = (*csv)->parent; i; i = i->parent)
-                if (i->ready_index != SIZE_MAX)
-                    return i;
-
-    abort();
+    for (const version_t * i = v->parent; i; i = i->parent)
+        if (i->ready_index != SIZE_MAX)
+            return i;
+
+    return NULL;
 }
 
 
-static void cycle_split (database_t * db, changeset_t * cs)
+static void cycle_split (database_t * db, changeset_t * cs, size_t cycle_size)
 {
-    fprintf (stderr, "*********** CYCLE **********\n");
     // We split the changeset into two.  We leave all the blocked versions
     // in cs, and put the ready-to-emit into nw.
 
-    changeset_t * new = database_new_changeset (db);
-    new->type = ct_commit;
-    new->time = cs->time;               // FIXME.
+    // The versions are a span of the database version list, so partition
+    // in place: the blocked versions are packed at the front, and the
+    // ready-to-emit versions are moved to the end to form the span for new.
+    size_t count = cs->versions_end - cs->versions;
+    version_t ** ready = ARRAY_ALLOC (version_t *, count);
+    version_t ** ready_end = ready;
     version_t ** cs_v = cs->versions;
     for (version_t ** v = cs->versions; v != cs->versions_end; ++v)
         if ((*v)->ready_index == SIZE_MAX)
             // Blocked; stays in cs.
             *cs_v++ = *v;
-        else {
+        else
             // Ready-to-emit; goes into new.
-            ARRAY_APPEND (new->versions, *v);
-            (*v)->commit = new;
-        }
+            *ready_end++ = *v;
+
+    memcpy (cs_v, ready, (ready_end - ready) * sizeof (version_t *));
+    xfree (ready);
 
+    changeset_t * new = database_new_changeset (db);
+    new->type = ct_commit;
+    new->time = cs->time;               // FIXME.
+    new->string_rank = cs->string_rank;
+    new->versions = cs_v;
+    new->versions_end = cs->versions_end;
     cs->versions_end = cs_v;
     assert (cs->versions != cs->versions_end);
     assert (new->versions != new->versions_end);
-    ARRAY_TRIM (cs->versions);
-    ARRAY_TRIM (new->versions);
+
+    for (version_t ** v = new->versions; v != new->versions_end; ++v)
+        (*v)->commit = new;
 
     heap_insert (&db->ready_changesets, new);
 
-    fprintf (stderr, "Changeset %s %s\n%s\n",
-             cs->versions[0]->branch ? cs->versions[0]->branch->tag : "",
-             cs->versions[0]->author, cs->versions[0]->log);
-    for (version_t ** v = new->versions; v != new->versions_end; ++v)
-        fprintf (stderr, "    %s:%s\n", (*v)->file->path, (*v)->version);
+    const version_t * v = cs->versions[0];
+    const char * eol = strchr (v->log, '\n');
+    fprintf (stderr, "Break cycle of %zu changesets: split %s %s '%.*s', "
+             "deferring %zu of %zu versions\n",
+             cycle_size, v->branch ? v->branch->tag : "", v->author,
+             (int) (eol ? eol - v->log : strlen (v->log)), v->log,
+             cs->versions_end - cs->versions, count);
+}
 
-    fprintf (stderr, "Deferring:\n");
 
-    for (version_t ** v = cs->versions; v != cs->versions_end; ++v)
-        fprintf (stderr, "    %s:%s\n", (*v)->file->path, (*v)->version);
+/// Emission is stuck: every unemitted changeset has a blocked version.  Find
+/// all the changeset cycles, and split one changeset in each.
+///
+/// A changeset depends on the changesets containing the earliest unemitted
+/// ancestors of its blocked versions.  Those ancestors are ready to emit, so
+/// every changeset on a cycle contains a ready version.  Hence we only need to
+/// consider the changesets of the ready versions.  We find the strongly
+/// connected components of that graph in one pass; each component with a
+/// cycle is broken by splitting the ready versions out of one changeset.
+static void break_cycles (database_t * db, heap_t * ready_versions)
+{
+    // Number the nodes.  The changesets are not on the ready heap, so we can
+    // borrow the ready_index to hold the node number.
+    changeset_t ** nodes = NULL;
+    changeset_t ** nodes_end = NULL;
+    for (heap_entry_t * i = ready_versions->entries;
+         i != ready_versions->entries_end; ++i) {
+        changeset_t * cs = ((version_t *) i->item)->commit;
+        if (cs->ready_index == SIZE_MAX) {
+            cs->ready_index = nodes_end - nodes;
+            ARRAY_APPEND (nodes, cs);
+        }
+    }
+
+    size_t num_nodes = nodes_end - nodes;
+    size_t * start = ARRAY_ALLOC (size_t, num_nodes + 1);
+    size_t * edges = NULL;
+    size_t * edges_end = NULL;
+    for (size_t i = 0; i != num_nodes; ++i) {
+        start[i] = edges_end - edges;
+        for (version_t ** v = nodes[i]->versions;
+             v != nodes[i]->versions_end; ++v)
+            if ((*v)->ready_index == SIZE_MAX) {
+                const version_t * b = blocking_version (*v);
+                assert (b && b->commit->ready_index < num_nodes);
+                ARRAY_APPEND (edges, b->commit->ready_index);
+            }
+    }
+    start[num_nodes] = edges_end - edges;
+
+    size_t * component = ARRAY_ALLOC (size_t, num_nodes);
+    size_t num_components = scc_find (num_nodes, start, edges, component);
+
+    // For each component, find its size, whether it has a cycle, and the
+    // changeset to split.  We split the changeset that would be emitted first,
+    // to keep things deterministic.
+    size_t * size = ARRAY_CALLOC (size_t, num_components);
+    bool * cyclic = ARRAY_CALLOC (bool, num_components);
+    changeset_t ** best = ARRAY_CALLOC (changeset_t *, num_components);
+    for (size_t i = 0; i != num_nodes; ++i) {
+        size_t c = component[i];
+        ++size[c];
+        for (size_t * e = edges + start[i]; e != edges + start[i + 1]; ++e)
+            if (*e == i)
+                cyclic[c] = true;   // Self-loop.
+
+        if (best[c] == NULL
+            || heap_less (&db->ready_changesets, nodes[i], best[c]))
+            best[c] = nodes[i];
+    }
+
+    for (changeset_t ** i = nodes; i != nodes_end; ++i)
+        (*i)->ready_index = SIZE_MAX;
+
+    size_t splits = 0;
+    for (size_t c = 0; c != num_components; ++c)
+        if (size[c] > 1 || cyclic[c]) {
+            cycle_split (db, best[c], size[c]);
+            ++splits;
+        }
+
+    if (splits == 0)
+        fatal ("Changeset emission is stuck, but there is no cycle.\n");
+
+    free (nodes);
+    free (start);
+    free (edges);
+    free (component);
+    free (size);
+    free (cyclic);
+    free (best);
 }
 
 
@@ -144,22 +239,8 @@ changeset_t * next_changeset_split (database_t * db, heap_t * ready_versions)
     if (heap_empty (ready_versions))
         return NULL;
 
-    if (heap_empty (&db->ready_changesets)) {
-        // Find a cycle.
-        const version_t * slow = heap_front (ready_versions);
-        const version_t * fast = slow;
-        do {
-            slow = preceed (slow->commit);
-            fast = preceed (preceed (fast->commit)->commit);
-        }
-        while (slow != fast);
-
-        // And split it.
-        cycle_split (db, slow->commit);
-
-        assert (db->ready_changesets.entries
-                != db->ready_changesets.entries_end);
-    }
+    if (heap_empty (&db->ready_changesets))
+        break_cycles (db, ready_versions);
 
     return heap_pop (&db->ready_changesets);
 }
@@ -167,15 +248,28 @@ changeset_t * next_changeset_split (database_t * db, heap_t * ready_versions)
 
 changeset_t * next_changeset (database_t * db)
 {
-    if (heap_empty (&db->ready_changesets))
-        return NULL;
-    else
+    if (!heap_empty (&db->ready_changesets))
         return heap_pop (&db->ready_changesets);
+
+    if (!db->changesets_ordered)
+        return NULL;
+
+    // Nothing released or deferred is ready; walk the stored order.  A commit
+    // that is not ready is deferred: it goes on the heap when released.
+    while (db->emission_cursor != db->changesets_end - db->changesets) {
+        changeset_t * cs = db->changesets[db->emission_cursor++];
+        if (cs->unready_count == 0)
+            return cs;
+    }
+
+    return NULL;
 }
 
 
 void prepare_for_emission (database_t * db, heap_t * ready_versions)
 {
+    db->emission_cursor = 0;
+
     // Re-do the changeset unready counts.
     for (changeset_t ** i = db->changesets; i != db->changesets_end; ++i) {
         // FIXME - when we make fix-up commits explicit we will need to
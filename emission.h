@@ -22,7 +22,9 @@ size_t changeset_update_branch_versions (struct database * db,
 struct changeset * next_changeset_split (struct database * db,
                                          struct heap * ready_versions);
 
-/// Find the next changeset to emit.
+/// Find the next changeset to emit.  Once the commit order is fixed by
+/// @ref create_changesets, this merges the released tags and deferred commits
+/// into the stored order.
 struct changeset * next_changeset (struct database * db);
 
 /// Set up all the unready_counts, and mark initial versions as ready to emit.
@@ -0,0 +1,243 @@
+#include "database.h"
+#include "entries.h"
+#include "file.h"
+#include "log.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// The listing of a directory on a branch.
+typedef struct entries_dir {
+    const tag_t * branch;
+    size_t dir;
+    version_t ** versions;              ///< The versions listed.
+    size_t * offsets;                   ///< Where each file's line starts.
+    char * text;
+    size_t text_len;
+    struct entries_dir * next;
+} entries_dir_t;
+
+
+static bool same_directory (const char * A, const char * B)
+{
+    const char * sA = strrchr (A, '/');
+    const char * sB = strrchr (B, '/');
+    if (sA == NULL)
+        return sB == NULL;
+    return sB != NULL  &&  sA - A == sB - B  &&  memcmp (A, B, sA - A) == 0;
+}
+
+
+static int path_dirlen (const char * p)
+{
+    const char * s = strrchr (p, '/');
+    if (s == NULL)
+        return 0;
+    else
+        return s - p + 1;
+}
+
+
+static const char * path_filename (const char * p)
+{
+    const char * s = strrchr (p, '/');
+    if (s == NULL)
+        return p;
+    else
+        return s + 1;
+}
+
+
+void entries_init (entries_t * e, const database_t * db, const char * name)
+{
+    e->name = name && *name ? name : NULL;
+    e->db = db;
+    e->dir = NULL;
+    e->dir_start = NULL;
+    e->buckets = NULL;
+    e->num_buckets = 0;
+    e->num_listings = 0;
+    if (e->name == NULL)
+        return;
+
+    // The directories are runs of files in the same directory.
+    size_t num_files = db->files_end - db->files;
+    e->dir = ARRAY_ALLOC (size_t, num_files);
+    e->dir_start = ARRAY_ALLOC (size_t, num_files + 1);
+    size_t num_dirs = 0;
+    for (size_t i = 0; i != num_files; ++i) {
+        if (i == 0 || !same_directory (db->files[i - 1].path,
+                                       db->files[i].path))
+            e->dir_start[num_dirs++] = i;
+        e->dir[i] = num_dirs - 1;
+    }
+    e->dir_start[num_dirs] = num_files;
+
+    e->num_buckets = 64;
+    e->buckets = ARRAY_CALLOC (entries_dir_t *, e->num_buckets);
+}
+
+
+static void entries_dir_free (entries_dir_t * d)
+{
+    free (d->versions);
+    free (d->offsets);
+    free (d->text);
+    free (d);
+}
+
+
+void entries_destroy (entries_t * e)
+{
+    for (size_t i = 0; i != e->num_buckets; ++i)
+        for (entries_dir_t * d = e->buckets[i]; d;) {
+            entries_dir_t * next = d->next;
+            entries_dir_free (d);
+            d = next;
+        }
+
+    free (e->buckets);
+    free (e->dir);
+    free (e->dir_start);
+}
+
+
+static size_t entries_hash (const entries_t * e, const tag_t * branch,
+                            size_t dir)
+{
+    uint64_t h = ((uintptr_t) branch >> 4) * 0x9e3779b97f4a7c15ull + dir;
+    return (h ^ (h >> 29)) & (e->num_buckets - 1);
+}
+
+
+static entries_dir_t * entries_dir_new (const entries_t * e, size_t dir)
+{
+    size_t count = e->dir_start[dir + 1] - e->dir_start[dir];
+    entries_dir_t * d = xmalloc (sizeof (entries_dir_t));
+    d->branch = NULL;
+    d->dir = dir;
+    d->versions = ARRAY_CALLOC (version_t *, count);
+    d->offsets = ARRAY_CALLOC (size_t, count + 1);
+    d->text = NULL;
+    d->text_len = 0;
+    d->next = NULL;
+    return d;
+}
+
+
+/// Find the listing of @c dir on @c branch, creating it if need be.
+static entries_dir_t * entries_dir_find (entries_t * e, const tag_t * branch,
+                                         size_t dir)
+{
+    entries_dir_t ** head = &e->buckets[entries_hash (e, branch, dir)];
+    for (entries_dir_t * d = *head; d; d = d->next)
+        if (d->branch == branch && d->dir == dir)
+            return d;
+
+    entries_dir_t * d = entries_dir_new (e, dir);
+    d->branch = branch;
+    d->next = *head;
+    *head = d;
+
+    if (++e->num_listings > e->num_buckets) {
+        // Rehash into twice as many buckets.
+        entries_dir_t ** old = e->buckets;
+        size_t old_size = e->num_buckets;
+        e->num_buckets *= 2;
+        e->buckets = ARRAY_CALLOC (entries_dir_t *, e->num_buckets);
+        for (size_t i = 0; i != old_size; ++i)
+            for (entries_dir_t * j = old[i]; j;) {
+                entries_dir_t * next = j->next;
+                entries_dir_t ** h
+                    = &e->buckets[entries_hash (e, j->branch, j->dir)];
+                j->next = *h;
+                *h = j;
+                j = next;
+            }
+        free (old);
+    }
+
+    return d;
+}
+
+
+/// Bring the listing @c d up to date with the versions @c vv, regenerating the
+/// lines of the files whose version has changed.
+static void entries_dir_update (const entries_t * e, entries_dir_t * d,
+                                version_t * const * vv)
+{
+    size_t first = e->dir_start[d->dir];
+    size_t count = e->dir_start[d->dir + 1] - first;
+
+    size_t k = 0;
+    while (k != count && d->versions[k] == vv[first + k])
+        ++k;
+    if (k == count)
+        return;                         // No change.
+
+    char * text;
+    size_t text_len;
+    FILE * f = open_memstream (&text, &text_len);
+    if (f == NULL)
+        fatal ("open_memstream failed: %s\n", strerror (errno));
+
+    // The lines before the first change are kept as they are.
+    fwrite (d->text, 1, d->offsets[k], f);
+    for (; k != count; ++k) {
+        version_t * v = vv[first + k];
+        size_t offset = ftell (f);
+        if (v == d->versions[k])
+            fwrite (d->text + d->offsets[k], 1,
+                    d->offsets[k + 1] - d->offsets[k], f);
+        else if (version_live (v))
+            fprintf (f, "%s %s\n", v->version,
+                     path_filename (e->db->files[first + k].path));
+        d->offsets[k] = offset;
+        d->versions[k] = v;
+    }
+    d->offsets[count] = ftell (f);
+
+    if (ferror (f))
+        fatal ("memstream: error creating entries listing\n");
+    fclose (f);
+
+    free (d->text);
+    d->text = text;
+    d->text_len = text_len;
+}
+
+
+const char * entries_output (entries_t * e, FILE * out, const tag_t * branch,
+                             version_t * const * vv, const file_t * f,
+                             const char * last_path)
+{
+    if (e->name == NULL)
+        return last_path;
+
+    if (last_path != NULL && same_directory (last_path, f->path))
+        return last_path;
+
+    size_t dir = e->dir[f - e->db->files];
+    entries_dir_t * d = branch ? entries_dir_find (e, branch, dir)
+        : entries_dir_new (e, dir);
+    entries_dir_update (e, d, vv);
+
+    if (d->text_len == 0)
+        fprintf (out, "D %.*s%s\n",
+                 path_dirlen (f->path), f->path, e->name);
+    else {
+        fprintf (out, "M 644 inline %.*s%s\n",
+                 path_dirlen (f->path), f->path, e->name);
+        fprintf (out, "data <<EOF\n");
+        fwrite (d->text, 1, d->text_len, out);
+        fprintf (out, "EOF\n");
+    }
+
+    if (branch == NULL)
+        entries_dir_free (d);
+
+    return f->path;
+}
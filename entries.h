@@ -0,0 +1,44 @@
+#ifndef ENTRIES_H
+#define ENTRIES_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct database;
+struct entries_dir;
+struct file;
+struct tag;
+struct version;
+
+/// The entries files added to each directory, listing the CVS versions of the
+/// files in the directory.  The listing for each branch and directory is kept,
+/// and on each change only the lines for changed files are regenerated.
+typedef struct entries {
+    const char * name;                  ///< The entries file name, or NULL.
+    const struct database * db;
+
+    size_t * dir;                       ///< The directory of each file.
+    size_t * dir_start;                 ///< The first file of each directory.
+
+    struct entries_dir ** buckets;      ///< Hash of listings by branch & dir.
+    size_t num_buckets;
+    size_t num_listings;
+} entries_t;
+
+/// Initialise @c e for the entries files called @c name, or for no entries
+/// files if @c name is NULL or empty.
+void entries_init (entries_t * e, const struct database * db,
+                   const char * name);
+
+void entries_destroy (entries_t * e);
+
+/// Output the entries file for the directory of @c f, given the versions
+/// @c vv, unless @c last_path is in the same directory.  If @c vv are the
+/// versions of @c branch then pass that, and the listing will be kept for
+/// next time; else pass NULL.  Returns the new @c last_path.
+const char * entries_output (entries_t * e, FILE * out,
+                             const struct tag * branch,
+                             struct version * const * vv,
+                             const struct file * f, const char * last_path);
+
+#endif
@@ -13,6 +13,7 @@ version_t * file_new_version (file_t * f)
     f->versions_end[-1].file = f;
     f->versions_end[-1].implicit_merge = false;
     f->versions_end[-1].used = true;
+    f->versions_end[-1].unchanged = false;
     f->versions_end[-1].ready_index = SIZE_MAX;
     return &f->versions_end[-1];
 }
@@ -39,6 +40,7 @@ void tag_init (tag_t * tag, const char * name)
     tag->tag_files = NULL;
     tag->tag_files_end = NULL;
     tag->branch_versions = NULL;
+    tag->branch_live = 0;
 
     tag->parents = NULL;
     tag->parents_end = NULL;
@@ -43,6 +43,9 @@ struct version {
     /// Should this version be mode 755 instead of 644?
     bool exec;
 
+    /// The RCS delta from the parent is empty, so the content is the same.
+    bool unchanged;
+
     version_t * parent;                 ///< Previous version.
     version_t * children;               ///< A child, or NULL.
     version_t * sibling;                ///< A sibling, or NULL.
@@ -60,7 +63,7 @@ struct version {
 
     union {
         size_t ready_index;             ///< Heap index for emitting versions.
-        size_t mark;                    ///< Mark during emission.
+        size_t blob;                    ///< Content, as a blob index.
     };
 };
 
@@ -77,6 +80,13 @@ static inline version_t * version_live (version_t * v)
 }
 
 
+/// Radix sort key for ordering versions by file; see @ref ARRAY_RADIX_SORT.
+static inline uint64_t version_file_key (const void * v)
+{
+    return (uintptr_t) ((const version_t *) v)->file;
+}
+
+
 struct tag {
     const char * tag;                   ///< The tag name.
 
@@ -89,6 +99,10 @@ struct tag {
     /// version, in the emission of the branch, of the corresponding file.
     version_t ** branch_versions;
 
+    /// For branches, the number of live versions in @c branch_versions.  This
+    /// lets fix-ups be found without going through every file.
+    size_t branch_live;
+
     /// The array of parent branches to this tag.  The emission process will
     /// choose one of these as the branch to put the tag on.
     struct parent_branch * parents;
@@ -136,4 +150,15 @@ static inline tag_t * as_tag (const changeset_t * cs)
     return (tag_t *) (((char *) cs) - offsetof (tag_t, changeset));
 }
 
+/// Set the current version of the file with index @c i on @c branch, keeping
+/// the count of live versions up to date.
+static inline void branch_set_version (tag_t * branch, size_t i,
+                                       version_t * v)
+{
+    version_t ** bv = &branch->branch_versions[i];
+    branch->branch_live += (version_live (v) != NULL)
+        - (version_live (*bv) != NULL);
+    *bv = v;
+}
+
 #endif
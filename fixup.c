@@ -34,8 +34,36 @@ static int compare_fixup_by_time (const void * AA, const void * BB)
 }
 
 
-void create_fixups (const database_t * db,
-                    version_t * const * branch_versions, tag_t * tag)
+/// Note a fixup if the version of file @c i on the branch differs from the
+/// tag version @c tv.
+static void add_fixup (const database_t * db,
+                       version_t * const * branch_versions, tag_t * tag,
+                       const file_t * i, version_t * tv)
+{
+    version_t * bv = branch_versions ? version_normalise (
+        branch_versions[i - db->files]) : NULL;
+
+    version_t * bvl = bv == NULL || bv->dead ? NULL : bv;
+    version_t * tvl = tv == NULL || tv->dead ? NULL : tv;
+
+    if (bvl == tvl)
+        return;
+
+    // The only fixups we defer are files that spontaneously appear on
+    // the tag.  Everything else we assume was there from the start.
+    time_t fix_time;
+    if (tv != NULL && branch_versions
+        && branch_versions[i - db->files] == NULL)
+        fix_time = tv->time;
+    else
+        fix_time = TIME_MIN;
+
+    ARRAY_APPEND (tag->fixups, ((fixup_ver_t) {
+                .file = i, .version = tvl, .time = fix_time }));
+}
+
+
+void create_fixups (const database_t * db, const tag_t * base, tag_t * tag)
 {
     // Go through the current versions on the branch and note any version
     // fix-ups required.
@@ -46,31 +74,30 @@ void create_fixups (const database_t * db,
     assert (TIME_MAX > 0);
     assert (TIME_MIN == (time_t) ((unsigned long long) TIME_MAX + 1));
 
-    version_t ** tf = tag->tag_files;
-    for (file_t * i = db->files; i != db->files_end; ++i) {
-        version_t * bv = branch_versions ? version_normalise (
-            branch_versions[i - db->files]) : NULL;
-        version_t * tv = NULL;
-        if (tf != tag->tag_files_end && (*tf)->file == i)
-            tv = version_normalise (*tf++);
-
-        version_t * bvl = bv == NULL || bv->dead ? NULL : bv;
-        version_t * tvl = tv == NULL || tv->dead ? NULL : tv;
-
-        if (bvl == tvl)
-            continue;
-
-        // The only fixups we defer are files that spontaneously appear on
-        // the tag.  Everything else we assume was there from the start.
-        time_t fix_time;
-        if (tv != NULL && branch_versions
-            && branch_versions[i - db->files] == NULL)
-            fix_time = tv->time;
-        else
-            fix_time = TIME_MIN;
-
-        ARRAY_APPEND (tag->fixups, ((fixup_ver_t) {
-                    .file = i, .version = tvl, .time = fix_time }));
+    version_t * const * branch_versions = base ? base->branch_versions : NULL;
+
+    // If every live file on the branch is on the tag, then only the tag files
+    // can need fixing up.  Otherwise we have to go through all the files to
+    // find the ones to delete.
+    size_t covered = 0;
+    if (branch_versions)
+        for (version_t ** tf = tag->tag_files; tf != tag->tag_files_end; ++tf)
+            if (version_live (branch_versions[(*tf)->file - db->files]))
+                ++covered;
+
+    if (base == NULL || covered == base->branch_live)
+        for (version_t ** tf = tag->tag_files; tf != tag->tag_files_end; ++tf)
+            add_fixup (db, branch_versions, tag, (*tf)->file,
+                       version_normalise (*tf));
+    else {
+        assert (covered < base->branch_live);
+        version_t ** tf = tag->tag_files;
+        for (file_t * i = db->files; i != db->files_end; ++i) {
+            version_t * tv = NULL;
+            if (tf != tag->tag_files_end && (*tf)->file == i)
+                tv = version_normalise (*tf++);
+            add_fixup (db, branch_versions, tag, i, tv);
+        }
     }
 
     tag->fixups_curr = tag->fixups;
@@ -172,31 +199,29 @@ void fixup_list (fixup_ver_t ** fixups, fixup_ver_t ** fixups_end,
 
 
 char * fixup_commit_comment (const database_t * db,
-                             version_t * const * base_versions, tag_t * tag,
+                             const tag_t * base, tag_t * tag,
                              fixup_ver_t * fixups,
                              fixup_ver_t * fixups_end)
 {
-    // Generate stats.
-    size_t keep = 0;
+    version_t * const * base_versions = base ? base->branch_versions : NULL;
+
+    // Generate stats.  Every live file not in the fixups is kept, so we only
+    // need to look at the fixups.
+    size_t keep = base ? base->branch_live : 0;
     size_t added = 0;
     size_t deleted = 0;
     size_t modified = 0;
 
-    fixup_ver_t * ffv = fixups;
-    for (file_t * i = db->files; i != db->files_end; ++i) {
+    for (fixup_ver_t * ffv = fixups; ffv != fixups_end; ++ffv) {
         version_t * bv = base_versions ?
-            version_live (base_versions[i - db->files]) : NULL;
-        version_t * tv;
-        if (ffv != fixups_end && ffv->file == i)
-            tv = ffv++->version;
-        else
-            tv = bv;
+            version_live (base_versions[ffv->file - db->files]) : NULL;
+        version_t * tv = ffv->version;
 
-        if (bv == tv) {
-            if (bv != NULL)
-                ++keep;
+        if (bv == tv)
             continue;
-        }
+
+        if (bv != NULL)
+            --keep;
 
         if (tv == NULL) {
             ++deleted;
@@ -209,8 +234,6 @@ char * fixup_commit_comment (const database_t * db,
             ++modified;
     }
 
-    assert (ffv == fixups_end);
-
     // Generate the commit comment.
     char * result;
     size_t res_size;
@@ -222,25 +245,41 @@ char * fixup_commit_comment (const database_t * db,
     fprintf (f, "Fix-up commit generated by crap-clone.  "
              "(~%zu +%zu -%zu =%zu)\n", modified, added, deleted, keep);
 
-    ffv = fixups;
-    for (file_t * i = db->files; i != db->files_end; ++i) {
-        version_t * bv = base_versions ?
-            version_live (base_versions[i - db->files]) : NULL;
-        version_t * tv = NULL;
-        if (ffv != fixups_end && ffv->file == i)
-            tv = ffv++->version;
-        else
-            tv = bv;
-
-        if (bv == tv) {
-            if (bv != NULL && keep <= deleted)
-                fprintf (f, "%s KEEP %s\n", bv->file->path, bv->version);
-            continue;
+    // We list whichever of the KEEP and DELETE lines are fewer.  Only for the
+    // KEEP lines do we need to go through all the files; otherwise, just list
+    // the fixups.
+    if (keep > deleted)
+        for (fixup_ver_t * ffv = fixups; ffv != fixups_end; ++ffv) {
+            version_t * bv = base_versions ?
+                version_live (base_versions[ffv->file - db->files]) : NULL;
+            version_t * tv = ffv->version;
+            if (bv != tv)
+                fprintf (f, "%s %s->%s\n", ffv->file->path,
+                         bv ? bv->version : "ADD",
+                         tv ? tv->version : "DELETE");
         }
-
-        if (tv != NULL || deleted <= keep)
-            fprintf (f, "%s %s->%s\n", i->path,
-                     bv ? bv->version : "ADD", tv ? tv->version : "DELETE");
+    else {
+        fixup_ver_t * ffv = fixups;
+        for (file_t * i = db->files; i != db->files_end; ++i) {
+            version_t * bv = base_versions ?
+                version_live (base_versions[i - db->files]) : NULL;
+            version_t * tv = NULL;
+            if (ffv != fixups_end && ffv->file == i)
+                tv = ffv++->version;
+            else
+                tv = bv;
+
+            if (bv == tv) {
+                if (bv != NULL)
+                    fprintf (f, "%s KEEP %s\n", bv->file->path, bv->version);
+                continue;
+            }
+
+            if (tv != NULL || deleted <= keep)
+                fprintf (f, "%s %s->%s\n", i->path, bv ? bv->version : "ADD",
+                         tv ? tv->version : "DELETE");
+        }
+        assert (ffv == fixups_end);
     }
 
     if (ferror (f))
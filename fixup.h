@@ -15,11 +15,10 @@ typedef struct fixup_ver {
     time_t time;                        ///< Timestamp of fix-up.
 } fixup_ver_t;
 
-/// Create the fixups for a tag (or branch).  @p branch_versions is a list of
-/// versions, and versions that differ on the @p tag are noted in the @p
+/// Create the fixups for a tag (or branch).  The current versions of the @p
+/// base branch (if any) that differ on the @p tag are noted in the @p
 /// tag->fixup list.
-void create_fixups (const struct database * db,
-                    struct version * const * branch_versions,
+void create_fixups (const struct database * db, const struct tag * base,
                     struct tag * tag);
 
 /// Select from the @p tag->fixups the list of @p fixups to be done before the
@@ -29,7 +28,7 @@ void fixup_list (fixup_ver_t ** fixups, fixup_ver_t ** fixups_end,
 
 /// Generate the commit message for a fixup list.
 char * fixup_commit_comment (const struct database * db,
-                             struct version * const * base_versions,
+                             const struct tag * base,
                              struct tag * tag,
                              fixup_ver_t * fixups,
                              fixup_ver_t * fixups_end);
@@ -7,14 +7,17 @@
 
 
 #define INDEX(P) *((size_t *) (heap->index_offset + (char *) (P)))
-#define LESS(P,Q) (heap->compare (Q, P) > 0)
+#define ARITY 4
 
 void heap_init (heap_t * heap, size_t offset,
+                heap_key_t * get_key, const void * context,
                 int (*compare) (const void *, const void *))
 {
     heap->entries = NULL;
     heap->entries_end = NULL;
     heap->index_offset = offset;
+    heap->get_key = get_key;
+    heap->context = context;
     heap->compare = compare;
 }
 
@@ -25,44 +28,60 @@ void heap_destroy (heap_t * heap)
 }
 
 
+static inline bool less (const heap_t * heap,
+                         const heap_entry_t * A, const heap_entry_t * B)
+{
+    if (A->key != B->key)
+        return A->key < B->key;
+    if (A->tie != B->tie)
+        return A->tie < B->tie;
+    return heap->compare != NULL && heap->compare (B->item, A->item) > 0;
+}
+
+
 /// The heap has a bubble at @c position; shuffle the bubble downwards to an
 /// appropriate point, and place @c item in it.
-static void shuffle_down (heap_t * heap, size_t position, void * item)
+static void shuffle_down (heap_t * heap, size_t position,
+                          const heap_entry_t * item)
 {
     size_t num_entries = heap->entries_end - heap->entries;
     while (1) {
-        size_t child = position * 2 + 1;
+        size_t child = position * ARITY + 1;
         if (child >= num_entries)
             break;
 
-        if (child + 1 < num_entries
-            && LESS (heap->entries[child + 1], heap->entries[child]))
-            ++child;
+        size_t last = child + ARITY < num_entries
+            ? child + ARITY : num_entries;
+        size_t best = child;
+        for (size_t i = child + 1; i < last; ++i)
+            if (less (heap, &heap->entries[i], &heap->entries[best]))
+                best = i;
 
-        if (LESS (item, heap->entries[child]))
+        if (!less (heap, &heap->entries[best], item))
             break;
 
-        heap->entries[position] = heap->entries[child];
-        INDEX (heap->entries[position]) = position;
-        position = child;
+        heap->entries[position] = heap->entries[best];
+        INDEX (heap->entries[position].item) = position;
+        position = best;
     }
 
-    heap->entries[position] = item;
-    INDEX (item) = position;
+    heap->entries[position] = *item;
+    INDEX (item->item) = position;
 }
 
 
 /// The heap has a bubble at @c position; shuffle the bubble upwards as far as
 /// might be needed to insert @c item, and then call @c shuffle_down.
-static void shuffle_up (heap_t * heap, size_t position, void * item)
+static void shuffle_up (heap_t * heap, size_t position,
+                        const heap_entry_t * item)
 {
     while (position > 0) {
-        size_t parent = (position - 1) >> 1;
-        if (!LESS (item, heap->entries[parent]))
+        size_t parent = (position - 1) / ARITY;
+        if (!less (heap, item, &heap->entries[parent]))
             break;
 
         heap->entries[position] = heap->entries[parent];
-        INDEX (heap->entries[position]) = position;
+        INDEX (heap->entries[position].item) = position;
         position = parent;
     }
 
@@ -74,41 +93,59 @@ void heap_insert (heap_t * heap, void * item)
 {
     assert (INDEX (item) == SIZE_MAX);
 
+    heap_entry_t entry;
+    entry.item = item;
+    heap->get_key (heap->context, item, &entry);
+
     // Create a bubble at the end.
     ARRAY_EXTEND (heap->entries);
 
-    shuffle_up (heap, heap->entries_end - heap->entries - 1, item);
+    shuffle_up (heap, heap->entries_end - heap->entries - 1, &entry);
 }
 
 
 void heap_remove (heap_t * heap, void * item)
 {
     assert (INDEX (item) != SIZE_MAX);
-    assert (heap->entries[INDEX (item)] == item);
+    assert (heap->entries[INDEX (item)].item == item);
 
     --heap->entries_end;
-    if (item != *heap->entries_end)
+    if (item != heap->entries_end->item) {
         // Shuffle the item from the end into the bubble.
-        shuffle_up (heap, INDEX (item), *heap->entries_end);
+        heap_entry_t last = *heap->entries_end;
+        shuffle_up (heap, INDEX (item), &last);
+    }
 
     INDEX (item) = SIZE_MAX;
 }
 
 
+bool heap_less (const heap_t * heap, const void * A, const void * B)
+{
+    heap_entry_t eA = { .item = (void *) A };
+    heap_entry_t eB = { .item = (void *) B };
+    heap->get_key (heap->context, A, &eA);
+    heap->get_key (heap->context, B, &eB);
+    return less (heap, &eA, &eB);
+}
+
+
 void * heap_front (heap_t * heap)
 {
     assert (!heap_empty (heap));
-    return heap->entries[0];
+    return heap->entries[0].item;
 }
 
 
 void * heap_pop (heap_t * heap)
 {
     assert (!heap_empty (heap));
-    void * result = heap->entries[0];
+    void * result = heap->entries[0].item;
     assert (INDEX (result) == 0);
-    if (--heap->entries_end != heap->entries)
-        shuffle_down (heap, 0, *heap->entries_end);
+    if (--heap->entries_end != heap->entries) {
+        heap_entry_t last = *heap->entries_end;
+        shuffle_down (heap, 0, &last);
+    }
 
     INDEX (result) = SIZE_MAX;
     return result;
@@ -3,13 +3,31 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
-/// Type used to store a heap.
+/// An entry in a heap.  The sort keys are computed once, when the item is
+/// inserted, and stored inline so that sifting does not chase pointers.
+typedef struct heap_entry {
+    uint64_t key;                       ///< Primary sort key.
+    uint64_t tie;                       ///< Secondary sort key.
+    void * item;
+} heap_entry_t;
+
+/// Function to fill in the @c key and @c tie of a heap entry for @c item.
+typedef void heap_key_t (const void * context, const void * item,
+                         heap_entry_t * entry);
+
+/// Type used to store a heap.  This is a 4-ary heap, ordered by key, then tie,
+/// and then by the compare function if that is non-NULL.
 typedef struct heap {
-    void ** entries;
-    void ** entries_end;
+    heap_entry_t * entries;
+    heap_entry_t * entries_end;
     size_t index_offset;
-    /// @c compare should return >0 if first arg is greater than second, and <=0
+    heap_key_t * get_key;
+    const void * context;               ///< Passed to @c get_key.
+    /// @c compare is only called for items with equal keys and ties.  It
+    /// should return >0 if first arg is greater than second, and <=0
     /// otherwise.  Thus either a strcmp or a '>' like predicate can be used.
     int (*compare) (const void *, const void *);
 } heap_t;
@@ -17,6 +35,7 @@ typedef struct heap {
 
 /// Initialise a new heap.
 void heap_init (heap_t * heap, size_t offset,
+                heap_key_t * get_key, const void * context,
                 int (*compare) (const void *, const void *));
 
 /// Destroy a heap.
@@ -34,10 +53,26 @@ void * heap_front (heap_t * heap);
 /// Return least item from a heap, after removing it.
 void * heap_pop (heap_t * heap);
 
+/// Does @c A sort before @c B in the heap order?  Neither need be in the heap.
+bool heap_less (const heap_t * heap, const void * A, const void * B);
+
 /// Is a heap empty?
 static inline bool heap_empty (heap_t * heap)
 {
     return heap->entries == heap->entries_end;
 }
 
+/// Map a time to a heap key, preserving order.  Times are clamped to +/-2^62,
+/// so the result fits in 63 bits.
+static inline uint64_t heap_time_key (time_t t)
+{
+    const int64_t limit = (int64_t) 1 << 62;
+    int64_t tt = t;
+    if (tt < -limit)
+        tt = -limit;
+    if (tt > limit - 1)
+        tt = limit - 1;
+    return (uint64_t) (tt + limit);
+}
+
 #endif
@@ -0,0 +1,1146 @@
+#include "import.h"
+#include "log.h"
+#include "pack.h"
+#include "sha1.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pipeline.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Number of branches to keep the trees of in memory.
+#define IMPORT_ACTIVE_BRANCHES 64
+
+/// Bytes of blob data to hold back, waiting for a commit to say where it goes.
+#define IMPORT_PENDING_LIMIT (64 << 20)
+
+#define MODE_DIR 040000
+
+/// An entry in a hash table keyed by name.
+typedef struct named {
+    char * name;
+    struct named * next;
+} named_t;
+
+typedef struct name_table {
+    named_t ** buckets;
+    size_t size;
+    size_t count;
+} name_table_t;
+
+/// A blob that has been read but not yet written to the pack.  We wait until
+/// a commit uses it, so that we know what path to take the delta base from.
+typedef struct blob {
+    named_t named;                      ///< Hex id, if not marked.
+    unsigned char sha[20];
+    unsigned char * data;
+    size_t len;
+} blob_t;
+
+typedef struct mark {
+    unsigned char sha[20];
+    bool known;
+    size_t commit;                      ///< Index in the commits, or SIZE_MAX.
+    blob_t * blob;                      ///< Blob data not yet written.
+} mark_t;
+
+typedef struct commit {
+    unsigned char sha[20];
+    unsigned char tree[20];
+    size_t parents;                     ///< Offset in the parent list.
+    size_t num_parents;
+} commit_t;
+
+typedef struct tree tree_t;
+
+typedef struct tree_entry {
+    char * name;
+    unsigned mode;
+    unsigned char sha[20];
+    tree_t * tree;                      ///< Subtree, or NULL if not loaded.
+} tree_entry_t;
+
+/// A tree, with the entries sorted by strcmp.  Git order differs slightly;
+/// that is only used when writing the tree out.
+struct tree {
+    tree_entry_t * entries;
+    tree_entry_t * entries_end;
+    bool dirty;                         ///< Changed since last written.
+    size_t object;                      ///< Last version written, if any,
+    unsigned char * data;               ///< kept as a delta base.
+    size_t len;
+};
+
+typedef struct branch {
+    named_t named;
+    size_t tip;                         ///< The commit index, or SIZE_MAX.
+    tree_entry_t root;
+    struct branch * lru_prev;           ///< Branches with a loaded tree.
+    struct branch * lru_next;
+    bool loaded;
+} branch_t;
+
+/// A ref as found in the repository.
+typedef struct ref {
+    named_t named;
+    unsigned char sha[20];
+} ref_t;
+
+/// The last blob written at a path, to use as a delta base.
+typedef struct path_base {
+    named_t named;
+    size_t object;
+    unsigned char * data;
+    size_t len;
+} path_base_t;
+
+typedef struct import {
+    FILE * in;
+    const char * git_dir;
+    bool force;
+    pthread_t thread;
+
+    char * line;                        ///< The current line.
+    size_t line_max;
+    bool pushed_back;                   ///< Re-read the current line.
+    bool done;                          ///< Seen the done command.
+    bool want_done;                     ///< The done command is required.
+
+    pack_t pack;
+    char * pack_dir;
+
+    mark_t * marks;
+    size_t num_marks;
+
+    commit_t * commits;
+    commit_t * commits_end;
+    size_t * parents;
+    size_t * parents_end;
+
+    name_table_t branches;
+    name_table_t paths;
+    name_table_t unmarked;              ///< Blobs without a mark, by id.
+    size_t pending_bytes;               ///< Data held in unmarked.
+    path_base_t stream_base;            ///< Last blob written in stream order.
+
+    branch_t * lru_first;
+    branch_t * lru_last;
+    size_t num_loaded;
+
+    import_stats_t stats;
+} import_t;
+
+
+static size_t name_hash (const char * s)
+{
+    size_t h = 5381;
+    for (; *s; ++s)
+        h = h * 33 + (unsigned char) *s;
+    return h;
+}
+
+
+static named_t * table_find (const name_table_t * t, const char * name)
+{
+    if (t->size == 0)
+        return NULL;
+
+    for (named_t * n = t->buckets[name_hash (name) & (t->size - 1)];
+         n; n = n->next)
+        if (strcmp (n->name, name) == 0)
+            return n;
+
+    return NULL;
+}
+
+
+static void table_insert (name_table_t * t, named_t * n)
+{
+    if (t->count >= t->size) {
+        size_t old_size = t->size;
+        named_t ** old = t->buckets;
+        t->size = old_size ? old_size * 2 : 64;
+        t->buckets = ARRAY_CALLOC (named_t *, t->size);
+        for (size_t i = 0; i != old_size; ++i)
+            for (named_t * j = old[i]; j;) {
+                named_t * next = j->next;
+                named_t ** h
+                    = &t->buckets[name_hash (j->name) & (t->size - 1)];
+                j->next = *h;
+                *h = j;
+                j = next;
+            }
+        free (old);
+    }
+
+    named_t ** h = &t->buckets[name_hash (n->name) & (t->size - 1)];
+    n->next = *h;
+    *h = n;
+    ++t->count;
+}
+
+
+static void table_remove (name_table_t * t, named_t * n)
+{
+    named_t ** p = &t->buckets[name_hash (n->name) & (t->size - 1)];
+    while (*p != n)
+        p = &(*p)->next;
+    *p = n->next;
+    --t->count;
+}
+
+
+/// Read the next line of the stream, without the line feed.  Returns false at
+/// the end of the stream.
+static bool next_line (import_t * im)
+{
+    if (im->pushed_back) {
+        im->pushed_back = false;
+        return true;
+    }
+
+    ssize_t len = getline (&im->line, &im->line_max, im->in);
+    if (len < 0) {
+        if (ferror (im->in))
+            fatal ("import: read failed: %s\n", strerror (errno));
+        return false;
+    }
+
+    if (len > 0 && im->line[len - 1] == '\n')
+        im->line[len - 1] = 0;
+    return true;
+}
+
+
+static void expect_line (import_t * im)
+{
+    if (!next_line (im))
+        fatal ("import: unexpected end of stream\n");
+}
+
+
+static size_t parse_mark (const char * s)
+{
+    char * end;
+    if (*s != ':')
+        fatal ("import: bad mark '%s'\n", s);
+    unsigned long m = strtoul (s + 1, &end, 10);
+    if (m == 0 || m == ULONG_MAX || (*end != 0 && *end != ' '))
+        fatal ("import: bad mark '%s'\n", s);
+    return m;
+}
+
+
+static mark_t * get_mark (import_t * im, size_t m)
+{
+    if (m >= im->num_marks) {
+        size_t old = im->num_marks;
+        im->num_marks = old ? old * 2 : 1024;
+        while (im->num_marks <= m)
+            im->num_marks *= 2;
+        im->marks = ARRAY_REALLOC (im->marks, im->num_marks);
+        for (size_t i = old; i != im->num_marks; ++i) {
+            im->marks[i].known = false;
+            im->marks[i].commit = SIZE_MAX;
+            im->marks[i].blob = NULL;
+        }
+    }
+
+    return &im->marks[m];
+}
+
+
+static mark_t * known_mark (import_t * im, const char * s)
+{
+    size_t m = parse_mark (s);
+    mark_t * mark = m < im->num_marks ? &im->marks[m] : NULL;
+    if (mark == NULL || !mark->known)
+        fatal ("import: unknown mark '%s'\n", s);
+    return mark;
+}
+
+
+/// Read the data command that follows, returning a malloc'd buffer.
+static unsigned char * parse_data (import_t * im, size_t * len)
+{
+    expect_line (im);
+    if (!starts_with (im->line, "data "))
+        fatal ("import: expected data, got '%s'\n", im->line);
+
+    const char * arg = im->line + 5;
+    if (starts_with (arg, "<<")) {
+        // Delimited data; each line includes its line feed.
+        char * delimiter = xstrdup (arg + 2);
+        char * data = NULL;
+        size_t data_len;
+        FILE * f = open_memstream (&data, &data_len);
+        while (true) {
+            expect_line (im);
+            if (strcmp (im->line, delimiter) == 0)
+                break;
+            fprintf (f, "%s\n", im->line);
+        }
+        fclose (f);
+        free (delimiter);
+        *len = data_len;
+        return (unsigned char *) data;
+    }
+
+    char * end;
+    unsigned long n = strtoul (arg, &end, 10);
+    if (*end != 0 || n == ULONG_MAX)
+        fatal ("import: bad data length '%s'\n", arg);
+
+    unsigned char * data = xmalloc (n + 1);
+    if (fread (data, 1, n, im->in) != n)
+        fatal ("import: unexpected end of stream in data\n");
+
+    // Skip the optional line feed.
+    int c = getc (im->in);
+    if (c != '\n' && c != EOF)
+        ungetc (c, im->in);
+
+    *len = n;
+    return data;
+}
+
+
+static void blob_free (blob_t * blob)
+{
+    if (blob == NULL)
+        return;
+
+    free (blob->named.name);
+    free (blob->data);
+    free (blob);
+}
+
+
+/// Write blob data as a delta against @c base.  The data is kept as the next
+/// base, and becomes owned by it.
+static void write_base_blob (import_t * im, path_base_t * base,
+                             unsigned char * data, size_t len,
+                             const unsigned char sha[20])
+{
+    size_t before = im->pack.objects_end - im->pack.objects;
+    size_t object = pack_add_delta (&im->pack, pack_blob, data, len, sha,
+                                    base->object, base->data, base->len);
+    if (object >= before)
+        ++im->stats.blobs;
+
+    free (base->data);
+    if (len <= PACK_DELTA_LIMIT) {
+        base->object = object;
+        base->data = data;
+        base->len = len;
+    }
+    else {
+        base->object = SIZE_MAX;
+        base->data = NULL;
+        base->len = 0;
+        free (data);
+    }
+}
+
+
+/// Write blob data used at @c path, as a delta against the last blob there.
+/// The data is kept as the next base, and becomes owned by the path.
+static void write_path_blob (import_t * im, const char * path,
+                             unsigned char * data, size_t len,
+                             const unsigned char sha[20])
+{
+    path_base_t * base = (path_base_t *) table_find (&im->paths, path);
+    if (base == NULL) {
+        base = xmalloc (sizeof (path_base_t));
+        base->named.name = xstrdup (path);
+        base->object = SIZE_MAX;
+        base->data = NULL;
+        base->len = 0;
+        table_insert (&im->paths, &base->named);
+    }
+
+    write_base_blob (im, base, data, len, sha);
+}
+
+
+static void import_blob (import_t * im)
+{
+    mark_t * mark = NULL;
+    expect_line (im);
+    if (starts_with (im->line, "mark "))
+        mark = get_mark (im, parse_mark (im->line + 5));
+    else
+        im->pushed_back = true;
+
+    blob_t * blob = xmalloc (sizeof (blob_t));
+    blob->named.name = NULL;
+    blob->data = parse_data (im, &blob->len);
+    pack_hash (pack_blob, blob->data, blob->len, blob->sha);
+
+    if (mark == NULL) {
+        // Keep it until a commit refers to it by id.
+        char hex[41];
+        sha1_hex (blob->sha, hex);
+        if (pack_find (&im->pack, blob->sha) != SIZE_MAX
+            || table_find (&im->unmarked, hex) != NULL) {
+            blob_free (blob);
+            return;
+        }
+        if (im->pending_bytes + blob->len > IMPORT_PENDING_LIMIT) {
+            // Too much held back, as when all the blobs come first; those are
+            // in file order, so the previous blob makes a good base.
+            write_base_blob (im, &im->stream_base,
+                             blob->data, blob->len, blob->sha);
+            free (blob);
+            return;
+        }
+        blob->named.name = xstrdup (hex);
+        table_insert (&im->unmarked, &blob->named);
+        im->pending_bytes += blob->len;
+        return;
+    }
+
+    blob_free (mark->blob);
+    memcpy (mark->sha, blob->sha, 20);
+    mark->known = true;
+    mark->commit = SIZE_MAX;
+    mark->blob = blob;
+}
+
+
+static tree_t * tree_new (void)
+{
+    tree_t * t = xmalloc (sizeof (tree_t));
+    t->entries = NULL;
+    t->entries_end = NULL;
+    t->dirty = true;
+    t->object = SIZE_MAX;
+    t->data = NULL;
+    t->len = 0;
+    return t;
+}
+
+
+static void tree_free (tree_t * t)
+{
+    if (t == NULL)
+        return;
+
+    for (tree_entry_t * i = t->entries; i != t->entries_end; ++i) {
+        free (i->name);
+        tree_free (i->tree);
+    }
+    free (t->entries);
+    free (t->data);
+    free (t);
+}
+
+
+static int compare_entries (const void * AA, const void * BB)
+{
+    const tree_entry_t * A = AA;
+    const tree_entry_t * B = BB;
+    return strcmp (A->name, B->name);
+}
+
+
+/// Load the directory @c dir from the pack, if it is not already in memory.
+static void tree_load (import_t * im, tree_entry_t * dir)
+{
+    if (dir->tree != NULL)
+        return;
+
+    size_t object = pack_find (&im->pack, dir->sha);
+    if (object == SIZE_MAX) {
+        char hex[41];
+        sha1_hex (dir->sha, hex);
+        fatal ("import: tree %s is not in the pack\n", hex);
+    }
+
+    size_t len;
+    unsigned char * data = pack_read (&im->pack, object, &len);
+    tree_t * t = tree_new();
+    t->dirty = false;
+    for (const unsigned char * p = data; p != data + len;) {
+        const unsigned char * space = memchr (p, ' ', data + len - p);
+        const unsigned char * nul = space
+            ? memchr (space, 0, data + len - space) : NULL;
+        if (nul == NULL || data + len - nul < 21)
+            fatal ("import: corrupt tree object\n");
+
+        ARRAY_EXTEND (t->entries);
+        tree_entry_t * e = t->entries_end - 1;
+        e->mode = strtoul ((const char *) p, NULL, 8);
+        e->name = xstrdup ((const char *) space + 1);
+        memcpy (e->sha, nul + 1, 20);
+        e->tree = NULL;
+        p = nul + 21;
+    }
+    t->object = object;
+    t->data = data;
+    t->len = len;
+
+    ARRAY_SORT (t->entries, compare_entries);
+    dir->tree = t;
+}
+
+
+/// Find the entry called @c name (of length @c len) in @c t, or the place to
+/// insert it.
+static tree_entry_t * tree_find (tree_t * t, const char * name, size_t len,
+                                 bool * found)
+{
+    tree_entry_t * lo = t->entries;
+    tree_entry_t * hi = t->entries_end;
+    while (lo != hi) {
+        tree_entry_t * mid = lo + (hi - lo) / 2;
+        int c = strncmp (mid->name, name, len);
+        if (c == 0)
+            c = mid->name[len] != 0;
+        if (c == 0) {
+            *found = true;
+            return mid;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *found = false;
+    return lo;
+}
+
+
+/// Set @c path, relative to the directory @c dir, to the object @c sha.
+static void tree_set (import_t * im, tree_entry_t * dir, const char * path,
+                      unsigned mode, const unsigned char sha[20])
+{
+    tree_load (im, dir);
+    tree_t * t = dir->tree;
+    t->dirty = true;
+
+    const char * slash = strchr (path, '/');
+    size_t len = slash ? (size_t) (slash - path) : strlen (path);
+    bool found;
+    tree_entry_t * e = tree_find (t, path, len, &found);
+    if (!found) {
+        size_t index = e - t->entries;
+        ARRAY_EXTEND (t->entries);
+        e = t->entries + index;
+        memmove (e + 1, e, (t->entries_end - e - 1) * sizeof (tree_entry_t));
+        e->name = xasprintf ("%.*s", (int) len, path);
+        e->mode = 0;
+        e->tree = NULL;
+    }
+
+    if (slash == NULL) {
+        tree_free (e->tree);
+        e->tree = NULL;
+        e->mode = mode;
+        memcpy (e->sha, sha, 20);
+        return;
+    }
+
+    if (e->mode != MODE_DIR) {
+        // A new directory, possibly replacing a file.
+        e->mode = MODE_DIR;
+        e->tree = tree_new();
+    }
+
+    tree_set (im, e, slash + 1, mode, sha);
+}
+
+
+/// Remove @c path, relative to the directory @c dir.  Directories left empty
+/// are removed too.
+static void tree_delete (import_t * im, tree_entry_t * dir, const char * path)
+{
+    tree_load (im, dir);
+    tree_t * t = dir->tree;
+
+    const char * slash = strchr (path, '/');
+    size_t len = slash ? (size_t) (slash - path) : strlen (path);
+    bool found;
+    tree_entry_t * e = tree_find (t, path, len, &found);
+    if (!found)
+        return;
+
+    if (slash != NULL) {
+        if (e->mode != MODE_DIR)
+            return;
+        tree_delete (im, e, slash + 1);
+        t->dirty = true;
+        if (e->tree->entries != e->tree->entries_end)
+            return;
+    }
+
+    free (e->name);
+    tree_free (e->tree);
+    memmove (e, e + 1, (t->entries_end - e - 1) * sizeof (tree_entry_t));
+    --t->entries_end;
+    t->dirty = true;
+}
+
+
+static int compare_git_order (const void * AA, const void * BB)
+{
+    const tree_entry_t * A = *(tree_entry_t * const *) AA;
+    const tree_entry_t * B = *(tree_entry_t * const *) BB;
+    size_t lA = strlen (A->name);
+    size_t lB = strlen (B->name);
+    size_t len = lA < lB ? lA : lB;
+    int c = memcmp (A->name, B->name, len);
+    if (c != 0)
+        return c;
+
+    // Directories sort as if they had a trailing slash.
+    unsigned char cA = lA > len ? A->name[len] : A->mode == MODE_DIR ? '/' : 0;
+    unsigned char cB = lB > len ? B->name[len] : B->mode == MODE_DIR ? '/' : 0;
+    return cA - cB;
+}
+
+
+/// Write out the changed trees under @c dir, and update its object id.
+static void tree_store (import_t * im, tree_entry_t * dir)
+{
+    tree_t * t = dir->tree;
+    if (t == NULL || !t->dirty)
+        return;
+
+    size_t count = t->entries_end - t->entries;
+    tree_entry_t ** sorted = ARRAY_ALLOC (tree_entry_t *, count);
+    for (size_t i = 0; i != count; ++i) {
+        if (t->entries[i].mode == MODE_DIR)
+            tree_store (im, &t->entries[i]);
+        sorted[i] = &t->entries[i];
+    }
+    qsort (sorted, count, sizeof *sorted, compare_git_order);
+
+    char * data = NULL;
+    size_t len;
+    FILE * f = open_memstream (&data, &len);
+    for (size_t i = 0; i != count; ++i) {
+        fprintf (f, "%o %s", sorted[i]->mode, sorted[i]->name);
+        putc (0, f);
+        fwrite (sorted[i]->sha, 1, 20, f);
+    }
+    fclose (f);
+    free (sorted);
+
+    // Store the tree as a delta against its previous version.
+    pack_hash (pack_tree, data, len, dir->sha);
+    size_t before = im->pack.objects_end - im->pack.objects;
+    size_t object = pack_add_delta (&im->pack, pack_tree, data, len, dir->sha,
+                                    t->object, t->data, t->len);
+    if (object >= before)
+        ++im->stats.trees;
+    free (t->data);
+    t->object = object;
+    t->data = (unsigned char *) data;
+    t->len = len;
+
+    t->dirty = false;
+}
+
+
+static void lru_unlink (import_t * im, branch_t * b)
+{
+    if (b->lru_prev)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        im->lru_first = b->lru_next;
+    if (b->lru_next)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        im->lru_last = b->lru_prev;
+    b->lru_prev = NULL;
+    b->lru_next = NULL;
+}
+
+
+/// Note that @c b is in use, and drop the trees of the least recently used
+/// branches if there are too many in memory.
+static void branch_touch (import_t * im, branch_t * b)
+{
+    if (b->loaded)
+        lru_unlink (im, b);
+    else {
+        b->loaded = true;
+        ++im->num_loaded;
+    }
+
+    b->lru_next = im->lru_first;
+    if (im->lru_first)
+        im->lru_first->lru_prev = b;
+    else
+        im->lru_last = b;
+    im->lru_first = b;
+
+    while (im->num_loaded > IMPORT_ACTIVE_BRANCHES) {
+        branch_t * old = im->lru_last;
+        tree_store (im, &old->root);
+        tree_free (old->root.tree);
+        old->root.tree = NULL;
+        old->loaded = false;
+        lru_unlink (im, old);
+        --im->num_loaded;
+    }
+}
+
+
+static branch_t * branch_get (import_t * im, const char * name)
+{
+    branch_t * b = (branch_t *) table_find (&im->branches, name);
+    if (b != NULL)
+        return b;
+
+    b = xmalloc (sizeof (branch_t));
+    b->named.name = xstrdup (name);
+    b->tip = SIZE_MAX;
+    b->root.name = NULL;
+    b->root.mode = MODE_DIR;
+    b->root.tree = tree_new();
+    b->lru_prev = NULL;
+    b->lru_next = NULL;
+    b->loaded = false;
+    table_insert (&im->branches, &b->named);
+    branch_touch (im, b);
+    return b;
+}
+
+
+/// Start @c b from the commit with mark @c s.
+static void branch_from (import_t * im, branch_t * b, const char * s)
+{
+    mark_t * mark = known_mark (im, s);
+    if (mark->commit == SIZE_MAX)
+        fatal ("import: mark '%s' is not a commit\n", s);
+
+    if (b->tip == mark->commit && b->root.tree != NULL)
+        return;                         // Already there.
+
+    b->tip = mark->commit;
+    tree_free (b->root.tree);
+    b->root.tree = NULL;
+    memcpy (b->root.sha, im->commits[mark->commit].tree, 20);
+}
+
+
+static void import_reset (import_t * im, const char * name)
+{
+    branch_t * b = branch_get (im, name);
+    b->tip = SIZE_MAX;
+    tree_free (b->root.tree);
+    b->root.tree = tree_new();
+    branch_touch (im, b);
+
+    if (!next_line (im))
+        return;
+    if (starts_with (im->line, "from "))
+        branch_from (im, b, im->line + 5);
+    else
+        im->pushed_back = true;
+}
+
+
+/// Parse the mode of an M command, accepting the short forms.
+static unsigned parse_mode (const char * s, const char ** end)
+{
+    unsigned mode = strtoul (s, (char **) end, 8);
+    if (mode == 0644 || mode == 0755)
+        mode |= 0100000;
+    if (mode != 0100644 && mode != 0100755 && mode != 0120000
+        && mode != 0160000)
+        fatal ("import: bad mode in '%s'\n", s);
+    return mode;
+}
+
+
+static void file_modify (import_t * im, branch_t * b, const char * args)
+{
+    const char * p;
+    unsigned mode = parse_mode (args, &p);
+    if (*p++ != ' ')
+        fatal ("import: bad modify command 'M %s'\n", args);
+
+    const char * path = strchr (p, ' ');
+    if (path == NULL)
+        fatal ("import: bad modify command 'M %s'\n", args);
+    ++path;
+
+    unsigned char sha[20];
+    if (starts_with (p, "inline ")) {
+        char * path_copy = xstrdup (path);
+        size_t len;
+        unsigned char * data = parse_data (im, &len);
+        pack_hash (pack_blob, data, len, sha);
+        write_path_blob (im, path_copy, data, len, sha);
+        tree_set (im, &b->root, path_copy, mode, sha);
+        free (path_copy);
+        return;
+    }
+
+    if (*p == ':') {
+        mark_t * mark = known_mark (im, p);
+        memcpy (sha, mark->sha, 20);
+        if (mark->blob) {
+            // The data now belongs to the path.
+            write_path_blob (im, path, mark->blob->data, mark->blob->len, sha);
+            free (mark->blob);
+            mark->blob = NULL;
+        }
+    }
+    else if (sha1_parse (p, sha) && p[40] == ' ') {
+        char hex[41];
+        sha1_hex (sha, hex);
+        blob_t * blob = (blob_t *) table_find (&im->unmarked, hex);
+        if (blob) {
+            table_remove (&im->unmarked, &blob->named);
+            im->pending_bytes -= blob->len;
+            write_path_blob (im, path, blob->data, blob->len, sha);
+            free (blob->named.name);
+            free (blob);
+        }
+    }
+    else
+        fatal ("import: bad data reference in 'M %s'\n", args);
+
+    tree_set (im, &b->root, path, mode, sha);
+}
+
+
+/// Does the commit @c tip contain the commit with id @c sha?
+static bool commit_contains (const import_t * im, size_t tip,
+                             const unsigned char sha[20])
+{
+    size_t count = im->commits_end - im->commits;
+    bool * seen = ARRAY_CALLOC (bool, count);
+    size_t * stack = ARRAY_ALLOC (size_t, count);
+    size_t depth = 0;
+    bool found = false;
+    stack[depth++] = tip;
+    seen[tip] = true;
+    while (depth != 0 && !found) {
+        const commit_t * c = &im->commits[stack[--depth]];
+        found = memcmp (c->sha, sha, 20) == 0;
+        for (size_t i = 0; i != c->num_parents; ++i) {
+            size_t p = im->parents[c->parents + i];
+            if (!seen[p]) {
+                seen[p] = true;
+                stack[depth++] = p;
+            }
+        }
+    }
+
+    free (seen);
+    free (stack);
+    return found;
+}
+
+
+static void import_commit (import_t * im, const char * name)
+{
+    branch_t * b = branch_get (im, name);
+    branch_touch (im, b);
+
+    mark_t * mark = NULL;
+    expect_line (im);
+    if (starts_with (im->line, "mark ")) {
+        mark = get_mark (im, parse_mark (im->line + 5));
+        expect_line (im);
+    }
+
+    char * author = NULL;
+    if (starts_with (im->line, "author ")) {
+        author = xstrdup (im->line + 7);
+        expect_line (im);
+    }
+    if (!starts_with (im->line, "committer "))
+        fatal ("import: expected committer, got '%s'\n", im->line);
+    char * committer = xstrdup (im->line + 10);
+
+    size_t message_len;
+    unsigned char * message = parse_data (im, &message_len);
+
+    size_t * merges = NULL;
+    size_t * merges_end = NULL;
+    while (next_line (im)) {
+        if (starts_with (im->line, "from ")) {
+            if (merges != merges_end)
+                fatal ("import: from must come before merge\n");
+            branch_from (im, b, im->line + 5);
+        }
+        else if (starts_with (im->line, "merge ")) {
+            mark_t * m = known_mark (im, im->line + 6);
+            if (m->commit == SIZE_MAX)
+                fatal ("import: merge '%s' is not a commit\n", im->line + 6);
+            ARRAY_APPEND (merges, m->commit);
+        }
+        else if (starts_with (im->line, "M "))
+            file_modify (im, b, im->line + 2);
+        else if (starts_with (im->line, "D "))
+            tree_delete (im, &b->root, im->line + 2);
+        else if (strcmp (im->line, "deleteall") == 0) {
+            tree_free (b->root.tree);
+            b->root.tree = tree_new();
+        }
+        else {
+            im->pushed_back = true;
+            break;
+        }
+    }
+
+    // The first parent is the branch tip, which a from command will have
+    // moved; then come the merges.
+    size_t parents = im->parents_end - im->parents;
+    if (b->tip != SIZE_MAX)
+        ARRAY_APPEND (im->parents, b->tip);
+    for (size_t * i = merges; i != merges_end; ++i)
+        ARRAY_APPEND (im->parents, *i);
+    free (merges);
+
+    tree_load (im, &b->root);
+    tree_store (im, &b->root);
+
+    char hex[41];
+    char * data = NULL;
+    size_t len;
+    FILE * f = open_memstream (&data, &len);
+    sha1_hex (b->root.sha, hex);
+    fprintf (f, "tree %s\n", hex);
+    for (size_t * i = im->parents + parents; i != im->parents_end; ++i) {
+        sha1_hex (im->commits[*i].sha, hex);
+        fprintf (f, "parent %s\n", hex);
+    }
+    fprintf (f, "author %s\ncommitter %s\n\n",
+             author ? author : committer, committer);
+    fwrite (message, 1, message_len, f);
+    fclose (f);
+
+    ARRAY_EXTEND (im->commits);
+    commit_t * c = im->commits_end - 1;
+    memcpy (c->tree, b->root.sha, 20);
+    c->parents = parents;
+    c->num_parents = im->parents_end - im->parents - parents;
+    pack_hash (pack_commit, data, len, c->sha);
+    pack_add (&im->pack, pack_commit, data, len, c->sha);
+    ++im->stats.commits;
+
+    b->tip = c - im->commits;
+    if (mark) {
+        blob_free (mark->blob);
+        mark->blob = NULL;
+        memcpy (mark->sha, c->sha, 20);
+        mark->known = true;
+        mark->commit = b->tip;
+    }
+
+    free (data);
+    free (author);
+    free (committer);
+    free (message);
+}
+
+
+static void * import_thread (void * p)
+{
+    import_t * im = p;
+
+    while (next_line (im)) {
+        if (im->line[0] == 0)
+            continue;
+        else if (strcmp (im->line, "blob") == 0)
+            import_blob (im);
+        else if (starts_with (im->line, "commit ")) {
+            char * name = xstrdup (im->line + 7);
+            import_commit (im, name);
+            free (name);
+        }
+        else if (starts_with (im->line, "reset ")) {
+            char * name = xstrdup (im->line + 6);
+            import_reset (im, name);
+            free (name);
+        }
+        else if (strcmp (im->line, "feature done") == 0)
+            im->want_done = true;
+        else if (strcmp (im->line, "done") == 0) {
+            im->done = true;
+            break;
+        }
+        else if (starts_with (im->line, "progress "))
+            fprintf (stderr, "%s\n", im->line + 9);
+        else if (strcmp (im->line, "checkpoint") != 0)
+            fatal ("import: unsupported command '%s'\n", im->line);
+    }
+
+    if (im->want_done && !im->done)
+        fatal ("import: stream ends early\n");
+
+    // Blobs that no commit used are written whole.
+    for (size_t i = 0; i < im->num_marks; ++i) {
+        blob_t * blob = im->marks[i].blob;
+        if (blob) {
+            size_t before = im->pack.objects_end - im->pack.objects;
+            if (pack_add (&im->pack, pack_blob, blob->data, blob->len,
+                          blob->sha) >= before)
+                ++im->stats.blobs;
+            blob_free (blob);
+            im->marks[i].blob = NULL;
+        }
+    }
+    for (size_t i = 0; i != im->unmarked.size; ++i)
+        for (named_t * n = im->unmarked.buckets[i]; n;) {
+            named_t * next = n->next;
+            blob_t * blob = (blob_t *) n;
+            size_t before = im->pack.objects_end - im->pack.objects;
+            if (pack_add (&im->pack, pack_blob, blob->data, blob->len,
+                          blob->sha) >= before)
+                ++im->stats.blobs;
+            blob_free (blob);
+            n = next;
+        }
+    free (im->unmarked.buckets);
+
+    im->stats.deltas = im->pack.deltas;
+    im->stats.raw_bytes = im->pack.raw_bytes;
+    im->stats.pack_bytes = im->pack.offset;
+    pack_finish (&im->pack, im->stats.pack);
+    return NULL;
+}
+
+
+import_t * import_start (int fd, const char * git_dir, bool force)
+{
+    import_t * im = xcalloc (sizeof (import_t));
+    im->in = fdopen (fd, "r");
+    if (im->in == NULL)
+        fatal ("fdopen failed: %s\n", strerror (errno));
+    setvbuf (im->in, NULL, _IOFBF, 1 << 20);
+
+    im->git_dir = git_dir;
+    im->force = force;
+
+    im->pack_dir = xasprintf ("%s/objects/pack", git_dir);
+    pack_init (&im->pack, im->pack_dir);
+    im->stream_base.object = SIZE_MAX;
+
+    int r = pthread_create (&im->thread, NULL, import_thread, im);
+    if (r != 0)
+        fatal ("Failed to create import thread: %s\n", strerror (r));
+
+    return im;
+}
+
+
+/// Read the current refs into a table.
+static void read_refs (name_table_t * refs)
+{
+    pipeline * pl = pipeline_new_command_args (
+        "git", "for-each-ref", "--format=%(objectname) %(refname)", NULL);
+    pipeline_want_infile (pl, "/dev/null");
+    pipeline_want_out (pl, -1);
+    pipeline_start (pl);
+
+    FILE * f = pipeline_get_outfile (pl);
+    char * line = NULL;
+    size_t line_max = 0;
+    ssize_t len;
+    while ((len = getline (&line, &line_max, f)) > 42) {
+        if (line[len - 1] == '\n')
+            line[len - 1] = 0;
+        ref_t * r = xmalloc (sizeof (ref_t));
+        r->named.name = xstrdup (line + 41);
+        if (!sha1_parse (line, r->sha))
+            fatal ("git for-each-ref: bad output '%s'\n", line);
+        table_insert (refs, &r->named);
+    }
+    free (line);
+
+    if (pipeline_wait (pl) != 0)
+        fatal ("git for-each-ref failed\n");
+    pipeline_free (pl);
+}
+
+
+static void free_table (name_table_t * t, bool with_data)
+{
+    for (size_t i = 0; i != t->size; ++i)
+        for (named_t * n = t->buckets[i]; n;) {
+            named_t * next = n->next;
+            if (with_data)
+                free (((path_base_t *) n)->data);
+            free (n->name);
+            free (n);
+            n = next;
+        }
+    free (t->buckets);
+}
+
+
+size_t import_finish (import_t * im, import_stats_t * stats)
+{
+    pthread_join (im->thread, NULL);
+    fclose (im->in);
+
+    name_table_t refs = { NULL, 0, 0 };
+    read_refs (&refs);
+
+    pipeline * pl = pipeline_new_command_args (
+        "git", "update-ref", "--stdin", NULL);
+    pipeline_want_in (pl, -1);
+    pipeline_start (pl);
+    FILE * update = pipeline_get_infile (pl);
+
+    size_t failures = 0;
+    for (size_t i = 0; i != im->branches.size; ++i)
+        for (named_t * n = im->branches.buckets[i]; n; n = n->next) {
+            branch_t * b = (branch_t *) n;
+            if (b->tip == SIZE_MAX)
+                continue;
+
+            char hex[41];
+            sha1_hex (im->commits[b->tip].sha, hex);
+            const ref_t * old = (ref_t *) table_find (&refs, n->name);
+            if (!im->force && old != NULL
+                && memcmp (old->sha, im->commits[b->tip].sha, 20) != 0
+                && !commit_contains (im, b->tip, old->sha)) {
+                char old_hex[41];
+                sha1_hex (old->sha, old_hex);
+                warning ("Not updating %s (new tip %s does not contain %s)\n",
+                         n->name, hex, old_hex);
+                ++failures;
+                continue;
+            }
+
+            fprintf (update, "update %s %s\n", n->name, hex);
+        }
+
+    if (pipeline_wait (pl) != 0)
+        fatal ("git update-ref failed\n");
+    pipeline_free (pl);
+    free_table (&refs, false);
+
+    if (stats)
+        *stats = im->stats;
+
+    for (size_t i = 0; i != im->branches.size; ++i)
+        for (named_t * n = im->branches.buckets[i]; n; n = n->next)
+            tree_free (((branch_t *) n)->root.tree);
+    free_table (&im->branches, false);
+    free_table (&im->paths, true);
+    free (im->stream_base.data);
+    free (im->marks);
+    free (im->commits);
+    free (im->parents);
+    free (im->line);
+    free (im->pack_dir);
+    free (im);
+
+    return failures;
+}
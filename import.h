@@ -0,0 +1,33 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct import;
+
+/// Counters describing an in-process import.
+typedef struct import_stats {
+    size_t blobs;                       ///< Blobs written.
+    size_t trees;                       ///< Trees written.
+    size_t commits;                     ///< Commits written.
+    size_t deltas;                      ///< Objects stored as deltas.
+    uint64_t raw_bytes;                 ///< Size of the objects written.
+    uint64_t pack_bytes;                ///< Size of the pack file.
+    char pack[41];                      ///< Name of the pack, or empty.
+} import_stats_t;
+
+/// Start importing the git-fast-import stream read from @c fd, on a separate
+/// thread.  Objects are written directly to a new pack in @c git_dir, with
+/// each blob stored as a delta against the previous blob at the same path
+/// where that is worthwhile.  Only the subset of the fast-import language that
+/// we generate is supported.
+struct import * import_start (int fd, const char * git_dir, bool force);
+
+/// Wait for the import to finish, and then update the refs.  Unless @c force
+/// was given, a ref is only moved to a commit that contains its current
+/// value.  Returns the number of refs that could not be updated.
+size_t import_finish (struct import * im, import_stats_t * stats);
+
+#endif
@@ -3,10 +3,14 @@
 #include "file.h"
 #include "log.h"
 #include "log_parse.h"
+#include "parallel.h"
 #include "string_cache.h"
 #include "utils.h"
 
 #include <assert.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,9 +21,15 @@
 #define REV_BOUNDARY "M ----------------------------"
 #define FILE_BOUNDARY "M ============================================================================="
 
+/// Bytes of rlog output to gather before handing them to a parsing thread.
+#define RLOG_CHUNK_SIZE (1 << 20)
+
 
 typedef struct tag_hash_item {
     string_hash_head_t head;
+    bool kept;                          ///< Used by a file, not filtered out.
+    bool tag_excluded;                  ///< Filtered out where a tag.
+    bool branch_excluded;               ///< Filtered out where a branch.
     tag_t tag;
 } tag_hash_item_t;
 
@@ -37,98 +47,293 @@ static inline bool is_digit (int x)
 }
 
 
-static tag_t * get_tag (string_hash_t * tags, const char * name)
+const regex_t * include_tags;
+const regex_t * exclude_tags;
+const regex_t * include_branches;
+const regex_t * exclude_branches;
+
+
+const char ** include_paths;
+const char ** include_paths_end;
+const char ** exclude_paths;
+const char ** exclude_paths_end;
+
+
+static bool path_matches (const char ** patterns, const char ** patterns_end,
+                          const char * path)
+{
+    for (const char ** i = patterns; i != patterns_end; ++i)
+        if (fnmatch (*i, path, FNM_LEADING_DIR) == 0)
+            return true;
+
+    return false;
+}
+
+
+static bool path_wanted (const char * path)
+{
+    return (include_paths == include_paths_end
+            || path_matches (include_paths, include_paths_end, path))
+        && !path_matches (exclude_paths, exclude_paths_end, path);
+}
+
+
+static bool name_wanted (const regex_t * include, const regex_t * exclude,
+                         const char * name)
+{
+    return (include == NULL || regexec (include, name, 0, NULL, 0) == 0)
+        && (exclude == NULL || regexec (exclude, name, 0, NULL, 0) != 0);
+}
+
+
+/// Find or add the hash item for the tag @c name.  The tag and branch filters
+/// are evaluated when a name is first seen, so each file only does a lookup.
+static tag_hash_item_t * get_tag_item (string_hash_t * tags, const char * name)
 {
     bool n;
     tag_hash_item_t * tag = string_hash_insert (tags, name,
                                                 sizeof (tag_hash_item_t), &n);
-    if (n)
+    if (n) {
         tag_init (&tag->tag, name);
+        tag->kept = false;
+        tag->tag_excluded = !name_wanted (include_tags, exclude_tags, name);
+        tag->branch_excluded = !name_wanted (include_branches,
+                                             exclude_branches, name);
+    }
+    return tag;
+}
+
+
+static tag_t * get_tag (string_hash_t * tags, const char * name)
+{
+    tag_hash_item_t * tag = get_tag_item (tags, name);
+    tag->kept = true;
     return &tag->tag;
 }
 
 
-/// Parse a date string into a time_t and an offset; the filled in time includes
-/// the offset and hence is a real Unix time.
-static bool parse_cvs_date (time_t * time, time_t * offset, const char * date)
+/// The kinds of rlog line that the parser dispatches on.
+typedef enum line_kind {
+    lk_other,
+    lk_rev_boundary,                    ///< REV_BOUNDARY.
+    lk_file_boundary,                   ///< FILE_BOUNDARY.
+    lk_mt,                              ///< "MT ..." (tagged text).
+    lk_tab,                             ///< "M \t..." (tag list entry).
+    lk_head,                            ///< "M head:".
+    lk_branch,                          ///< "M branch:".
+    lk_branches,                        ///< "M branches: ".
+    lk_locks,                           ///< "M locks:".
+    lk_access,                          ///< "M access list:".
+    lk_symbols,                         ///< "M symbolic names:".
+    lk_keyword,                         ///< "M keyword substitution:".
+    lk_total,                           ///< "M total revisions:".
+    lk_description,                     ///< "M description:".
+    lk_revision,                        ///< "M revision ".
+    lk_date,                            ///< "M date: ".
+} line_kind_t;
+
+
+/// Does the line @c l, of length @c len, start with the literal @c LIT?
+#define LINE_IS(l, len, LIT)                                    \
+    ((len) >= sizeof (LIT) - 1 && memcmp (l, LIT, sizeof (LIT) - 1) == 0)
+
+
+/// Classify a line of rlog output.  We dispatch on the byte after the "M ",
+/// so that each line is compared against at most a couple of literals.
+static line_kind_t line_kind (const char * l, size_t len)
+{
+    if (len < 3 || l[0] != 'M')
+        return lk_other;
+
+    if (l[1] == 'T')
+        return l[2] == ' ' ? lk_mt : lk_other;
+
+    if (l[1] != ' ')
+        return lk_other;
+
+    switch (l[2]) {
+    case '-':
+        if (len == sizeof (REV_BOUNDARY) - 1
+            && memcmp (l, REV_BOUNDARY, len) == 0)
+            return lk_rev_boundary;
+        break;
+    case '=':
+        if (len == sizeof (FILE_BOUNDARY) - 1
+            && memcmp (l, FILE_BOUNDARY, len) == 0)
+            return lk_file_boundary;
+        break;
+    case '\t':
+        return lk_tab;
+    case 'a':
+        if (LINE_IS (l, len, "M access list:"))
+            return lk_access;
+        break;
+    case 'b':
+        if (LINE_IS (l, len, "M branches: "))
+            return lk_branches;
+        if (LINE_IS (l, len, "M branch:"))
+            return lk_branch;
+        break;
+    case 'd':
+        if (LINE_IS (l, len, "M date: "))
+            return lk_date;
+        if (LINE_IS (l, len, "M description:"))
+            return lk_description;
+        break;
+    case 'h':
+        if (LINE_IS (l, len, "M head:"))
+            return lk_head;
+        break;
+    case 'k':
+        if (LINE_IS (l, len, "M keyword substitution:"))
+            return lk_keyword;
+        break;
+    case 'l':
+        if (LINE_IS (l, len, "M locks:"))
+            return lk_locks;
+        break;
+    case 'r':
+        if (LINE_IS (l, len, "M revision "))
+            return lk_revision;
+        break;
+    case 's':
+        if (LINE_IS (l, len, "M symbolic names:"))
+            return lk_symbols;
+        break;
+    case 't':
+        if (LINE_IS (l, len, "M total revisions:"))
+            return lk_total;
+        break;
+    }
+
+    return lk_other;
+}
+
+
+/// Is the line a boundary between revisions or files?
+static inline bool is_boundary (line_kind_t kind)
+{
+    return kind == lk_rev_boundary || kind == lk_file_boundary;
+}
+
+
+/// Read a run of digits, like strtoul but without the locale and sign
+/// handling.  Large values saturate rather than wrap.
+static unsigned long parse_digits (const char ** p)
+{
+    const char * d = *p;
+    unsigned long result = 0;
+    for (; is_digit (*d); ++d)
+        if (result < 100000000)
+            result = result * 10 + *d - '0';
+
+    *p = d;
+    return result;
+}
+
+
+/// Days from 1970-01-01 to the given proleptic Gregorian date, with @c month
+/// in [1,12].  Out-of-range days carry over linearly, as with timegm.
+static time_t days_from_civil (long year, unsigned month, long day)
+{
+    year -= month <= 2;
+    long era = (year >= 0 ? year : year - 399) / 400;
+    long yoe = year - era * 400;
+    long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+
+/// Parse a date string, running to @c end, into a time_t and an offset; the
+/// filled in time includes the offset and hence is a real Unix time.
+static bool parse_cvs_date (time_t * time, time_t * offset,
+                            const char * date, const char * end)
 {
     // We parse (YY|YYYY)[-/]MM[-/]DD HH:MM(:SS)?( (+|-)HH(MM?))?  This is just
     // like cvsps.  We are a little looser about the digit sequences.
     if (!is_digit (date[0]) || !is_digit (date[1]))
         return false;
 
-    struct tm dtm;
+    // Revisions are mostly committed in runs on the same day, so cache the
+    // last day converted.  This is per-thread, as the log is parsed in
+    // parallel.
+    static __thread long last_year = -1;
+    static __thread unsigned last_month;
+    static __thread unsigned last_mday;
+    static __thread time_t last_days;
 
-    dtm.tm_year = 0;
-    if (date[2] != ':')
-        dtm.tm_year = -1900;
+    long year_base = date[2] != ':' ? 0 : 1900;
 
-    char * d;
-    unsigned long year = strtoul (date, &d, 10);
+    const char * d = date;
+    unsigned long year = parse_digits (&d);
     if (year >= 10000 || (*d != '-' && *d != '/'))
         return false;
 
     ++d;
-    dtm.tm_year += year;
-
-    dtm.tm_mon = strtoul (d, &d, 10) - 1;
-    if (dtm.tm_mon < 0 || dtm.tm_mon > 11 || (*d != '-' && *d != '/'))
+    unsigned long month = parse_digits (&d);
+    if (month < 1 || month > 12 || (*d != '-' && *d != '/'))
         return false;
 
     ++d;
-    dtm.tm_mday = strtoul (d, &d, 10);
-    if (dtm.tm_mday < 1 || dtm.tm_mday > 31 || *d++ != ' ')
+    unsigned long mday = parse_digits (&d);
+    if (mday < 1 || mday > 31 || *d++ != ' ')
         return false;
 
-    dtm.tm_hour = strtoul (d, &d, 10);
-    if (dtm.tm_hour < 0 || dtm.tm_hour > 24 || *d++ != ':')
+    unsigned long hour = parse_digits (&d);
+    if (hour > 24 || *d++ != ':')
         return false;
 
-    dtm.tm_min = strtoul (d, &d, 10);
-    if (dtm.tm_min < 0 || dtm.tm_min > 59)
+    unsigned long min = parse_digits (&d);
+    if (min > 59)
         return false;
 
-    if (*d == ':') {
+    unsigned long sec = 0;
+    if (d != end && *d == ':') {
         ++d;
-        dtm.tm_sec = strtoul (d, &d, 10);
-        if (dtm.tm_sec < 0 || dtm.tm_sec > 60)
+        sec = parse_digits (&d);
+        if (sec > 60)
             return false;
     }
-    else
-        dtm.tm_sec = 0;
 
-    if (*d == 0) {
-        *time = timegm (&dtm);
-        *offset = 0;
-        return true;
-    }
-    if (*d++ != ' ')
-        return false;
+    time_t off = 0;
+    int sign = 0;
+    if (d != end) {
+        if (*d++ != ' ')
+            return false;
 
-    int sign;
-    if (*d == '+')
-        sign = 1;
-    else if (*d == '-')
-        sign = -1;
-    else
-        return false;
+        if (*d == '+')
+            sign = 1;
+        else if (*d == '-')
+            sign = -1;
+        else
+            return false;
 
-    if (!is_digit (d[1]) || !is_digit (d[2]))
-        return false;
+        if (end - d < 3 || !is_digit (d[1]) || !is_digit (d[2]))
+            return false;
 
-    time_t off = (d[1] - '0') * 36000 + (d[2] - '0') * 3600;
-    d += 3;
+        off = (d[1] - '0') * 36000 + (d[2] - '0') * 3600;
+        d += 3;
 
-    if (*d != 0) {
-        if (!is_digit (d[0]) || !is_digit (d[1]))
+        if (d != end) {
+            if (end - d < 2 || !is_digit (d[0]) || !is_digit (d[1]))
+                return false;
+            off += (d[0] - '0') * 600 + (d[1] - '0') * 60;
+            d += 2;
+        }
+        if (d != end)
             return false;
-        off += (d[0] - '0') * 600 + (d[1] - '0') * 60;
-        d += 2;
     }
-    if (*d != 0)
-        return false;
 
-    *time = timegm (&dtm) - sign * off;
+    long full_year = year + year_base;
+    if (full_year != last_year || month != last_month || mday != last_mday) {
+        last_year = full_year;
+        last_month = month;
+        last_mday = mday;
+        last_days = days_from_civil (full_year, month, mday);
+    }
+
+    *time = last_days * 86400 + hour * 3600 + min * 60 + sec - sign * off;
     *offset = off;
     return true;
 }
@@ -283,18 +488,6 @@ static int compare_file_tag (const void * AA, const void * BB)
 }
 
 
-static int compare_versionp (const void * AA, const void * BB)
-{
-    version_t * const * A = AA;
-    version_t * const * B = BB;
-    if ((*A)->file < (*B)->file)
-        return -1;
-    if ((*A)->file > (*B)->file)
-        return 1;
-    return 0;
-}
-
-
 static int compare_branch (const void * AA, const void * BB)
 {
     const file_tag_t * A = AA;
@@ -364,9 +557,13 @@ static void fill_in_parents (file_t * file)
         char vers[1 + strlen (v->version)];
         strcpy (vers, v->version);
         v->parent = NULL;
-        while (predecessor (vers)) {
+        // The lines count is relative to the first predecessor only.
+        bool delta_parent = true;
+        for (; predecessor (vers); delta_parent = false) {
             v->parent = file_find_version (file, vers);
             if (v->parent) {
+                v->unchanged = v->unchanged && delta_parent && !v->dead
+                    && !v->parent->dead;
                 // The parent of an implicit merge should be an implicit merge
                 // if possible.
                 if (v->implicit_merge && v->parent != file->versions_end
@@ -379,6 +576,9 @@ static void fill_in_parents (file_t * file)
                 break;
             }
         }
+        if (v->parent == NULL)
+            v->unchanged = false;
+
         // Special case:  n.0 has the previous x.y version as parent.
         const char * dot = strchr(v->version, '.');
         if (!dot)
@@ -394,11 +594,72 @@ static void fill_in_parents (file_t * file)
 }
 
 
+/// Does the version @c v lie on the branch @c branch, or on a branch off it?
+static bool on_branch (const char * v, const char * branch)
+{
+    size_t len = strlen (branch);
+    return strncmp (v, branch, len) == 0 && v[len] == '.';
+}
+
+
+/// Remove the versions on the @c excluded branches, and the tags and branches
+/// on those versions.  A branch that also has a name that is kept stays.  A
+/// kept branch sprouting from an excluded one loses the file, with a warning.
+static void drop_excluded_versions (file_t * file,
+                                    file_tag_t * file_tags,
+                                    file_tag_t ** file_tags_end,
+                                    const char ** excluded,
+                                    const char ** excluded_end)
+{
+    const char ** e = excluded;
+    for (const char ** i = excluded; i != excluded_end; ++i) {
+        bool kept = false;
+        for (file_tag_t * j = file_tags; j != *file_tags_end; ++j)
+            kept |= j->version == *i;   // The strings are cached.
+        if (!kept)
+            *e++ = *i;
+    }
+    excluded_end = e;
+
+    if (excluded == excluded_end)
+        return;
+
+    version_t * vv = file->versions;
+    for (version_t * v = file->versions; v != file->versions_end; ++v) {
+        bool drop = false;
+        for (const char ** i = excluded; i != excluded_end; ++i)
+            drop |= on_branch (v->version, *i);
+        if (!drop)
+            *vv++ = *v;
+    }
+    file->versions_end = vv;
+
+    file_tag_t * tt = file_tags;
+    for (file_tag_t * t = file_tags; t != *file_tags_end; ++t) {
+        bool drop = false;
+        for (const char ** i = excluded; i != excluded_end; ++i)
+            drop |= on_branch (t->version, *i);
+        if (!drop)
+            *tt++ = *t;
+        else if (is_branch (t->version))
+            warning ("%s: Branch %s (%s) sprouts from an excluded branch;"
+                     " the file is left off it.\n",
+                     file->path, t->tag->tag, t->version);
+    }
+    *file_tags_end = tt;
+}
+
+
 static void fill_in_versions_and_parents (file_t * file, bool attic,
                                           file_tag_t * file_tags,
                                           file_tag_t * file_tags_end,
+                                          const char ** excluded,
+                                          const char ** excluded_end,
                                           string_hash_t * tags)
 {
+    drop_excluded_versions (file, file_tags, &file_tags_end,
+                            excluded, excluded_end);
+
     ARRAY_SORT (file->versions, compare_version);
     ARRAY_TRIM (file->versions);
 
@@ -503,7 +764,7 @@ static void fill_in_versions_and_parents (file_t * file, bool attic,
 
 static size_t read_mt_key_values (file_t * file,
                                   version_t * version,
-                                  cvs_connection_t * s)
+                                  cvs_connection_t * s, size_t len)
 {
     bool have_date = false;
 
@@ -511,45 +772,49 @@ static size_t read_mt_key_values (file_t * file,
     bool author_next = false;
     bool commitid_next = false;
 
-    size_t len;
     do {
-        if (starts_with (s->line, "MT date ")) {
-            if (!parse_cvs_date (&version->time, &version->offset, s->line + 8))
+        const char * l = s->line;
+        bool text = LINE_IS (l, len, "MT text ");
+        if (LINE_IS (l, len, "MT date ")) {
+            if (!parse_cvs_date (&version->time, &version->offset,
+                                 l + 8, l + len))
                 fatal ("Log (%s) date line has unknown format: %s\n",
-                       file->rcs_path, s->line);
+                       file->rcs_path, l);
             have_date = true;
         }
         if (author_next) {
-            if (!starts_with (s->line, "MT text "))
+            if (!text)
                 fatal ("Log (%s) author line is not text: %s\n",
-                       file->rcs_path, s->line);
-            version->author = cache_string (s->line + 8);
+                       file->rcs_path, l);
+            version->author = cache_string_n (l + 8, len - 8);
             author_next = false;
         }
         if (state_next) {
-            if (!starts_with (s->line, "MT text "))
+            if (!text)
                 fatal ("Log (%s) state line is not text: %s\n",
-                       file->rcs_path, s->line);
-            version->dead = starts_with (s->line, "MT text dead");
+                       file->rcs_path, l);
+            version->dead = LINE_IS (l, len, "MT text dead");
             state_next = false;
         }
         if (commitid_next) {
-            if (!starts_with (s->line, "MT text "))
+            if (!text)
                 fatal ("Log (%s) commitid line is not text: %s\n",
-                       file->rcs_path, s->line);
-            version->commitid = cache_string (s->line + 8);
+                       file->rcs_path, l);
+            version->commitid = cache_string_n (l + 8, len - 8);
             commitid_next = false;
         }
-        if (ends_with (s->line, " author: "))
-            author_next = true;
-        if (ends_with (s->line, " state: "))
-            state_next = true;
-        if (ends_with (s->line, " commitid: "))
-            commitid_next = true;
+        if (l[len - 1] == ' ') {
+            if (ends_with (l, " author: "))
+                author_next = true;
+            if (ends_with (l, " state: "))
+                state_next = true;
+            if (ends_with (l, " commitid: "))
+                commitid_next = true;
+        }
 
         len = next_line (s);
     }
-    while (starts_with (s->line, "MT "));
+    while (line_kind (s->line, len) == lk_mt);
 
     if (!have_date)
         fatal ("Log (%s) does not have date.\n", file->rcs_path);
@@ -573,22 +838,34 @@ static void read_m_key_values (file_t * file, version_t * version,
         if (end == NULL)
             break;
 
-        if (starts_with (l, "date: ")) {
-            l += 6;
-            char date[end - l + 1];
-            memcpy (date, l, end - l);
-            date[end - l] = 0;
-            if (!parse_cvs_date (&version->time, &version->offset, date))
-                fatal ("Log (%s) date has unknown format: %s\n",
-                       file->rcs_path, date);
-            have_date = true;
+        size_t len = end - l + 1;
+        switch (l[0]) {
+        case 'd':
+            if (LINE_IS (l, len, "date: ")) {
+                if (!parse_cvs_date (&version->time, &version->offset,
+                                     l + 6, end))
+                    fatal ("Log (%s) date has unknown format: %.*s\n",
+                           file->rcs_path, (int) (end - l - 6), l + 6);
+                have_date = true;
+            }
+            break;
+        case 'a':
+            if (LINE_IS (l, len, "author: "))
+                version->author = cache_string_n (l + 8, end - l - 8);
+            break;
+        case 's':
+            if (LINE_IS (l, len, "state: dead"))
+                version->dead = true;
+            break;
+        case 'c':
+            if (LINE_IS (l, len, "commitid: "))
+                version->commitid = cache_string_n (l + 10, end - l - 10);
+            break;
+        case 'l':
+            if (LINE_IS (l, len, "lines: +0 -0;"))
+                version->unchanged = true;
+            break;
         }
-        else if (starts_with (l, "author: "))
-            version->author = cache_string_n (l + 8, end - l - 8);
-        else if (starts_with (l, "state: dead"))
-            version->dead = true;
-        else if (starts_with (l, "commitid: "))
-            version->commitid = cache_string_n (l + 10, end - l - 10);
 
         l = end + 1;
         if (l[0] == ' ' && l[1] == ' ')
@@ -603,18 +880,21 @@ static void read_m_key_values (file_t * file, version_t * version,
 }
 
 
-static void read_file_version (file_t * file, cvs_connection_t * s)
+/// Read one revision, starting at its "revision" line of length @c len.
+/// Returns the length of the boundary line that ends it.
+static size_t read_file_version (file_t * file, cvs_connection_t * s,
+                                 size_t len)
 {
-    if (!starts_with (s->line, "M revision "))
+    if (line_kind (s->line, len) != lk_revision)
         fatal ("Log (%s) did not have expected 'revision' line: %s\n",
                file->rcs_path, s->line);
 
     version_t * version = file_new_version (file);
 
     const char * vstr = s->line + 11;
-    char * tab = strchr (vstr, '\t');
+    const char * tab = memchr (vstr, '\t', len - 11);
 
-    version->version = cache_string_n (vstr, tab ? tab - vstr : strlen (vstr));
+    version->version = cache_string_n (vstr, tab ? tab - vstr : len - 11);
     if (!valid_version (version->version))
         fatal ("Log (%s) has malformed version %s\n",
                file->rcs_path, version->version);
@@ -625,10 +905,11 @@ static void read_file_version (file_t * file, cvs_connection_t * s)
     version->children = NULL;
     version->sibling = NULL;
 
-    size_t len = next_line (s);
-    if (starts_with (s->line, "MT "))
-        len = read_mt_key_values (file, version, s);
-    else if (starts_with (s->line, "M date: ")) {
+    len = next_line (s);
+    line_kind_t kind = line_kind (s->line, len);
+    if (kind == lk_mt)
+        len = read_mt_key_values (file, version, s, len);
+    else if (kind == lk_date) {
         read_m_key_values (file, version, s->line + 2);
         len = next_line (s);
     }
@@ -638,20 +919,23 @@ static void read_file_version (file_t * file, cvs_connection_t * s)
 
     // We don't care about the 'branches:' annotation; we reconstruct the branch
     // information ourselves.
-    if (starts_with (s->line, "M branches: "))
+    kind = line_kind (s->line, len);
+    if (kind == lk_branches) {
         len = next_line (s);
+        kind = line_kind (s->line, len);
+    }
 
     // Snarf the log entry.
     char * log = NULL;
     size_t log_len = 0;
-    while (strcmp (s->line, REV_BOUNDARY) != 0
-           && strcmp (s->line, FILE_BOUNDARY) != 0) {
+    while (!is_boundary (kind)) {
         log = xrealloc (log, log_len + len + 1);
         memcpy (log + log_len, s->line + 2, len - 2);
         log_len += len - 1;
         log[log_len - 1] = '\n';
 
         len = next_line (s);
+        kind = line_kind (s->line, len);
     }
 
     version->log = cache_string_n (log, log_len);
@@ -665,27 +949,29 @@ static void read_file_version (file_t * file, cvs_connection_t * s)
         file->versions_end[-1] = file->versions_end[-2];
         file->versions_end[-1].implicit_merge = true;
     }
+
+    return len;
 }
 
 
-static void read_file_versions (database_t * db,
-                                string_hash_t * tags,
-                                cvs_connection_t * s)
+/// Read the rlog output for one file, starting at its "RCS file:" line of
+/// length @c len.  Returns the length of the line following the file.
+static size_t read_file_versions (database_t * db,
+                                  string_hash_t * tags,
+                                  cvs_connection_t * s, size_t len)
 {
-    if (!starts_with (s->line, "M RCS file: /"))
+    if (!LINE_IS (s->line, len, "M RCS file: /"))
         fatal ("Expected RCS file line, not %s\n", s->line);
 
-    size_t len = strlen (s->line);
     if ((s->line)[len - 1] != 'v' || (s->line)[len - 2] != ',')
         fatal ("RCS file name does not end with ',v': %s\n", s->line);
 
-    file_t * file = database_new_file (db);
-    file->rcs_path = cache_string_n (s->line + 12, len - 12);
-
     if (!starts_with (s->line + 12, s->prefix))
         fatal ("RCS file name '%s' does not start with prefix '%s'\n",
                s->line + 12, s->prefix);
 
+    const char * rcs_path = cache_string_n (s->line + 12, len - 12);
+
     (s->line)[len - 2] = 0;                 // Remove the ',v'
     char * last_slash = strrchr (s->line, '/');
     bool attic = false;
@@ -697,33 +983,51 @@ static void read_file_versions (database_t * db,
         memmove (last_slash - 6, last_slash, strlen (last_slash) + 1);
     }
 
-    file->path = cache_string (s->line + 12 + strlen (s->prefix));
+    const char * path = s->line + 12 + strlen (s->prefix);
+    if (!path_wanted (path)) {
+        // Skip to the next file, without looking at the tags or versions.
+        do {
+            len = next_line (s);
+            if (!LINE_IS (s->line, len, "M"))
+                fatal ("Log (%s) incorrectly terminated\n", rcs_path);
+        }
+        while (line_kind (s->line, len) != lk_file_boundary);
+        return next_line (s);
+    }
+
+    file_t * file = database_new_file (db);
+    file->rcs_path = rcs_path;
+    file->path = cache_string (path);
 
     file_tag_t * file_tags = NULL;
     file_tag_t * file_tags_end = NULL;
 
+    // The branch versions of branches that are filtered out.
+    const char ** excluded = NULL;
+    const char ** excluded_end = NULL;
+
     // Add a fake branch for the trunk.
     const char * empty_string = cache_string ("");
     ARRAY_EXTEND (file_tags);
     file_tags_end[-1].tag = get_tag (tags, empty_string);
     file_tags_end[-1].version = empty_string;
 
-    do
+    line_kind_t kind;
+    do {
         len = next_line (s);
-    while (starts_with (s->line, "M head:") ||
-           starts_with (s->line, "M branch:") ||
-           starts_with (s->line, "M locks:") ||
-           starts_with (s->line, "M access list:") ||
-           starts_with (s->line, "M \t"));
+        kind = line_kind (s->line, len);
+    }
+    while (kind == lk_head || kind == lk_branch || kind == lk_locks
+           || kind == lk_access || kind == lk_tab);
 
-    if (!starts_with (s->line, "M symbolic names:"))
+    if (kind != lk_symbols)
         fatal ("Log (%s) did not have expected tag list: %s\n",
                file->rcs_path, s->line);
 
     len = next_line (s);
 
-    while (starts_with (s->line, "M \t")) {
-        char * colon = strrchr (s->line, ':');
+    while (line_kind (s->line, len) == lk_tab) {
+        char * colon = memrchr (s->line, ':', len);
         if (colon == NULL)
             fatal ("Tag on (%s) did not have version: %s\n",
                    file->rcs_path, s->line);
@@ -738,45 +1042,58 @@ static void read_file_versions (database_t * db,
             fatal ("Tag %s on (%s) has bogus version '%s'\n",
                    tag_name, file->rcs_path, colon);
 
-        ARRAY_EXTEND (file_tags);
-        file_tags_end[-1].tag = get_tag (tags, tag_name);
-        file_tags_end[-1].version = cache_string (colon);
+        tag_hash_item_t * tag = get_tag_item (tags, tag_name);
+        bool branch = is_branch (colon);
+        if (branch ? tag->branch_excluded : tag->tag_excluded) {
+            if (branch)
+                ARRAY_APPEND (excluded, cache_string (colon));
+        }
+        else {
+            tag->kept = true;
+            ARRAY_EXTEND (file_tags);
+            file_tags_end[-1].tag = &tag->tag;
+            file_tags_end[-1].version = cache_string (colon);
+        }
 
         len = next_line (s);
     }
 
-    while (starts_with (s->line, "M keyword substitution:") ||
-           starts_with (s->line, "M total revisions:"))
+    kind = line_kind (s->line, len);
+    while (kind == lk_keyword || kind == lk_total) {
         len = next_line (s);
+        kind = line_kind (s->line, len);
+    }
 
-    if (!starts_with (s->line, "M description:"))
+    if (kind != lk_description)
         fatal ("Log (%s) did not have expected 'description' item: %s\n",
                file->rcs_path, s->line);
 
     // Just skip until a boundary.  Too bad if a log entry contains one of
     // the boundary strings.
-    while (strcmp (s->line, REV_BOUNDARY) != 0
-           && strcmp (s->line, FILE_BOUNDARY) != 0) {
-        if (!starts_with (s->line, "M "))
+    while (!is_boundary (kind)) {
+        if (!LINE_IS (s->line, len, "M "))
             fatal ("Log (%s) description incorrectly terminated\n",
                    file->rcs_path);
         len = next_line (s);
+        kind = line_kind (s->line, len);
     }
 
-    while (strcmp (s->line, FILE_BOUNDARY) != 0) {
-        len = next_line (s);
-        read_file_version (file, s);
+    while (kind != lk_file_boundary) {
+        len = read_file_version (file, s, next_line (s));
+        kind = line_kind (s->line, len);
     }
 
-    next_line (s);
+    len = next_line (s);
 
-    fill_in_versions_and_parents (file, attic, file_tags, file_tags_end, tags);
+    fill_in_versions_and_parents (file, attic, file_tags, file_tags_end,
+                                  excluded, excluded_end, tags);
 
     xfree (file_tags);
+    xfree (excluded);
+    return len;
 }
 
 
-// Compare paths; we are careful to put files in the same directory together.
 static int compare_file (const void * AA, const void * BB)
 {
     return compare_paths (
@@ -834,23 +1151,51 @@ static void trim_dead_branch_additions (tag_t * branch)
 }
 
 
-void read_files_versions (database_t * db, cvs_connection_t * s)
+/// Sort the tag version lists, and set the initial branch version lists, for
+/// a range of tags.
+static void prepare_tags (void * dbp, size_t begin, size_t end)
 {
-    database_init (db);
+    database_t * db = dbp;
+    for (tag_t * i = db->tags + begin; i != db->tags + end; ++i) {
+        // On a branch, remove initial versions if they appear to be dead
+        // revisions created for subsequent branch additions.
+        if (i->branch_versions)
+            trim_dead_branch_additions (i);
 
-    string_hash_t tags;
-    string_hash_init (&tags);
+        ARRAY_TRIM (i->tag_files);
+        ARRAY_RADIX_SORT (i->tag_files, version_file_key);
+        if (i->branch_versions) {
+            i->branch_versions = ARRAY_CALLOC (version_t *,
+                                               db->files_end - db->files);
+            for (version_t ** j = i->tag_files; j != i->tag_files_end; ++j)
+                branch_set_version (i, (*j)->file - db->files, *j);
+        }
+
+        i->is_released = false;
+    }
+}
 
-    next_line (s);
+
+/// Read the output of an rlog command, up to the "ok".
+static void read_rlog (database_t * db, string_hash_t * tags,
+                       cvs_connection_t * s)
+{
+    size_t len = next_line (s);
 
     while (strcmp (s->line, "ok") != 0)
         if (strcmp (s->line, "M ") == 0)
-            next_line (s);
+            len = next_line (s);
         else
-            read_file_versions (db, &tags, s);
+            len = read_file_versions (db, tags, s, len);
+}
 
+
+/// Put the files in order and build the tag array, once the rlog output has
+/// all been read.
+static void finish_files_versions (database_t * db, string_hash_t * tags)
+{
     // Sort the list of files.
-    ARRAY_SORT (db->files, compare_file);
+    ARRAY_PSORT (db->files, compare_file);
 
     // Set the pointers from versions to files.
     for (file_t * f = db->files; f != db->files_end; ++f)
@@ -858,19 +1203,21 @@ void read_files_versions (database_t * db, cvs_connection_t * s)
             j->file = f;
 
     // Flatten the hash of tags to an array.
-    db->tags = ARRAY_ALLOC (tag_t, tags.num_entries);
+    db->tags = ARRAY_ALLOC (tag_t, tags->num_entries);
     db->tags_end = db->tags;
 
-    for (tag_hash_item_t * i = string_hash_begin (&tags);
-         i; i = string_hash_next (&tags, i))
-        *db->tags_end++ = i->tag;
+    // Names seen only where filtered out are left behind.
+    for (tag_hash_item_t * i = string_hash_begin (tags);
+         i; i = string_hash_next (tags, i))
+        if (i->kept)
+            *db->tags_end++ = i->tag;
 
-    assert (db->tags_end == db->tags + tags.num_entries);
+    assert (db->tags_end <= db->tags + tags->num_entries);
 
     // Sort the list of tags.
-    ARRAY_SORT (db->tags, compare_tag);
+    ARRAY_PSORT (db->tags, compare_tag);
     for (tag_t * i = db->tags; i != db->tags_end; ++i) {
-        tag_hash_item_t * h = string_hash_find (&tags, i->tag);
+        tag_hash_item_t * h = string_hash_find (tags, i->tag);
         assert (h);
         assert (h->tag.tag == i->tag);
         h->tag.parent = &i->changeset;
@@ -883,23 +1230,361 @@ void read_files_versions (database_t * db, cvs_connection_t * s)
                 j->branch = as_tag (j->branch->parent);
 
     // Sort the tag version lists.  Set the initial branch version lists.
-    for (tag_t * i = db->tags; i != db->tags_end; ++i) {
-        // On a branch, remove initial versions if they appear to be dead
-        // revisions created for subsequent branch additions.
-        if (i->branch_versions)
-            trim_dead_branch_additions (i);
+    parallel_for (db->tags_end - db->tags, prepare_tags, db);
 
-        ARRAY_TRIM (i->tag_files);
-        ARRAY_SORT (i->tag_files, compare_versionp);
-        if (i->branch_versions) {
-            i->branch_versions = ARRAY_CALLOC (version_t *,
-                                               db->files_end - db->files);
-            for (version_t ** j = i->tag_files; j != i->tag_files_end; ++j)
-                i->branch_versions[(*j)->file - db->files] = *j;
+    string_hash_destroy (tags);
+}
+
+
+/// The files and tags from one shard or chunk of the rlog output.
+typedef struct shard_result {
+    file_t * files;
+    file_t * files_end;
+    string_hash_t tags;
+} shard_result_t;
+
+
+/// Add the tag data parsed from one shard into @c tag.
+static void merge_tag (tag_t * tag, tag_t * from)
+{
+    size_t count = from->tag_files_end - from->tag_files;
+    size_t old = tag->tag_files_end - tag->tag_files;
+    tag->tag_files = ARRAY_REALLOC (tag->tag_files, old + count);
+    memcpy (tag->tag_files + old, from->tag_files,
+            count * sizeof (version_t *));
+    tag->tag_files_end = tag->tag_files + old + count;
+    xfree (from->tag_files);
+
+    if (from->changeset.time > tag->changeset.time)
+        tag->changeset.time = from->changeset.time;
+
+    if (from->branch_versions)
+        tag->branch_versions = from->branch_versions;
+
+    tag->dummy |= from->dummy;
+}
+
+
+/// Build @c db from the files and tags of several parts of the rlog output.
+/// Tags on several parts are combined, and the part's tags point to the
+/// combined tag, for the branch pointers.
+static void merge_results (database_t * db,
+                           shard_result_t * results, size_t count)
+{
+    database_init (db);
+
+    string_hash_t tags;
+    string_hash_init (&tags);
+
+    for (shard_result_t * r = results; r != results + count; ++r) {
+        for (tag_hash_item_t * i = string_hash_begin (&r->tags);
+             i; i = string_hash_next (&r->tags, i)) {
+            if (!i->kept)
+                continue;
+            tag_t * tag = get_tag (&tags, i->tag.tag);
+            merge_tag (tag, &i->tag);
+            i->tag.parent = &tag->changeset;
         }
 
-        i->is_released = false;
+        for (file_t * f = r->files; f != r->files_end; ++f) {
+            for (version_t * j = f->versions; j != f->versions_end; ++j)
+                if (j->branch)
+                    j->branch = as_tag (j->branch->parent);
+
+            *database_new_file (db) = *f;
+        }
+
+        xfree (r->files);
+        string_hash_destroy (&r->tags);
+    }
+
+    finish_files_versions (db, &tags);
+}
+
+
+/// A run of whole files from the rlog output, to parse on its own.
+typedef struct rlog_chunk {
+    char * data;
+    size_t len;
+    shard_result_t result;
+} rlog_chunk_t;
+
+
+/// Chunks waiting for the parsing threads.
+typedef struct chunk_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    rlog_chunk_t ** chunks;
+    rlog_chunk_t ** chunks_end;
+    size_t next;                        ///< Next chunk to parse.
+    bool done;                          ///< No more chunks will be added.
+    const char * prefix;
+} chunk_queue_t;
+
+
+static void parse_chunk (rlog_chunk_t * c, const char * prefix)
+{
+    cvs_connection_t s;
+    cvs_connection_memory (&s, c->data, c->len);
+    s.prefix = prefix;
+
+    database_t db;
+    database_init (&db);
+    string_hash_init (&c->result.tags);
+    read_rlog (&db, &c->result.tags, &s);
+    c->result.files = db.files;
+    c->result.files_end = db.files_end;
+}
+
+
+static void * chunk_worker_run (void * p)
+{
+    chunk_queue_t * q = p;
+    pthread_mutex_lock (&q->lock);
+    while (true)
+        if (q->next != (size_t) (q->chunks_end - q->chunks)) {
+            rlog_chunk_t * c = q->chunks[q->next++];
+            pthread_mutex_unlock (&q->lock);
+            parse_chunk (c, q->prefix);
+            xfree (c->data);
+            pthread_mutex_lock (&q->lock);
+        }
+        else if (q->done)
+            break;
+        else
+            pthread_cond_wait (&q->cond, &q->lock);
+
+    pthread_mutex_unlock (&q->lock);
+    return NULL;
+}
+
+
+static void queue_chunk (chunk_queue_t * q, char * data, size_t len)
+{
+    rlog_chunk_t * c = xmalloc (sizeof (rlog_chunk_t));
+    c->data = data;
+    c->len = len;
+    pthread_mutex_lock (&q->lock);
+    ARRAY_APPEND (q->chunks, c);
+    pthread_cond_signal (&q->cond);
+    pthread_mutex_unlock (&q->lock);
+}
+
+
+/// Read the rlog output, splitting it at file boundaries into chunks that are
+/// parsed on @c threads threads, while we carry on reading.
+static void read_rlog_parallel (database_t * db, cvs_connection_t * s,
+                                unsigned threads)
+{
+    chunk_queue_t q = {
+        PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+        NULL, NULL, 0, false, s->prefix };
+
+    pthread_t workers[threads];
+    for (unsigned i = 0; i != threads; ++i) {
+        int r = pthread_create (&workers[i], NULL, chunk_worker_run, &q);
+        if (r != 0)
+            fatal ("Failed to create parsing thread: %s\n", strerror (r));
     }
 
-    string_hash_destroy (&tags);
+    char * data = NULL;
+    size_t len = 0;
+    size_t max = 0;
+    while (true) {
+        size_t line_len = next_line (s);
+        if (strcmp (s->line, "ok") == 0 || starts_with (s->line, "error"))
+            break;
+
+        if (len + line_len + 1 > max) {
+            max = 2 * max + line_len + RLOG_CHUNK_SIZE;
+            data = xrealloc (data, max);
+        }
+
+        memcpy (data + len, s->line, line_len);
+        data[len + line_len] = '\n';
+        len += line_len + 1;
+
+        if (len >= RLOG_CHUNK_SIZE && strcmp (s->line, FILE_BOUNDARY) == 0) {
+            queue_chunk (&q, data, len);
+            data = NULL;
+            len = 0;
+            max = 0;
+        }
+    }
+
+    // The server has finished, so stop the workers even on failure.
+    bool failed = strcmp (s->line, "ok") != 0;
+    if (failed)
+        xfree (data);
+    else
+        queue_chunk (&q, data, len);
+
+    pthread_mutex_lock (&q.lock);
+    q.done = true;
+    pthread_cond_broadcast (&q.cond);
+    pthread_mutex_unlock (&q.lock);
+
+    for (unsigned i = 0; i != threads; ++i)
+        pthread_join (workers[i], NULL);
+
+    if (failed)
+        fatal ("rlog failed: %s\n", s->line);
+
+    size_t count = q.chunks_end - q.chunks;
+    shard_result_t * results = ARRAY_ALLOC (shard_result_t, count);
+    for (size_t i = 0; i != count; ++i) {
+        results[i] = q.chunks[i]->result;
+        xfree (q.chunks[i]);
+    }
+    xfree (q.chunks);
+    pthread_mutex_destroy (&q.lock);
+    pthread_cond_destroy (&q.cond);
+
+    merge_results (db, results, count);
+    xfree (results);
+}
+
+
+void read_files_versions (database_t * db, cvs_connection_t * s)
+{
+    unsigned threads = parallel_thread_count();
+    if (threads > 1) {
+        read_rlog_parallel (db, s, threads);
+        return;
+    }
+
+    database_init (db);
+
+    string_hash_t tags;
+    string_hash_init (&tags);
+
+    read_rlog (db, &tags, s);
+
+    finish_files_versions (db, &tags);
+}
+
+
+typedef struct shard_context {
+    const rlog_shard_t * shards;
+    shard_result_t * results;
+    size_t num_shards;
+    size_t next;                        ///< Next shard to hand out.
+} shard_context_t;
+
+
+typedef struct shard_worker {
+    shard_context_t * context;
+    cvs_connection_t * conn;
+} shard_worker_t;
+
+
+static void * shard_worker_run (void * p)
+{
+    shard_worker_t * worker = p;
+    shard_context_t * c = worker->context;
+    cvs_connection_t * s = worker->conn;
+    for (size_t i; (i = __sync_fetch_and_add (&c->next, 1)) < c->num_shards;) {
+        cvs_printff (s,
+                     "Global_option -q\n"
+                     "%s"
+                     "Argument --\n"
+                     "Argument %s\n"
+                     "rlog\n",
+                     c->shards[i].local ? "Argument -l\n" : "",
+                     c->shards[i].path);
+
+        database_t db;
+        database_init (&db);
+        string_hash_init (&c->results[i].tags);
+        read_rlog (&db, &c->results[i].tags, s);
+        c->results[i].files = db.files;
+        c->results[i].files_end = db.files_end;
+    }
+
+    return NULL;
+}
+
+
+void read_files_versions_sharded (database_t * db,
+                                  cvs_connection_t ** conns, size_t num_conns,
+                                  const rlog_shard_t * shards,
+                                  size_t num_shards)
+{
+    if (num_conns > num_shards)
+        num_conns = num_shards;
+    assert (num_conns != 0);
+
+    shard_context_t context = {
+        shards, ARRAY_ALLOC (shard_result_t, num_shards), num_shards, 0 };
+    shard_worker_t workers[num_conns];
+    pthread_t threads[num_conns];
+    for (size_t i = 0; i != num_conns; ++i) {
+        workers[i].context = &context;
+        workers[i].conn = conns[i];
+    }
+
+    for (size_t i = 1; i != num_conns; ++i) {
+        int r = pthread_create (&threads[i], NULL,
+                                shard_worker_run, &workers[i]);
+        if (r != 0)
+            fatal ("Failed to create rlog thread: %s\n", strerror (r));
+    }
+
+    shard_worker_run (&workers[0]);
+
+    for (size_t i = 1; i != num_conns; ++i)
+        pthread_join (threads[i], NULL);
+
+    merge_results (db, context.results, num_shards);
+    xfree (context.results);
+}
+
+
+typedef struct memory_context {
+    rlog_chunk_t * chunks;
+    const char * prefix;
+} memory_context_t;
+
+
+static void parse_memory_chunk (void * p, size_t index)
+{
+    memory_context_t * m = p;
+    parse_chunk (&m->chunks[index], m->prefix);
+}
+
+
+void read_files_versions_memory (database_t * db, char * data, size_t len,
+                                 const char * prefix)
+{
+    // Split at file boundaries, into chunks for each thread.
+    rlog_chunk_t * chunks = NULL;
+    rlog_chunk_t * chunks_end = NULL;
+    static const char boundary[] = "\n" FILE_BOUNDARY "\n";
+    char * end = data + len;
+    for (char * start = data; start != end; ) {
+        char * split = end;
+        if (end - start > RLOG_CHUNK_SIZE) {
+            split = memmem (start + RLOG_CHUNK_SIZE - 1,
+                            end - start - RLOG_CHUNK_SIZE + 1,
+                            boundary, sizeof boundary - 1);
+            split = split ? split + sizeof boundary - 1 : end;
+        }
+
+        ARRAY_EXTEND (chunks);
+        chunks_end[-1].data = start;
+        chunks_end[-1].len = split - start;
+        start = split;
+    }
+
+    size_t count = chunks_end - chunks;
+    memory_context_t m = { chunks, prefix };
+    parallel_each (count, parse_memory_chunk, &m);
+
+    shard_result_t * results = ARRAY_ALLOC (shard_result_t, count);
+    for (size_t i = 0; i != count; ++i)
+        results[i] = chunks[i].result;
+    xfree (chunks);
+
+    merge_results (db, results, count);
+    xfree (results);
 }
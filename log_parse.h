@@ -1,12 +1,57 @@
 #ifndef LOG_PARSE_H
 #define LOG_PARSE_H
 
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+
 struct database;
 struct cvs_connection;
 
+/// A part of the module to rlog on its own.
+typedef struct rlog_shard {
+    const char * path;                  ///< Path to rlog, including the module.
+    bool local;                         ///< Leave out the subdirectories.
+} rlog_shard_t;
+
+/// Regular expressions selecting the tags and branches to import, applied as
+/// the log is parsed.  A name is kept if it matches the include pattern and
+/// does not match the exclude pattern; a NULL pattern places no restriction.
+/// The versions on an excluded branch are dropped, together with the tags and
+/// branches on those versions.
+extern const regex_t * include_tags;
+extern const regex_t * exclude_tags;
+extern const regex_t * include_branches;
+extern const regex_t * exclude_branches;
+
+/// fnmatch patterns selecting the files to import, by their path within the
+/// module.  A pattern also matches the files below a matching directory.  A
+/// file is kept if it matches an include pattern, or there are none, and
+/// matches no exclude pattern.  Other files are skipped as the log is read.
+extern const char ** include_paths;
+extern const char ** include_paths_end;
+extern const char ** exclude_paths;
+extern const char ** exclude_paths_end;
+
 /// Populate @c database from the given file @c f.  @c l and @c l_len are used
 /// for storing lines as they are read fromthe file.
 void read_files_versions (struct database * database,
                           struct cvs_connection * s);
 
+/// Populate @c database by running rlog on each of the @c shards.  The @c
+/// num_conns connections each run on their own thread, taking the next shard
+/// when done with the last.
+void read_files_versions_sharded (struct database * database,
+                                  struct cvs_connection ** conns,
+                                  size_t num_conns,
+                                  const rlog_shard_t * shards,
+                                  size_t num_shards);
+
+/// Populate @c database from rlog output held in memory, as saved from the
+/// server's responses, ending with the "ok".  The RCS file names start with
+/// @c prefix, the module directory on the server.  The data is modified in
+/// place.
+void read_files_versions_memory (struct database * database,
+                                 char * data, size_t len, const char * prefix);
+
 #endif
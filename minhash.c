@@ -0,0 +1,40 @@
+#include "minhash.h"
+
+#include <stdint.h>
+
+
+void minhash_init (minhash_t * m)
+{
+    for (int i = 0; i != MINHASH_SIZE; ++i)
+        m->min[i] = UINT64_MAX;
+}
+
+
+void minhash_add (minhash_t * m, uint64_t key)
+{
+    // The murmur3 finaliser.
+    uint64_t h = key;
+    h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+    h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    uint64_t * bucket = &m->min[h % MINHASH_SIZE];
+    if (h < *bucket)
+        *bucket = h;
+}
+
+
+double minhash_jaccard (const minhash_t * a, const minhash_t * b)
+{
+    // Buckets empty in both sets carry no information.
+    int used = 0;
+    int equal = 0;
+    for (int i = 0; i != MINHASH_SIZE; ++i)
+        if (a->min[i] != UINT64_MAX || b->min[i] != UINT64_MAX) {
+            ++used;
+            if (a->min[i] == b->min[i])
+                ++equal;
+        }
+
+    return used ? (double) equal / used : 1;
+}
@@ -0,0 +1,24 @@
+#ifndef MINHASH_H
+#define MINHASH_H
+
+#include <stdint.h>
+
+/// Number of buckets in a MinHash signature.
+#define MINHASH_SIZE 16
+
+/// A one-permutation MinHash signature of a set of 64-bit keys.  The hash of
+/// each key selects a bucket, and each bucket keeps the least hash it sees.
+typedef struct minhash {
+    uint64_t min[MINHASH_SIZE];
+} minhash_t;
+
+/// Initialise @c m to the signature of the empty set.
+void minhash_init (minhash_t * m);
+
+/// Add @c key to the set with signature @c m.
+void minhash_add (minhash_t * m, uint64_t key);
+
+/// Estimate the Jaccard similarity of the sets with signatures @c a and @c b.
+double minhash_jaccard (const minhash_t * a, const minhash_t * b);
+
+#endif
@@ -0,0 +1,184 @@
+#include "log.h"
+#include "output.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct output {
+    int fd;
+    output_stats_t * stats;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;           ///< Signalled when data is added.
+    pthread_cond_t not_full;            ///< Signalled when data is written.
+
+    char * buffer;
+    size_t start;                       ///< Offset of the first byte.
+    size_t count;                       ///< Number of bytes in the buffer.
+    bool closing;                       ///< No more data will be added.
+    int error;                          ///< errno of a failed write, or 0.
+
+    output_stats_t counts;
+} output_t;
+
+
+static double now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void * output_thread (void * p)
+{
+    output_t * o = p;
+
+    pthread_mutex_lock (&o->mutex);
+    while (true) {
+        while (o->count == 0 && !o->closing) {
+            ++o->counts.idle;
+            pthread_cond_wait (&o->not_empty, &o->mutex);
+        }
+        if (o->count == 0)
+            break;
+
+        // Write out the contiguous data at the start of the buffer.
+        size_t len = o->count;
+        if (len > OUTPUT_BUFFER_SIZE - o->start)
+            len = OUTPUT_BUFFER_SIZE - o->start;
+        pthread_mutex_unlock (&o->mutex);
+
+        ssize_t done = write (o->fd, o->buffer + o->start, len);
+        int error = done < 0 ? errno : 0;
+
+        pthread_mutex_lock (&o->mutex);
+        if (done < 0 && error == EINTR)
+            continue;
+
+        if (done < 0) {
+            // Discard everything; the writers will see the error.
+            o->error = error;
+            o->count = 0;
+            pthread_cond_broadcast (&o->not_full);
+            break;
+        }
+
+        o->start = (o->start + done) % OUTPUT_BUFFER_SIZE;
+        o->count -= done;
+        pthread_cond_broadcast (&o->not_full);
+    }
+    pthread_mutex_unlock (&o->mutex);
+
+    return NULL;
+}
+
+
+static ssize_t output_write (void * cookie, const char * data, size_t size)
+{
+    output_t * o = cookie;
+
+    pthread_mutex_lock (&o->mutex);
+    size_t remaining = size;
+    while (remaining != 0 && o->error == 0) {
+        if (o->count == OUTPUT_BUFFER_SIZE) {
+            // Back-pressure; wait for the thread to make space.
+            double start = now();
+            ++o->counts.stalls;
+            while (o->count == OUTPUT_BUFFER_SIZE && o->error == 0)
+                pthread_cond_wait (&o->not_full, &o->mutex);
+            o->counts.stall_seconds += now() - start;
+            continue;
+        }
+
+        size_t end = (o->start + o->count) % OUTPUT_BUFFER_SIZE;
+        size_t len = OUTPUT_BUFFER_SIZE - o->count;
+        if (len > OUTPUT_BUFFER_SIZE - end)
+            len = OUTPUT_BUFFER_SIZE - end;
+        if (len > remaining)
+            len = remaining;
+
+        memcpy (o->buffer + end, data, len);
+        data += len;
+        remaining -= len;
+        o->count += len;
+        o->counts.bytes += len;
+        pthread_cond_signal (&o->not_empty);
+    }
+
+    int error = o->error;
+    pthread_mutex_unlock (&o->mutex);
+
+    if (error == 0)
+        return size;
+
+    errno = error;
+    return 0;
+}
+
+
+static int output_close (void * cookie)
+{
+    output_t * o = cookie;
+
+    pthread_mutex_lock (&o->mutex);
+    o->closing = true;
+    pthread_cond_signal (&o->not_empty);
+    pthread_mutex_unlock (&o->mutex);
+
+    pthread_join (o->thread, NULL);
+
+    if (o->stats)
+        *o->stats = o->counts;
+
+    int error = o->error;
+    pthread_mutex_destroy (&o->mutex);
+    pthread_cond_destroy (&o->not_empty);
+    pthread_cond_destroy (&o->not_full);
+    free (o->buffer);
+    free (o);
+
+    if (error == 0)
+        return 0;
+
+    errno = error;
+    return EOF;
+}
+
+
+FILE * output_open (int fd, output_stats_t * stats)
+{
+    output_t * o = xmalloc (sizeof (output_t));
+    o->fd = fd;
+    o->stats = stats;
+    o->buffer = xmalloc (OUTPUT_BUFFER_SIZE);
+    o->start = 0;
+    o->count = 0;
+    o->closing = false;
+    o->error = 0;
+    memset (&o->counts, 0, sizeof o->counts);
+
+    pthread_mutex_init (&o->mutex, NULL);
+    pthread_cond_init (&o->not_empty, NULL);
+    pthread_cond_init (&o->not_full, NULL);
+
+    int r = pthread_create (&o->thread, NULL, output_thread, o);
+    if (r != 0)
+        fatal ("Failed to create output thread: %s\n", strerror (r));
+
+    FILE * f = fopencookie (o, "w", (cookie_io_functions_t) {
+            .write = output_write, .close = output_close });
+    if (f == NULL)
+        fatal ("fopencookie failed: %s\n", strerror (errno));
+
+    // Hand the data over in reasonably large pieces.
+    setvbuf (f, NULL, _IOFBF, 1 << 16);
+    return f;
+}
@@ -0,0 +1,24 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+
+/// Counters describing how an output stream performed.
+typedef struct output_stats {
+    unsigned long bytes;                ///< Bytes written.
+    unsigned long stalls;               ///< Writes that waited for space.
+    double stall_seconds;               ///< Total time spent waiting.
+    unsigned long idle;                 ///< Times the thread waited for data.
+} output_stats_t;
+
+/// Size of the output ring buffer.
+#define OUTPUT_BUFFER_SIZE (16 << 20)
+
+/// Open a stream writing to @c fd.  Data written to the stream is copied to a
+/// large ring buffer, which a separate thread drains to @c fd, so that the
+/// caller is not held up while the reader of @c fd is busy.  Closing the
+/// stream waits for the buffer to drain, and then stores the counters in
+/// @c stats.  The file descriptor is not closed.
+FILE * output_open (int fd, output_stats_t * stats);
+
+#endif
@@ -0,0 +1,662 @@
+#include "log.h"
+#include "pack.h"
+#include "sha1.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PACK_BUFFER_SIZE (1 << 20)
+
+/// Bytes per block indexed when computing deltas.
+#define DELTA_BLOCK 16
+
+
+static void put_be32 (unsigned char * p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+
+static void pack_flush (pack_t * p)
+{
+    for (size_t done = 0; done != p->buffer_len;) {
+        ssize_t r = write (p->fd, p->buffer + done, p->buffer_len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        check (r, "write %s", p->path);
+        done += r;
+    }
+    p->buffer_len = 0;
+}
+
+
+static void pack_write (pack_t * p, const void * data, size_t len)
+{
+    if (p->buffer_len + len > PACK_BUFFER_SIZE)
+        pack_flush (p);
+
+    if (len >= PACK_BUFFER_SIZE) {
+        const unsigned char * d = data;
+        for (size_t done = 0; done != len;) {
+            ssize_t r = write (p->fd, d + done, len - done);
+            if (r < 0 && errno == EINTR)
+                continue;
+            check (r, "write %s", p->path);
+            done += r;
+        }
+    }
+    else {
+        memcpy (p->buffer + p->buffer_len, data, len);
+        p->buffer_len += len;
+    }
+
+    p->offset += len;
+}
+
+
+void pack_init (pack_t * p, const char * dir)
+{
+    p->dir = dir;
+    p->path = xasprintf ("%s/tmp_pack_XXXXXX", dir);
+    p->fd = check (mkostemp (p->path, O_CLOEXEC), "mkstemp %s", p->path);
+    p->offset = 0;
+    p->buffer = xmalloc (PACK_BUFFER_SIZE);
+    p->buffer_len = 0;
+    p->objects = NULL;
+    p->objects_end = NULL;
+    p->index_size = 1024;
+    p->index = ARRAY_ALLOC (size_t, p->index_size);
+    memset (p->index, -1, p->index_size * sizeof (size_t));
+    p->zbuf = NULL;
+    p->zbuf_max = 0;
+    p->deltas = 0;
+    p->raw_bytes = 0;
+
+    memset (&p->deflater, 0, sizeof p->deflater);
+    if (deflateInit (&p->deflater, Z_DEFAULT_COMPRESSION) != Z_OK)
+        fatal ("deflateInit failed\n");
+
+    // The object count is filled in when we finish.
+    unsigned char header[12] = "PACK";
+    put_be32 (header + 4, 2);
+    put_be32 (header + 8, 0);
+    pack_write (p, header, sizeof header);
+}
+
+
+void pack_hash (pack_type_t type, const void * data, size_t len,
+                unsigned char sha[20])
+{
+    static const char * const names[] = {
+        [pack_commit] = "commit", [pack_tree] = "tree",
+        [pack_blob] = "blob", [pack_tag] = "tag" };
+    char header[32];
+    int header_len = sprintf (header, "%s %zu", names[type], len) + 1;
+
+    sha1_t s;
+    sha1_init (&s);
+    sha1_update (&s, header, header_len);
+    sha1_update (&s, data, len);
+    sha1_final (&s, sha);
+}
+
+
+static size_t sha_slot (const pack_t * p, const unsigned char sha[20])
+{
+    uint64_t h;
+    memcpy (&h, sha, sizeof h);
+    return h & (p->index_size - 1);
+}
+
+
+size_t pack_find (const pack_t * p, const unsigned char sha[20])
+{
+    for (size_t i = sha_slot (p, sha);; i = (i + 1) & (p->index_size - 1)) {
+        size_t o = p->index[i];
+        if (o == SIZE_MAX || memcmp (p->objects[o].sha, sha, 20) == 0)
+            return o;
+    }
+}
+
+
+static void index_insert (pack_t * p, size_t object)
+{
+    size_t i = sha_slot (p, p->objects[object].sha);
+    while (p->index[i] != SIZE_MAX)
+        i = (i + 1) & (p->index_size - 1);
+    p->index[i] = object;
+}
+
+
+/// Append a new object to the list, and return it.  The caller fills it in.
+static pack_object_t * new_object (pack_t * p, const unsigned char sha[20])
+{
+    size_t count = p->objects_end - p->objects + 1;
+    if (count * 2 > p->index_size) {
+        // Rehash.
+        p->index_size *= 2;
+        p->index = ARRAY_REALLOC (p->index, p->index_size);
+        memset (p->index, -1, p->index_size * sizeof (size_t));
+        for (size_t i = 0; i != count - 1; ++i)
+            index_insert (p, i);
+    }
+
+    ARRAY_EXTEND (p->objects);
+    pack_object_t * o = p->objects_end - 1;
+    memcpy (o->sha, sha, 20);
+    o->offset = p->offset;
+    o->base = SIZE_MAX;
+    o->depth = 0;
+    index_insert (p, count - 1);
+    return o;
+}
+
+
+/// Write a packed object: the header, the base offset for deltas, and the
+/// compressed data.
+static void write_object (pack_t * p, pack_object_t * o, pack_type_t type,
+                          size_t len, uint64_t base_offset,
+                          const void * data, size_t data_len)
+{
+    unsigned char header[32];
+    size_t header_len = 0;
+    header[header_len++] = (type << 4) | (len & 15);
+    for (len >>= 4; len != 0; len >>= 7) {
+        header[header_len - 1] |= 0x80;
+        header[header_len++] = len & 127;
+    }
+
+    if (type == pack_ofs_delta) {
+        uint64_t distance = o->offset - base_offset;
+        unsigned char ofs[16];
+        size_t pos = sizeof ofs - 1;
+        ofs[pos] = distance & 127;
+        while (distance >>= 7)
+            ofs[--pos] = 128 | (--distance & 127);
+        memcpy (header + header_len, ofs + pos, sizeof ofs - pos);
+        header_len += sizeof ofs - pos;
+    }
+
+    size_t bound = deflateBound (&p->deflater, data_len);
+    if (bound > p->zbuf_max) {
+        p->zbuf_max = bound;
+        p->zbuf = xrealloc (p->zbuf, bound);
+    }
+
+    deflateReset (&p->deflater);
+    p->deflater.next_in = (unsigned char *) data;
+    p->deflater.avail_in = data_len;
+    p->deflater.next_out = p->zbuf;
+    p->deflater.avail_out = p->zbuf_max;
+    if (deflate (&p->deflater, Z_FINISH) != Z_STREAM_END)
+        fatal ("deflate failed writing pack\n");
+    size_t zlen = p->deflater.next_out - p->zbuf;
+
+    o->type = type;
+    o->crc = crc32 (crc32 (0, header, header_len), p->zbuf, zlen);
+    pack_write (p, header, header_len);
+    pack_write (p, p->zbuf, zlen);
+}
+
+
+size_t pack_add (pack_t * p, pack_type_t type, const void * data, size_t len,
+                 const unsigned char sha[20])
+{
+    size_t found = pack_find (p, sha);
+    if (found != SIZE_MAX)
+        return found;
+
+    pack_object_t * o = new_object (p, sha);
+    write_object (p, o, type, len, 0, data, len);
+    p->raw_bytes += len;
+    return o - p->objects;
+}
+
+
+static size_t block_hash (uint32_t h)
+{
+    return (h * 0x9e3779b1u) >> 8;
+}
+
+
+static void delta_varint (unsigned char ** out, size_t v)
+{
+    for (; v >= 128; v >>= 7)
+        *(*out)++ = 128 | (v & 127);
+    *(*out)++ = v;
+}
+
+
+static void delta_insert (unsigned char ** out, const unsigned char * data,
+                          size_t len)
+{
+    while (len != 0) {
+        size_t n = len < 127 ? len : 127;
+        *(*out)++ = n;
+        memcpy (*out, data, n);
+        *out += n;
+        data += n;
+        len -= n;
+    }
+}
+
+
+static void delta_copy (unsigned char ** out, size_t offset, size_t len)
+{
+    while (len != 0) {
+        size_t n = len < 0x10000 ? len : 0x10000;
+        unsigned char * op = (*out)++;
+        *op = 0x80;
+        for (int i = 0; i != 4; ++i)
+            if ((offset >> (8 * i)) & 255) {
+                *op |= 1 << i;
+                *(*out)++ = offset >> (8 * i);
+            }
+        for (int i = 0; i != 3; ++i)
+            if ((n >> (8 * i)) & 255) {
+                *op |= 16 << i;
+                *(*out)++ = n >> (8 * i);
+            }
+        offset += n;
+        len -= n;
+    }
+}
+
+
+/// Encode @c data as a git delta against @c base.  The blocks of the base are
+/// indexed by a hash, and the data is scanned with a rolling hash for matching
+/// blocks, which are then extended in both directions.  Returns the delta
+/// length, or 0 if the delta would not be at least 20 bytes smaller than the
+/// data.
+static size_t delta_create (const unsigned char * base, size_t base_len,
+                            const unsigned char * data, size_t len,
+                            unsigned char ** result)
+{
+    if (len < 64 || base_len < DELTA_BLOCK)
+        return 0;
+
+    // The delta is abandoned if it would exceed this size.
+    size_t max = len - 20;
+    unsigned char * delta = xmalloc (max);
+    unsigned char * out = delta;
+    delta_varint (&out, base_len);
+    delta_varint (&out, len);
+
+    // Build the block index.
+    uint32_t pow = 1;                   // 0x01000193 ^ (DELTA_BLOCK - 1).
+    for (int i = 1; i != DELTA_BLOCK; ++i)
+        pow *= 0x01000193;
+    size_t size = 16;
+    while (size < base_len / DELTA_BLOCK * 2)
+        size *= 2;
+    size_t * table = ARRAY_ALLOC (size_t, size);
+    memset (table, -1, size * sizeof (size_t));
+    for (size_t i = 0; i + DELTA_BLOCK <= base_len; i += DELTA_BLOCK) {
+        uint32_t h = 0;
+        for (int j = 0; j != DELTA_BLOCK; ++j)
+            h = h * 0x01000193 + base[i + j];
+        size_t * slot = &table[block_hash (h) & (size - 1)];
+        if (*slot == SIZE_MAX)
+            *slot = i;
+    }
+
+    size_t pending = 0;                 // Start of data not yet encoded.
+    size_t i = 0;
+    uint32_t h = 0;
+    bool fresh = true;
+    while (i + DELTA_BLOCK <= len) {
+        if (fresh) {
+            h = 0;
+            for (int j = 0; j != DELTA_BLOCK; ++j)
+                h = h * 0x01000193 + data[i + j];
+            fresh = false;
+        }
+
+        size_t candidate = table[block_hash (h) & (size - 1)];
+        if (candidate == SIZE_MAX
+            || memcmp (base + candidate, data + i, DELTA_BLOCK) != 0) {
+            if (i + DELTA_BLOCK < len)
+                h = (h - data[i] * pow) * 0x01000193 + data[i + DELTA_BLOCK];
+            ++i;
+            continue;
+        }
+
+        // Extend the match backwards and forwards.
+        size_t from = candidate;
+        size_t to = i;
+        while (to > pending && from > 0 && base[from - 1] == data[to - 1]) {
+            --from;
+            --to;
+        }
+        size_t n = i + DELTA_BLOCK - to;
+        while (to + n < len && from + n < base_len
+               && base[from + n] == data[to + n])
+            ++n;
+
+        size_t cost = (to - pending) + (to - pending + 126) / 127
+            + 8 * (n / 0x10000 + 1);
+        if (out - delta + cost > max)
+            break;
+
+        delta_insert (&out, data + pending, to - pending);
+        delta_copy (&out, from, n);
+        i = to + n;
+        pending = i;
+        fresh = true;
+    }
+
+    free (table);
+
+    if (out - delta + (len - pending) + (len - pending + 126) / 127 > max) {
+        free (delta);
+        return 0;
+    }
+
+    delta_insert (&out, data + pending, len - pending);
+    *result = delta;
+    return out - delta;
+}
+
+
+size_t pack_add_delta (pack_t * p, pack_type_t type,
+                       const void * data, size_t len,
+                       const unsigned char sha[20],
+                       size_t base, const void * base_data, size_t base_len)
+{
+    size_t found = pack_find (p, sha);
+    if (found != SIZE_MAX)
+        return found;
+
+    if (base == SIZE_MAX || p->objects[base].depth >= PACK_DELTA_DEPTH
+        || len > PACK_DELTA_LIMIT || base_len > PACK_DELTA_LIMIT)
+        return pack_add (p, type, data, len, sha);
+
+    unsigned char * delta;
+    size_t delta_len = delta_create (base_data, base_len, data, len, &delta);
+    if (delta_len == 0)
+        return pack_add (p, type, data, len, sha);
+
+    unsigned depth = p->objects[base].depth + 1;
+    uint64_t base_offset = p->objects[base].offset;
+    pack_object_t * o = new_object (p, sha);
+    o->base = base;
+    o->depth = depth;
+    write_object (p, o, pack_ofs_delta, delta_len, base_offset,
+                  delta, delta_len);
+    free (delta);
+
+    ++p->deltas;
+    p->raw_bytes += len;
+    return o - p->objects;
+}
+
+
+static size_t delta_varint_read (const unsigned char ** p,
+                                 const unsigned char * end)
+{
+    size_t v = 0;
+    for (int shift = 0; *p != end; shift += 7) {
+        unsigned char c = *(*p)++;
+        v |= (size_t) (c & 127) << shift;
+        if (!(c & 128))
+            return v;
+    }
+    fatal ("pack: corrupt delta\n");
+}
+
+
+/// Apply the git delta @c delta to @c base, returning a malloc'd buffer.
+static unsigned char * delta_apply (const unsigned char * base, size_t base_len,
+                                    const unsigned char * delta,
+                                    size_t delta_len, size_t * len)
+{
+    const unsigned char * p = delta;
+    const unsigned char * end = delta + delta_len;
+    if (delta_varint_read (&p, end) != base_len)
+        fatal ("pack: delta base size mismatch\n");
+    size_t size = delta_varint_read (&p, end);
+    unsigned char * result = xmalloc (size + 1);
+    unsigned char * out = result;
+
+    while (p != end) {
+        unsigned char op = *p++;
+        if (op & 0x80) {
+            size_t offset = 0;
+            size_t n = 0;
+            for (int i = 0; i != 4; ++i)
+                if (op & (1 << i) && p != end)
+                    offset |= (size_t) *p++ << (8 * i);
+            for (int i = 0; i != 3; ++i)
+                if (op & (16 << i) && p != end)
+                    n |= (size_t) *p++ << (8 * i);
+            if (n == 0)
+                n = 0x10000;
+            if (offset + n > base_len || n > size - (out - result))
+                fatal ("pack: corrupt delta copy\n");
+            memcpy (out, base + offset, n);
+            out += n;
+        }
+        else {
+            if (op == 0 || op > end - p || op > size - (out - result))
+                fatal ("pack: corrupt delta insert\n");
+            memcpy (out, p, op);
+            out += op;
+            p += op;
+        }
+    }
+
+    if (out - result != size)
+        fatal ("pack: delta result size mismatch\n");
+
+    *len = size;
+    return result;
+}
+
+
+void * pack_read (pack_t * p, size_t object, size_t * len)
+{
+    pack_flush (p);
+
+    const pack_object_t * o = &p->objects[object];
+    uint64_t end = o + 1 == p->objects_end ? p->offset : o[1].offset;
+    size_t packed = end - o->offset;
+    unsigned char * raw = xmalloc (packed);
+    for (size_t done = 0; done != packed;) {
+        ssize_t r = pread (p->fd, raw + done, packed - done,
+                           o->offset + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        check (r, "read %s", p->path);
+        if (r == 0)
+            fatal ("read %s: unexpected end of file\n", p->path);
+        done += r;
+    }
+
+    size_t header_len = 1;
+    size_t size = raw[0] & 15;
+    for (int shift = 4; raw[header_len - 1] & 0x80; shift += 7)
+        size |= (size_t) (raw[header_len++] & 127) << shift;
+    if (o->type == pack_ofs_delta)
+        // Skip the base offset; we know the base object already.
+        while (raw[header_len++] & 0x80);
+
+    unsigned char * data = xmalloc (size + 1);
+    z_stream inflater;
+    memset (&inflater, 0, sizeof inflater);
+    if (inflateInit (&inflater) != Z_OK)
+        fatal ("inflateInit failed\n");
+    inflater.next_in = raw + header_len;
+    inflater.avail_in = packed - header_len;
+    inflater.next_out = data;
+    inflater.avail_out = size + 1;
+    if (inflate (&inflater, Z_FINISH) != Z_STREAM_END
+        || inflater.total_out != size)
+        fatal ("%s: corrupt object at offset %llu\n",
+               p->path, (unsigned long long) o->offset);
+    inflateEnd (&inflater);
+    free (raw);
+
+    if (o->base == SIZE_MAX) {
+        *len = size;
+        return data;
+    }
+
+    size_t base_len;
+    unsigned char * base = pack_read (p, o->base, &base_len);
+    unsigned char * result = delta_apply (base, base_len, data, size, len);
+    free (base);
+    free (data);
+    return result;
+}
+
+
+static int compare_objects (const void * AA, const void * BB)
+{
+    const pack_object_t * A = *(pack_object_t * const *) AA;
+    const pack_object_t * B = *(pack_object_t * const *) BB;
+    return memcmp (A->sha, B->sha, 20);
+}
+
+
+/// Write to an index file, keeping its checksum.
+static void index_write (FILE * f, sha1_t * s, const void * data, size_t len)
+{
+    sha1_update (s, data, len);
+    fwrite (data, 1, len, f);
+}
+
+
+static void write_index (const pack_t * p, const char * path,
+                         const unsigned char pack_sha[20])
+{
+    FILE * f = fopen (path, "w");
+    if (f == NULL)
+        fatal ("open %s failed: %s\n", path, strerror (errno));
+
+    size_t count = p->objects_end - p->objects;
+    const pack_object_t ** sorted = ARRAY_ALLOC (const pack_object_t *, count);
+    for (size_t i = 0; i != count; ++i)
+        sorted[i] = &p->objects[i];
+    qsort (sorted, count, sizeof *sorted, compare_objects);
+
+    sha1_t s;
+    sha1_init (&s);
+    unsigned char word[8];
+    index_write (f, &s, "\377tOc", 4);
+    put_be32 (word, 2);
+    index_write (f, &s, word, 4);
+
+    size_t n = 0;
+    for (int i = 0; i != 256; ++i) {
+        while (n != count && sorted[n]->sha[0] == i)
+            ++n;
+        put_be32 (word, n);
+        index_write (f, &s, word, 4);
+    }
+
+    for (size_t i = 0; i != count; ++i)
+        index_write (f, &s, sorted[i]->sha, 20);
+
+    for (size_t i = 0; i != count; ++i) {
+        put_be32 (word, sorted[i]->crc);
+        index_write (f, &s, word, 4);
+    }
+
+    // Offsets beyond 31 bits go in a separate table of 64 bit offsets.
+    uint32_t large = 0;
+    for (size_t i = 0; i != count; ++i) {
+        uint64_t offset = sorted[i]->offset;
+        put_be32 (word, offset < 0x80000000u ? offset : 0x80000000u | large++);
+        index_write (f, &s, word, 4);
+    }
+    for (size_t i = 0; i != count; ++i)
+        if (sorted[i]->offset >= 0x80000000u) {
+            put_be32 (word, sorted[i]->offset >> 32);
+            put_be32 (word + 4, sorted[i]->offset);
+            index_write (f, &s, word, 8);
+        }
+
+    index_write (f, &s, pack_sha, 20);
+    unsigned char index_sha[20];
+    sha1_final (&s, index_sha);
+    fwrite (index_sha, 1, 20, f);
+
+    if (ferror (f) | fclose (f))
+        fatal ("writing %s failed\n", path);
+
+    free (sorted);
+}
+
+
+void pack_finish (pack_t * p, char name[41])
+{
+    pack_flush (p);
+    deflateEnd (&p->deflater);
+    free (p->zbuf);
+    free (p->buffer);
+    free (p->index);
+
+    size_t count = p->objects_end - p->objects;
+    if (count == 0) {
+        close (p->fd);
+        unlink (p->path);
+        free (p->path);
+        name[0] = 0;
+        return;
+    }
+
+    // Fill in the object count, and then checksum the whole file.
+    unsigned char word[4];
+    put_be32 (word, count);
+    check (pwrite (p->fd, word, 4, 8), "write %s", p->path);
+
+    sha1_t s;
+    sha1_init (&s);
+    unsigned char * buffer = xmalloc (PACK_BUFFER_SIZE);
+    for (uint64_t done = 0; done != p->offset;) {
+        ssize_t r = pread (p->fd, buffer, PACK_BUFFER_SIZE, done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        check (r, "read %s", p->path);
+        if (r == 0)
+            fatal ("read %s: unexpected end of file\n", p->path);
+        sha1_update (&s, buffer, r);
+        done += r;
+    }
+    free (buffer);
+
+    unsigned char pack_sha[20];
+    sha1_final (&s, pack_sha);
+    check (pwrite (p->fd, pack_sha, 20, p->offset), "write %s", p->path);
+    check (fsync (p->fd), "fsync %s", p->path);
+    check (close (p->fd), "close %s", p->path);
+
+    sha1_hex (pack_sha, name);
+    char * index_tmp = xasprintf ("%s.idx", p->path);
+    write_index (p, index_tmp, pack_sha);
+
+    // Move the pack into place before its index, so that git never sees an
+    // index without its pack.
+    char * pack_path = xasprintf ("%s/pack-%s.pack", p->dir, name);
+    char * index_path = xasprintf ("%s/pack-%s.idx", p->dir, name);
+    chmod (p->path, 0444);
+    chmod (index_tmp, 0444);
+    if (rename (p->path, pack_path) != 0)
+        fatal ("rename %s failed: %s\n", pack_path, strerror (errno));
+    if (rename (index_tmp, index_path) != 0)
+        fatal ("rename %s failed: %s\n", index_path, strerror (errno));
+
+    free (pack_path);
+    free (index_path);
+    free (index_tmp);
+    free (p->path);
+    free (p->objects);
+}
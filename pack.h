@@ -0,0 +1,87 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/// The git object types, as numbered in a pack.
+typedef enum pack_type {
+    pack_commit = 1,
+    pack_tree = 2,
+    pack_blob = 3,
+    pack_tag = 4,
+    pack_ofs_delta = 6,
+} pack_type_t;
+
+/// Longest delta chain written.
+#define PACK_DELTA_DEPTH 50
+
+/// Largest object considered for deltas.
+#define PACK_DELTA_LIMIT (16 << 20)
+
+/// An object in the pack.
+typedef struct pack_object {
+    unsigned char sha[20];
+    uint64_t offset;                    ///< Position in the pack file.
+    uint32_t crc;                       ///< CRC32 of the packed data.
+    pack_type_t type;                   ///< Type as written.
+    size_t base;                        ///< Delta base, or SIZE_MAX.
+    unsigned depth;                     ///< Length of the delta chain.
+} pack_object_t;
+
+/// A pack file being written.
+typedef struct pack {
+    const char * dir;                   ///< The objects/pack directory.
+    char * path;                        ///< The temporary pack file.
+    int fd;
+    uint64_t offset;                    ///< Bytes written so far.
+
+    unsigned char * buffer;             ///< Data not yet written to fd.
+    size_t buffer_len;
+
+    pack_object_t * objects;            ///< The objects in write order.
+    pack_object_t * objects_end;
+
+    size_t * index;                     ///< Hash of objects by sha.
+    size_t index_size;
+
+    z_stream deflater;
+    unsigned char * zbuf;               ///< Compression output buffer.
+    size_t zbuf_max;
+
+    size_t deltas;                      ///< Number of deltas written.
+    uint64_t raw_bytes;                 ///< Total size before packing.
+} pack_t;
+
+/// Start a new pack file, in the directory @c dir.
+void pack_init (pack_t * p, const char * dir);
+
+/// Compute the git object id of an object.
+void pack_hash (pack_type_t type, const void * data, size_t len,
+                unsigned char sha[20]);
+
+/// Find the object with id @c sha, returning its index or SIZE_MAX.
+size_t pack_find (const pack_t * p, const unsigned char sha[20]);
+
+/// Add an object with id @c sha, unless it is already present.  Returns the
+/// index of the object.
+size_t pack_add (pack_t * p, pack_type_t type, const void * data, size_t len,
+                 const unsigned char sha[20]);
+
+/// Like @ref pack_add, but store the object as a delta against the object
+/// @c base, with content @c base_data, if that is worthwhile.
+size_t pack_add_delta (pack_t * p, pack_type_t type,
+                       const void * data, size_t len,
+                       const unsigned char sha[20],
+                       size_t base, const void * base_data, size_t base_len);
+
+/// Read back an object from the pack.  Returns a malloc'd buffer.
+void * pack_read (pack_t * p, size_t object, size_t * len);
+
+/// Finish the pack: write the trailer and index, and move both into place.
+/// The pack name is stored in @c name.  An empty pack is discarded; then
+/// @c name is empty.
+void pack_finish (pack_t * p, char name[41]);
+
+#endif
@@ -0,0 +1,282 @@
+#include "log.h"
+#include "parallel.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+unsigned parallel_threads;
+
+/// Below this many items, parallel_for does not bother with threads.
+#define PARALLEL_FOR_THRESHOLD 1024
+
+/// Below this many items, radix sort uses an insertion sort.
+#define RADIX_THRESHOLD 32
+
+
+unsigned parallel_thread_count (void)
+{
+    if (parallel_threads == 0) {
+        long n = sysconf (_SC_NPROCESSORS_ONLN);
+        parallel_threads = n > 0 ? n : 1;
+    }
+    return parallel_threads;
+}
+
+
+typedef struct parallel_job {
+    void (*fn) (void * context, size_t begin, size_t end);
+    void * context;
+    size_t begin;
+    size_t end;
+} parallel_job_t;
+
+
+static void * parallel_job_run (void * p)
+{
+    parallel_job_t * job = p;
+    job->fn (job->context, job->begin, job->end);
+    return NULL;
+}
+
+
+/// Run @c fn on @c pieces contiguous sub-ranges of [0, @c count).  The
+/// calling thread takes the first piece.
+static void run_pieces (size_t count, unsigned pieces,
+                        void (*fn) (void *, size_t, size_t), void * context)
+{
+    if (pieces <= 1) {
+        fn (context, 0, count);
+        return;
+    }
+
+    parallel_job_t jobs[pieces];
+    pthread_t threads[pieces];
+    for (unsigned i = 0; i != pieces; ++i) {
+        jobs[i].fn = fn;
+        jobs[i].context = context;
+        jobs[i].begin = count * i / pieces;
+        jobs[i].end = count * (i + 1) / pieces;
+    }
+
+    for (unsigned i = 1; i != pieces; ++i) {
+        int r = pthread_create (&threads[i], NULL, parallel_job_run, &jobs[i]);
+        if (r != 0)
+            fatal ("Failed to create thread: %s\n", strerror (r));
+    }
+
+    parallel_job_run (&jobs[0]);
+
+    for (unsigned i = 1; i != pieces; ++i)
+        pthread_join (threads[i], NULL);
+}
+
+
+void parallel_for (size_t count,
+                   void (*fn) (void * context, size_t begin, size_t end),
+                   void * context)
+{
+    unsigned pieces = parallel_thread_count();
+    if (count < PARALLEL_FOR_THRESHOLD)
+        pieces = 1;
+    else if (pieces > count)
+        pieces = count;
+
+    run_pieces (count, pieces, fn, context);
+}
+
+
+typedef struct each_context {
+    void (*fn) (void * context, size_t index);
+    void * context;
+    size_t count;
+    size_t next;                        ///< Next index to hand out.
+} each_context_t;
+
+
+static void each_run (void * p, size_t begin, size_t end)
+{
+    each_context_t * each = p;
+    for (size_t i; (i = __sync_fetch_and_add (&each->next, 1)) < each->count;)
+        each->fn (each->context, i);
+}
+
+
+void parallel_each (size_t count, void (*fn) (void * context, size_t index),
+                    void * context)
+{
+    unsigned pieces = parallel_thread_count();
+    if (pieces > count)
+        pieces = count;
+
+    each_context_t each = { fn, context, count, 0 };
+    run_pieces (pieces, pieces, each_run, &each);
+}
+
+
+typedef struct sort_context {
+    char * src;                         ///< Blocks to sort or merge.
+    char * dst;                         ///< Merge destination.
+    size_t count;
+    size_t size;
+    size_t block;                       ///< Items per input block.
+    int (*compare) (const void *, const void *);
+} sort_context_t;
+
+
+static void sort_blocks (void * p, size_t begin, size_t end)
+{
+    sort_context_t * c = p;
+    for (size_t i = begin; i != end; ++i) {
+        size_t first = i * c->block;
+        size_t last = first + c->block;
+        if (last > c->count)
+            last = c->count;
+        qsort (c->src + first * c->size, last - first, c->size, c->compare);
+    }
+}
+
+
+/// Merge adjacent pairs of blocks from src into dst.  Ties take the item
+/// from the left block, so the merge is stable.
+static void merge_blocks (void * p, size_t begin, size_t end)
+{
+    sort_context_t * c = p;
+    size_t size = c->size;
+    for (size_t i = begin; i != end; ++i) {
+        size_t first = 2 * i * c->block;
+        size_t mid = first + c->block;
+        size_t last = mid + c->block;
+        if (mid > c->count)
+            mid = c->count;
+        if (last > c->count)
+            last = c->count;
+
+        char * A = c->src + first * size;
+        char * A_end = c->src + mid * size;
+        char * B = A_end;
+        char * B_end = c->src + last * size;
+        char * out = c->dst + first * size;
+        while (A != A_end && B != B_end)
+            if (c->compare (B, A) < 0) {
+                memcpy (out, B, size);
+                B += size;
+                out += size;
+            }
+            else {
+                memcpy (out, A, size);
+                A += size;
+                out += size;
+            }
+
+        memcpy (out, A, A_end - A);
+        out += A_end - A;
+        memcpy (out, B, B_end - B);
+    }
+}
+
+
+void parallel_sort (void * base, size_t count, size_t size,
+                    int (*compare) (const void *, const void *))
+{
+    unsigned threads = parallel_thread_count();
+    if (count < PARALLEL_SORT_THRESHOLD || threads == 1) {
+        qsort (base, count, size, compare);
+        return;
+    }
+
+    sort_context_t c = {
+        .src = base, .count = count, .size = size, .compare = compare };
+
+    // Sort one block per thread, then merge pairs of blocks until there is
+    // only one.
+    c.block = (count + threads - 1) / threads;
+    size_t blocks = (count + c.block - 1) / c.block;
+    run_pieces (blocks, blocks, sort_blocks, &c);
+
+    char * buffer = xmalloc (count * size);
+    c.dst = buffer;
+    while (c.block < count) {
+        size_t pairs = (count + 2 * c.block - 1) / (2 * c.block);
+        run_pieces (pairs, pairs < threads ? pairs : threads,
+                    merge_blocks, &c);
+        char * t = c.src;
+        c.src = c.dst;
+        c.dst = t;
+        c.block *= 2;
+    }
+
+    if (c.src != base)
+        memcpy (base, c.src, count * size);
+
+    free (buffer);
+}
+
+
+void radix_sort_pointers (void ** base, size_t count,
+                          uint64_t (*key) (const void *))
+{
+    if (count < RADIX_THRESHOLD) {
+        for (size_t i = 1; i < count; ++i) {
+            void * item = base[i];
+            uint64_t k = key (item);
+            size_t j = i;
+            for (; j > 0 && key (base[j - 1]) > k; --j)
+                base[j] = base[j - 1];
+            base[j] = item;
+        }
+        return;
+    }
+
+    // Least significant digit first, eight bits at a time.  Digits on which
+    // all keys agree are skipped.
+    uint64_t * keys = ARRAY_ALLOC (uint64_t, count * 2);
+    void ** items = ARRAY_ALLOC (void *, count);
+    uint64_t * keys_tmp = keys + count;
+    uint64_t all_or = 0;
+    uint64_t all_and = ~(uint64_t) 0;
+    for (size_t i = 0; i != count; ++i) {
+        keys[i] = key (base[i]);
+        all_or |= keys[i];
+        all_and &= keys[i];
+    }
+
+    void ** src = base;
+    void ** dst = items;
+    for (unsigned shift = 0; shift < 64; shift += 8) {
+        if ((((all_or ^ all_and) >> shift) & 255) == 0)
+            continue;
+
+        size_t offsets[256] = { 0 };
+        for (size_t i = 0; i != count; ++i)
+            ++offsets[(keys[i] >> shift) & 255];
+
+        size_t total = 0;
+        for (int d = 0; d != 256; ++d) {
+            size_t n = offsets[d];
+            offsets[d] = total;
+            total += n;
+        }
+
+        for (size_t i = 0; i != count; ++i) {
+            size_t pos = offsets[(keys[i] >> shift) & 255]++;
+            dst[pos] = src[i];
+            keys_tmp[pos] = keys[i];
+        }
+
+        void ** t = src;
+        src = dst;
+        dst = t;
+        uint64_t * kt = keys;
+        keys = keys_tmp;
+        keys_tmp = kt;
+    }
+
+    if (src != base)
+        memcpy (base, src, count * sizeof (void *));
+
+    free (keys < keys_tmp ? keys : keys_tmp);
+    free (items);
+}
@@ -0,0 +1,47 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Number of threads to use for parallel work.  Zero means use the number of
+/// online CPUs.
+extern unsigned parallel_threads;
+
+/// The number of threads to use, resolving @ref parallel_threads.
+unsigned parallel_thread_count (void);
+
+/// Arrays with fewer items than this are sorted with plain qsort.
+#define PARALLEL_SORT_THRESHOLD 16384
+
+/// Sort an array, like qsort, using multiple threads for large arrays.  The
+/// sort is a stable merge of qsort'd blocks, so the result matches qsort
+/// exactly provided that @c compare does not report distinct items as equal.
+void parallel_sort (void * base, size_t count, size_t size,
+                    int (*compare) (const void *, const void *));
+
+/// Sort an array of pointers by an integer key.  This is a stable radix sort,
+/// so the result matches qsort for a comparator ordering by key, provided the
+/// keys are distinct.
+void radix_sort_pointers (void ** base, size_t count,
+                          uint64_t (*key) (const void *));
+
+/// Call @c fn on sub-ranges covering [0, @c count), on multiple threads.  The
+/// ranges are contiguous and @c fn should only touch its own range.
+void parallel_for (size_t count,
+                   void (*fn) (void * context, size_t begin, size_t end),
+                   void * context);
+
+/// Call @c fn on each index in [0, @c count), on multiple threads.  Indexes
+/// are handed out one at a time, so this suits a few items of uneven cost.
+void parallel_each (size_t count, void (*fn) (void * context, size_t index),
+                    void * context);
+
+/// Sort an array using @ref parallel_sort.  P_end should be the end pointer.
+#define ARRAY_PSORT(P, F) parallel_sort (P, P##_end - P, sizeof *(P), F)
+
+/// Sort an array of pointers using @ref radix_sort_pointers.
+#define ARRAY_RADIX_SORT(P, K) \
+    radix_sort_pointers ((void **) (P), P##_end - P, K)
+
+#endif
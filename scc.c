@@ -0,0 +1,83 @@
+// Tarjan's strongly connected components algorithm.  The recursion is done
+// with an explicit stack, as the graphs can be deep.
+
+#include "scc.h"
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define UNVISITED SIZE_MAX
+
+size_t scc_find (size_t n, const size_t * start, const size_t * edges,
+                 size_t * component)
+{
+    size_t * index = ARRAY_ALLOC (size_t, n);
+    size_t * lowlink = ARRAY_ALLOC (size_t, n);
+    size_t * stack = ARRAY_ALLOC (size_t, n);   // Tarjan's node stack.
+    size_t * call = ARRAY_ALLOC (size_t, n);    // DFS call stack.
+    size_t * next_edge = ARRAY_ALLOC (size_t, n);
+    size_t stack_size = 0;
+    size_t next_index = 0;
+    size_t num_components = 0;
+
+    for (size_t i = 0; i != n; ++i) {
+        index[i] = UNVISITED;
+        component[i] = UNVISITED;
+    }
+
+    for (size_t root = 0; root != n; ++root) {
+        if (index[root] != UNVISITED)
+            continue;
+
+        size_t depth = 0;
+        call[depth++] = root;
+        index[root] = lowlink[root] = next_index++;
+        next_edge[root] = start[root];
+        stack[stack_size++] = root;
+
+        while (depth != 0) {
+            size_t v = call[depth - 1];
+            if (next_edge[v] != start[v + 1]) {
+                size_t w = edges[next_edge[v]++];
+                if (index[w] == UNVISITED) {
+                    // Recurse.
+                    call[depth++] = w;
+                    index[w] = lowlink[w] = next_index++;
+                    next_edge[w] = start[w];
+                    stack[stack_size++] = w;
+                }
+                else if (component[w] == UNVISITED && index[w] < lowlink[v])
+                    // On the stack.
+                    lowlink[v] = index[w];
+                continue;
+            }
+
+            // Done with v; pop a component if v is a root.
+            if (lowlink[v] == index[v]) {
+                size_t w;
+                do {
+                    w = stack[--stack_size];
+                    component[w] = num_components;
+                }
+                while (w != v);
+                ++num_components;
+            }
+
+            // Return to the caller.
+            if (--depth != 0) {
+                size_t u = call[depth - 1];
+                if (lowlink[v] < lowlink[u])
+                    lowlink[u] = lowlink[v];
+            }
+        }
+    }
+
+    free (index);
+    free (lowlink);
+    free (stack);
+    free (call);
+    free (next_edge);
+
+    return num_components;
+}
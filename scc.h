@@ -0,0 +1,15 @@
+#ifndef SCC_H
+#define SCC_H
+
+#include <stddef.h>
+
+/// Find the strongly connected components of a digraph on nodes 0 .. @c n-1.
+/// The edges out of node @c i are @c edges[start[i]] to
+/// @c edges[start[i+1]-1].  Set @c component[i] for each node, and return the
+/// number of components.  Components are numbered in reverse topological
+/// order; every edge goes from a component to itself or to a lower numbered
+/// component.
+size_t scc_find (size_t n, const size_t * start, const size_t * edges,
+                 size_t * component);
+
+#endif
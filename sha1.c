@@ -0,0 +1,148 @@
+#include "sha1.h"
+
+#include <string.h>
+
+static inline uint32_t rol (uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+
+static void sha1_block (sha1_t * s, const unsigned char * p)
+{
+    uint32_t w[80];
+    for (int i = 0; i != 16; ++i)
+        w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16
+            | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i != 80; ++i)
+        w[i] = rol (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = s->h[0];
+    uint32_t b = s->h[1];
+    uint32_t c = s->h[2];
+    uint32_t d = s->h[3];
+    uint32_t e = s->h[4];
+    for (int i = 0; i != 80; ++i) {
+        uint32_t f;
+        uint32_t k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = rol (a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol (b, 30);
+        b = a;
+        a = t;
+    }
+
+    s->h[0] += a;
+    s->h[1] += b;
+    s->h[2] += c;
+    s->h[3] += d;
+    s->h[4] += e;
+}
+
+
+void sha1_init (sha1_t * s)
+{
+    s->h[0] = 0x67452301;
+    s->h[1] = 0xefcdab89;
+    s->h[2] = 0x98badcfe;
+    s->h[3] = 0x10325476;
+    s->h[4] = 0xc3d2e1f0;
+    s->length = 0;
+}
+
+
+void sha1_update (sha1_t * s, const void * data, size_t len)
+{
+    const unsigned char * p = data;
+    size_t used = s->length % 64;
+    s->length += len;
+
+    if (used != 0) {
+        size_t fill = 64 - used;
+        if (len < fill) {
+            memcpy (s->block + used, p, len);
+            return;
+        }
+        memcpy (s->block + used, p, fill);
+        sha1_block (s, s->block);
+        p += fill;
+        len -= fill;
+    }
+
+    for (; len >= 64; p += 64, len -= 64)
+        sha1_block (s, p);
+
+    memcpy (s->block, p, len);
+}
+
+
+void sha1_final (sha1_t * s, unsigned char digest[20])
+{
+    uint64_t bits = s->length * 8;
+    static const unsigned char pad[64] = { 0x80 };
+    size_t used = s->length % 64;
+    sha1_update (s, pad, used < 56 ? 56 - used : 120 - used);
+
+    unsigned char length[8];
+    for (int i = 0; i != 8; ++i)
+        length[i] = bits >> (56 - 8 * i);
+    sha1_update (s, length, 8);
+
+    for (int i = 0; i != 20; ++i)
+        digest[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+
+void sha1_hex (const unsigned char digest[20], char hex[41])
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i != 20; ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 15];
+    }
+    hex[40] = 0;
+}
+
+
+static int hex_digit (char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+
+bool sha1_parse (const char * hex, unsigned char digest[20])
+{
+    for (int i = 0; i != 20; ++i) {
+        int hi = hex_digit (hex[2 * i]);
+        if (hi < 0)
+            return false;
+        int lo = hex_digit (hex[2 * i + 1]);
+        if (lo < 0)
+            return false;
+        digest[i] = hi << 4 | lo;
+    }
+    return true;
+}
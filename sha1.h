@@ -0,0 +1,28 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// The state of a SHA-1 computation.
+typedef struct sha1 {
+    uint32_t h[5];
+    uint64_t length;                    ///< Bytes hashed so far.
+    unsigned char block[64];            ///< Partial block.
+} sha1_t;
+
+void sha1_init (sha1_t * s);
+
+void sha1_update (sha1_t * s, const void * data, size_t len);
+
+/// Finish the computation and store the 20 byte digest in @c digest.
+void sha1_final (sha1_t * s, unsigned char digest[20]);
+
+/// Format a digest as 40 hex digits plus a terminating nul.
+void sha1_hex (const unsigned char digest[20], char hex[41]);
+
+/// Parse 40 hex digits; returns false if @c hex is malformed.
+bool sha1_parse (const char * hex, unsigned char digest[20]);
+
+#endif